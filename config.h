@@ -1,45 +1,97 @@
 #pragma once
+#include "pagecache/constant.h"
 #include "pagecache/def_types.h"
+#include "result.h"
+#include "db.h"
 #include <atomic>
 #include <cstdint>
 #include <memory>
 #include <string>
 
+// 运行模式, 通过 Inner::apply_mode 调整一组相关的配置, 之后仍然可以单独修改其中的任何一项
+//   Default:        不套用预设, 各字段保持 Inner 中的默认值; 没有调用过 apply_mode 时就是这个模式
+//   LowSpace:       归档数据. 小segment, 开启压缩, 积极清理, heap释放时立即打洞
+//   HighThroughput: 热数据写入. 大segment(即更大的IoBuf), 较长的刷盘窗口, 懒惰清理, 多个写线程和多个lane
 enum Mode {
+  Default,
   LowSpace,
   HighThroughput,
 };
 
-enum Error {
-
-};
 struct Inner {
-   size_t cache_capacity;
+   size_t cache_capacity = 1024 * 1024 * 1024; // 1GB
   
-   uint64_t flush_every_ms;
+   uint64_t flush_every_ms = 500; // 0 表示不做定时刷盘
   
-   size_t segment_size;
+   size_t segment_size = 512 * 1024; // 512KB
   
    std::string path;
   
-   bool create_new;
-   Mode mode;
-   bool temporary;
-   bool use_compression;
+   bool create_new = false;
+   Mode mode = Default;
+   bool temporary = false;
+   bool use_compression = false;
+
+   bool use_io_uring = true; // 不可用时自动退回 pread/pwrite
+
+   bool use_direct_io = false; // 以O_DIRECT打开日志, 文件系统不支持时自动退回
+
+   bool use_mmap_reads = false; // 缺页时已经落盘的inline fragment从内存映射中读取, 适合内存充足的机器
   
-   uint32_t compression_factor;
+   uint32_t compression_factor = 5;
   
-   uint64_t idgen_persist_interval;
+   uint64_t idgen_persist_interval = 1000000;
   
-   uint64_t snapshot_after_ops;
+   uint64_t snapshot_after_ops = 1000000;
+
+   uint64_t cleaner_interval_ms = 200; // 0 表示不做后台清理
+
+   uint64_t cleaner_bytes_per_sec = 32 * 1024 * 1024; // 清理重写的速率上限, 0 表示不限速
+
+   size_t cleanup_threshold = SEGMENT_CLEANUP_THRESHOLD; // 活页面比例低于这个百分比的segment才会被清理
+
+   bool heap_punch_on_free = true; // false 时heap槽位释放时不打洞, 空间留给后续分配, 重启时统一打洞
+
+   size_t io_writers = 1; // 把冻结的IoBuf写入文件的线程数
+
+   size_t log_lanes = 1; // 独立追加的IoBuf环个数, 页面按pid分到其中一个; 适合写入密集而不频繁落盘的场景
   
   std::pair<int,int> version; // for mvcc ?? 
   std::string tmp_path;
   // (crate) global_error: Arc<Atomic<Error>>,
   std::shared_ptr<std::atomic<Error>> global_error;
 
-  Inner(const Inner &another) {
-    
+  Inner() = default;
+  Inner(const Inner &another) = default;
+
+  void apply_mode(Mode m) {
+    mode = m;
+    switch (m) {
+    case Default: // 不套用预设, 保留当前的配置
+      break;
+    case LowSpace:
+      segment_size = 256 * 1024;
+      flush_every_ms = 500;
+      use_compression = true;
+      cleanup_threshold = 80;
+      cleaner_interval_ms = 50;
+      cleaner_bytes_per_sec = 64 * 1024 * 1024;
+      heap_punch_on_free = true;
+      io_writers = 1;
+      log_lanes = 1;
+      break;
+    case HighThroughput:
+      segment_size = 8 * 1024 * 1024;
+      flush_every_ms = 2000;
+      use_compression = false;
+      cleanup_threshold = 20;
+      cleaner_interval_ms = 1000;
+      cleaner_bytes_per_sec = 8 * 1024 * 1024;
+      heap_punch_on_free = false;
+      io_writers = 4;
+      log_lanes = 4;
+      break;
+    }
   }
 };
 
@@ -47,16 +99,21 @@ class Config {
   std::shared_ptr<Inner> inner_;
 
   bool validate() const {
-    return inner_
+    return inner_ != nullptr;
   }
 public:
-  Config(const char *path) {
+  Config(const char *path, Mode mode = LowSpace) {
     inner_ = std::make_shared<Inner>();
     inner_->path = std::string(path);
+    inner_->apply_mode(mode);
   }
 
   Db *open() {
+    return nullptr;
+  }
 
+  const Inner &inner() const {
+    return *inner_;
   }
 };
 
@@ -254,6 +254,12 @@ public:
     return slots_[thread_id].is_protected();
   }
 
+  /**
+   * Current epoch without bumping it. Something retired after an unlink can be tagged with this
+   * and becomes safe after any later bump, so many retirements can share one bump.
+   */
+  inline epoch_counter_t current_epoch() const { return epoch_().load(std::memory_order_seq_cst); }
+
   /**
    * Bump epoch version and get previous one for reclaim.
    * @return Epoch for reclaim.
@@ -10,6 +10,8 @@
 
 using Header = u64;
 constexpr Header MAX_WRITERS = 127;
+// offset 只有24位, 单个IoBuf的容量不能超过这个值
+constexpr size_t MAX_HEADER_OFFSET = (1ull << 24) - 1;
 
 
 struct HeaderUtil {
@@ -18,7 +20,7 @@ struct HeaderUtil {
   }
 
   inline static Header mk_maxed(Header v) {
-    return v | (1ull < 32);
+    return v | (1ull << 32);
   }
 
   inline static bool is_sealed(Header v) {
@@ -26,7 +28,7 @@ struct HeaderUtil {
   }
 
   inline static Header mk_sealed(Header v) {
-    return v | (1ull < 31);
+    return v | (1ull << 31);
   }
 
   inline static Header n_writers(Header v) {
@@ -43,13 +45,18 @@ struct HeaderUtil {
     return v - (1ull << 24);
   }
 
+  inline static size_t offset(Header v) {
+    return static_cast<size_t>(v & 0xFFFFFF);
+  }
+
   inline static Header bump_offset(Header v, size_t by) {
     assert((by >> 24) == 0);
     return v + (Header)by;
   }
 
+  // 递增salt, 同时清空 maxed/sealed/n_writers/offset
   inline static Header bump_salt(Header v) {
-    return (v + (1ull << 33)) & 0xFFFFFFFD00000000;
+    return (v + (1ull << 33)) & 0xFFFFFFFE00000000;
   }
   
   inline static Header salt(Header v) {
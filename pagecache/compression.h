@@ -0,0 +1,330 @@
+#pragma once
+
+/*
+页面压缩 (use_compression)
+
+压缩过的页面在消息头(heap中是槽位头部)里带有MSG_FLAG_COMPRESSED, 负载的格式:
+
+  [raw_len: 4][dict_id: 1][raw deflate 数据]
+
+没有压缩的页面原样写入, 读取时看到flags为0就直接使用, 没有任何额外开销.
+压缩之后省不到1/8的页面不压缩.
+
+压缩级别取自compression_factor (1-9). 每个线程有自己的deflate/inflate上下文和输出缓冲区,
+只在第一次使用时分配, 之后每次reset复用.
+
+小页面各自压缩效果很差, 先采样一批写入的小页面, 从中挑出重复片段最多的样本拼成一个预置字典
+(deflate的历史窗口), 之后的小页面用这个字典压缩. 采样满了之后在后台线程训练字典并写出,
+写入的线程不等待, 训练完成之前的小页面继续不用字典压缩. 字典写进 path + ".dict.<id>", 一旦写出就不再修改,
+重启时全部读回, 旧的页面仍然可以用它们写入时的字典解压. 没有path时不训练字典.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "io_unix.h"
+#include "../util/common_def.h"
+#include "../3rd/log/tlog.h"
+
+constexpr size_t COMPRESSION_FRAME_HEADER = 5;
+constexpr size_t COMPRESSION_MIN_LEN = 64;        // 更小的页面不压缩
+constexpr size_t COMPRESSION_DICT_VALUE_MAX = 4096; // 不超过这个大小的页面使用字典
+constexpr size_t COMPRESSION_DICT_SIZE = 8 * 1024;
+constexpr size_t COMPRESSION_DICT_SAMPLES = 256;
+constexpr size_t COMPRESSION_MAX_DICTS = 256; // dict_id 是一个字节, 0 表示没有字典
+
+class PageCompressor final {
+  NO_COPY_MOVE(PageCompressor);
+
+  // 线程本地的zlib上下文, 只在第一次使用时分配
+  struct Contexts {
+    z_stream deflater;
+    z_stream inflater;
+    bool deflater_ready = false;
+    bool inflater_ready = false;
+    int level = 0;
+    std::vector<unsigned char> out;
+
+    ~Contexts() {
+      if (deflater_ready) {
+        deflateEnd(&deflater);
+      }
+      if (inflater_ready) {
+        inflateEnd(&inflater);
+      }
+    }
+
+    z_stream &deflate_stream(int want_level) {
+      if (!deflater_ready) {
+        std::memset(&deflater, 0, sizeof(deflater));
+        // 负的windowBits: 不带zlib头和adler32, 完整性由消息的crc保证
+        if (deflateInit2(&deflater, want_level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+          throw std::bad_alloc();
+        }
+        deflater_ready = true;
+        level = want_level;
+      } else {
+        deflateReset(&deflater);
+        if (level != want_level) {
+          deflateParams(&deflater, want_level, Z_DEFAULT_STRATEGY);
+          level = want_level;
+        }
+      }
+      return deflater;
+    }
+
+    z_stream &inflate_stream() {
+      if (!inflater_ready) {
+        std::memset(&inflater, 0, sizeof(inflater));
+        if (inflateInit2(&inflater, -15) != Z_OK) {
+          throw std::bad_alloc();
+        }
+        inflater_ready = true;
+      } else {
+        inflateReset(&inflater);
+      }
+      return inflater;
+    }
+  };
+
+  static Contexts &contexts() {
+    static thread_local Contexts ctx;
+    return ctx;
+  }
+
+  int level_;
+  std::string dict_prefix_;
+  std::atomic<const std::vector<unsigned char> *> dicts_[COMPRESSION_MAX_DICTS];
+  std::atomic<uint8_t> current_dict_;
+  std::atomic<bool> sampling_;
+
+  std::mutex mu_; // 保护采样和字典的安装, 不在其中训练或者写文件
+  std::vector<std::unique_ptr<std::vector<unsigned char>>> owned_dicts_;
+  std::vector<std::vector<unsigned char>> samples_;
+  std::thread trainer_;
+
+  std::string dict_path(size_t id) const {
+    return dict_prefix_ + "." + std::to_string(id);
+  }
+
+  void load_dicts() {
+    for (size_t id = 1; id < COMPRESSION_MAX_DICTS; ++id) {
+      int fd = ::open(dict_path(id).c_str(), O_RDONLY);
+      if (fd < 0) {
+        break;
+      }
+      auto dict = std::make_unique<std::vector<unsigned char>>(COMPRESSION_DICT_SIZE);
+      size_t n = pread_exact(fd, dict->data(), dict->size(), 0);
+      ::close(fd);
+      dict->resize(n);
+      dicts_[id].store(dict.get(), std::memory_order_release);
+      owned_dicts_.push_back(std::move(dict));
+      current_dict_.store(static_cast<uint8_t>(id), std::memory_order_release);
+    }
+  }
+
+  // 按8字节片段在样本之间出现的次数给样本打分, 最好的样本放在字典末尾(离被压缩的数据最近)
+  static std::vector<unsigned char> train(const std::vector<std::vector<unsigned char>> &samples) {
+    auto shingle = [](const unsigned char *p) {
+      uint64_t v;
+      std::memcpy(&v, p, 8);
+      return v;
+    };
+    std::unordered_map<uint64_t, uint32_t> counts;
+    for (auto &sample : samples) {
+      for (size_t i = 0; i + 8 <= sample.size(); i += 4) {
+        counts[shingle(sample.data() + i)] += 1;
+      }
+    }
+    std::vector<std::pair<double, size_t>> scored;
+    for (size_t s = 0; s < samples.size(); ++s) {
+      auto &sample = samples[s];
+      double score = 0;
+      for (size_t i = 0; i + 8 <= sample.size(); i += 4) {
+        score += counts[shingle(sample.data() + i)] - 1;
+      }
+      scored.emplace_back(score / static_cast<double>(sample.size() + 1), s);
+    }
+    std::sort(scored.begin(), scored.end(), [](auto &a, auto &b) { return a.first > b.first; });
+    std::vector<const std::vector<unsigned char> *> picked;
+    size_t total = 0;
+    for (auto &entry : scored) {
+      auto &sample = samples[entry.second];
+      if (total + sample.size() > COMPRESSION_DICT_SIZE) {
+        continue;
+      }
+      picked.push_back(&sample);
+      total += sample.size();
+    }
+    std::vector<unsigned char> dict;
+    dict.reserve(total);
+    for (auto it = picked.rbegin(); it != picked.rend(); ++it) {
+      dict.insert(dict.end(), (*it)->begin(), (*it)->end());
+    }
+    return dict;
+  }
+
+  // 先写临时文件再rename, 崩溃之后不会留下半个字典
+  void persist_dict(size_t id, const std::vector<unsigned char> &dict) {
+    std::string tmp = dict_path(id) + ".tmp";
+    int fd = ::open(tmp.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + tmp);
+    }
+    try {
+      pwrite_all(fd, dict.data(), dict.size(), 0);
+      fsync_fd(fd);
+    } catch (...) {
+      ::close(fd);
+      ::unlink(tmp.c_str());
+      throw;
+    }
+    ::close(fd);
+    if (::rename(tmp.c_str(), dict_path(id).c_str()) != 0) {
+      int err = errno;
+      ::unlink(tmp.c_str());
+      throw std::system_error(err, std::generic_category(), "rename dictionary");
+    }
+    fsync_parent_dir(dict_path(id));
+  }
+
+  // 在后台线程中运行, id 在开始训练时已经确定
+  void train_and_install(size_t id, std::vector<std::vector<unsigned char>> samples) {
+    auto dict = std::make_unique<std::vector<unsigned char>>(train(samples));
+    std::vector<std::vector<unsigned char>>().swap(samples);
+    try {
+      persist_dict(id, *dict);
+    } catch (const std::system_error &e) {
+      tlog_warn << "failed to persist compression dictionary: " << e.what();
+      return;
+    }
+    std::scoped_lock<std::mutex> lock(mu_);
+    dicts_[id].store(dict.get(), std::memory_order_release);
+    owned_dicts_.push_back(std::move(dict));
+    current_dict_.store(static_cast<uint8_t>(id), std::memory_order_release);
+    tlog_info << "trained compression dictionary " << id << " from " << COMPRESSION_DICT_SAMPLES << " pages";
+  }
+
+  void sample(const unsigned char *data, size_t len) {
+    std::scoped_lock<std::mutex> lock(mu_);
+    if (!sampling_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    samples_.emplace_back(data, data + len);
+    if (samples_.size() < COMPRESSION_DICT_SAMPLES) {
+      return;
+    }
+    sampling_.store(false, std::memory_order_release);
+    size_t id = owned_dicts_.size() + 1;
+    trainer_ = std::thread([this, id, samples = std::move(samples_)]() mutable {
+      train_and_install(id, std::move(samples));
+    });
+    samples_.clear();
+  }
+
+public:
+  // dict_prefix 为空时不训练字典
+  PageCompressor(uint32_t compression_factor, std::string dict_prefix)
+      : level_(static_cast<int>(std::clamp<uint32_t>(compression_factor, 1, 9))), dict_prefix_(std::move(dict_prefix)),
+        current_dict_(0), sampling_(false) {
+    for (auto &dict : dicts_) {
+      dict.store(nullptr, std::memory_order_relaxed);
+    }
+    if (!dict_prefix_.empty()) {
+      load_dicts();
+      sampling_.store(owned_dicts_.empty(), std::memory_order_relaxed);
+    }
+  }
+
+  ~PageCompressor() {
+    if (trainer_.joinable()) {
+      trainer_.join();
+    }
+  }
+
+  // 值得压缩时返回压缩后的帧, 指向线程本地的缓冲区, 同一个线程下一次调用之前有效; 否则返回nullptr
+  const std::vector<unsigned char> *compress(const unsigned char *data, size_t len) {
+    if (len < COMPRESSION_MIN_LEN || len > UINT32_MAX) {
+      return nullptr;
+    }
+    bool small = len <= COMPRESSION_DICT_VALUE_MAX;
+    if (small && sampling_.load(std::memory_order_acquire)) {
+      sample(data, len);
+    }
+    uint8_t dict_id = small ? current_dict_.load(std::memory_order_acquire) : 0;
+
+    Contexts &ctx = contexts();
+    z_stream &zs = ctx.deflate_stream(level_);
+    if (dict_id != 0) {
+      auto *dict = dicts_[dict_id].load(std::memory_order_acquire);
+      deflateSetDictionary(&zs, dict->data(), static_cast<uInt>(dict->size()));
+    }
+    size_t limit = len - len / 8;
+    ctx.out.resize(COMPRESSION_FRAME_HEADER + deflateBound(&zs, static_cast<uLong>(len)));
+    uint32_t raw_len = static_cast<uint32_t>(len);
+    std::memcpy(ctx.out.data(), &raw_len, 4);
+    ctx.out[4] = dict_id;
+    zs.next_in = const_cast<unsigned char *>(data);
+    zs.avail_in = static_cast<uInt>(len);
+    zs.next_out = ctx.out.data() + COMPRESSION_FRAME_HEADER;
+    zs.avail_out = static_cast<uInt>(ctx.out.size() - COMPRESSION_FRAME_HEADER);
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+      return nullptr;
+    }
+    size_t n = COMPRESSION_FRAME_HEADER + zs.total_out;
+    if (n >= limit) {
+      return nullptr;
+    }
+    ctx.out.resize(n);
+    return &ctx.out;
+  }
+
+  std::vector<unsigned char> decompress(const unsigned char *frame, size_t len) const {
+    if (len < COMPRESSION_FRAME_HEADER) {
+      throw std::runtime_error("truncated compressed page");
+    }
+    uint32_t raw_len;
+    std::memcpy(&raw_len, frame, 4);
+    uint8_t dict_id = frame[4];
+    std::vector<unsigned char> raw(raw_len);
+    z_stream &zs = contexts().inflate_stream();
+    zs.next_in = const_cast<unsigned char *>(frame + COMPRESSION_FRAME_HEADER);
+    zs.avail_in = static_cast<uInt>(len - COMPRESSION_FRAME_HEADER);
+    zs.next_out = raw.data();
+    zs.avail_out = raw_len;
+    int ret;
+    if (dict_id != 0) {
+      auto *dict = dicts_[dict_id].load(std::memory_order_acquire);
+      if (dict == nullptr) {
+        throw std::runtime_error("compression dictionary " + std::to_string(dict_id) + " is missing");
+      }
+      // raw deflate 可以在开始解压之前设置字典
+      inflateSetDictionary(&zs, dict->data(), static_cast<uInt>(dict->size()));
+    }
+    ret = inflate(&zs, Z_FINISH);
+    if (ret != Z_STREAM_END || zs.total_out != raw_len) {
+      throw std::runtime_error("corrupted compressed page");
+    }
+    return raw;
+  }
+
+  // 当前用于小页面的字典, 0 表示还没有
+  uint8_t dict_id() const {
+    return current_dict_.load(std::memory_order_acquire);
+  }
+};
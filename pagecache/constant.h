@@ -5,6 +5,12 @@
 // 
 const size_t MAX_MSG_HEADER_LEN = 32;
 
+// crc32(4) + kind(1) + pad(3) + len(4) + pid(8) + segment_lsn(8)
+const size_t MSG_HEADER_LEN = 28;
+
+// O_DIRECT 要求的对齐粒度, AlignedBuf 的8KB对齐满足这个要求
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
 // Log header length
 const uint32_t SEG_HEADER_LEN = 20;
 
@@ -15,10 +21,17 @@ const PageId META_PID = 0;
 
 const PageId COUNTER_PID = 1;
 
+// generate_id 每个线程一次从全局计数器租用的id个数
+const uint64_t IDGEN_BLOCK = 1024;
+
 const PageId BATCH_MANIFEST_PID = UINT64_MAX - 666;
 
 
 const size_t PAGE_CONSOLIDATION_THRESHOLD = 10;
+
+// 树节点超过这个大小时分裂, 小于TREE_NODE_MERGE_BYTES的leaf并入左兄弟
+const size_t TREE_NODE_SPLIT_BYTES = 4096;
+const size_t TREE_NODE_MERGE_BYTES = 1024;
 const size_t SEGMENT_CLEANUP_THRESHOLD = 50;
 
 
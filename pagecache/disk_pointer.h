@@ -1,14 +1,17 @@
 #pragma once
+#include <cstring>
+
 #include "def_types.h"
 #include "heap.h"
 
-// 首先完成只支持inline 形式的外存储日志结构
+// 页面在磁盘上的位置
+// inline: 数据就在日志的offset处
+// blob:   日志的offset处只记录了HeapId, 数据在heap中. offset仍然有效, segment的活页面统计依赖它
 struct DiskPtr {
   bool inline_flag = false; // whether heap allocation
-  union {
-    LogOffset offset; // used for non-heap allocation
-    HeapId heap_id; // used for heap allocation
-  };
+  LogOffset offset = 0;     // 日志消息的位置, 两种形式都有
+  HeapId heap_id {0, 0};    // used for heap allocation
+
   static DiskPtr new_inline(LogOffset offset) {
     DiskPtr ptr;
     ptr.inline_flag = true;
@@ -16,18 +19,38 @@ struct DiskPtr {
     return ptr;
   }
 
+  static DiskPtr new_blob(LogOffset offset, HeapId heap_id) {
+    DiskPtr ptr;
+    ptr.inline_flag = false;
+    ptr.offset = offset;
+    ptr.heap_id = heap_id;
+    return ptr;
+  }
+
   bool is_inline() const {
     return inline_flag;
   }
 
+  bool is_blob() const {
+    return !inline_flag;
+  }
+
   LogOffset lid() const {
-    if (inline_flag) {
-      return offset;
-    } else {
-      return heap_id.location;
-    }
+    return offset;
   }
 };
 
+// blob消息的负载: location(8) + original_lsn(8)
+constexpr size_t HEAP_ID_LEN = 16;
 
+inline void encode_heap_id(const HeapId &heap_id, unsigned char *buf) {
+  std::memcpy(buf, &heap_id.location, 8);
+  std::memcpy(buf + 8, &heap_id.original_lsn, 8);
+}
 
+inline HeapId decode_heap_id(const unsigned char *buf) {
+  HeapId heap_id;
+  std::memcpy(&heap_id.location, buf, 8);
+  std::memcpy(&heap_id.original_lsn, buf + 8, 8);
+  return heap_id;
+}
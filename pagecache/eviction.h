@@ -0,0 +1,228 @@
+#pragma once
+
+/*
+页面缓存的淘汰策略: 按PageId分片的S3-FIFO, 总量不超过cache_capacity字节
+
+每个分片有三个队列:
+  small: 新进入缓存的页面, 约占分片容量的10%
+  main:  在small中被再次访问过的页面
+  ghost: 从small中直接淘汰的pid (只有pid, 没有数据), 再次进入缓存时直接放进main
+只被访问一次的页面(例如范围扫描)在small中就被淘汰, 不会冲掉main中的热点页面.
+main按CLOCK的方式淘汰: 访问计数不为0的页面减一放回队尾.
+
+读路径不加锁: 访问只写进分片的一个有损环形缓冲区, 缓冲区写满时try_lock批量应用,
+抢不到锁或者被覆盖的访问记录直接丢掉, 只影响淘汰的精度.
+写路径(insert/erase/evict)持有分片锁.
+
+淘汰器只做记账, 选出来的页面由PageCache负责把内存中的数据丢掉.
+*/
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "def_types.h"
+#include "../util/common_def.h"
+
+constexpr size_t EVICTION_SHARD_BITS = 6;
+constexpr size_t EVICTION_SHARDS = size_t(1) << EVICTION_SHARD_BITS;
+constexpr size_t EVICTION_READ_BUFFER = 64; // 必须是2的幂
+constexpr uint8_t EVICTION_MAX_FREQ = 3;
+
+class PageEvictor final {
+  NO_COPY_MOVE(PageEvictor);
+
+  struct Entry {
+    size_t size;
+    uint8_t freq;
+    bool in_main;
+    std::list<PageId>::iterator pos;
+  };
+
+  struct alignas(CACHE_LINE_FETCH_ALIGN) Shard {
+    std::mutex mu;
+    std::unordered_map<PageId, Entry> entries;
+    std::list<PageId> small;
+    std::list<PageId> main;
+    std::deque<PageId> ghost_order;
+    std::unordered_set<PageId> ghost;
+    size_t small_bytes = 0;
+    size_t main_bytes = 0;
+
+    // 有损的访问记录, 0表示空, 否则是pid + 1
+    std::atomic<uint64_t> read_tail {0};
+    std::atomic<PageId> reads[EVICTION_READ_BUFFER];
+
+    Shard() {
+      for (auto &read : reads) {
+        read.store(0, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  size_t shard_capacity_;
+  std::unique_ptr<Shard[]> shards_;
+  std::atomic<size_t> total_bytes_;
+
+  static size_t shard_index(PageId pid) {
+    // 相邻的pid分到不同的分片
+    uint64_t h = pid * 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t>(h >> (64 - EVICTION_SHARD_BITS));
+  }
+
+  // 持有分片锁
+  static void drain_reads_locked(Shard &shard) {
+    for (auto &read : shard.reads) {
+      PageId tagged = read.exchange(0, std::memory_order_acq_rel);
+      if (tagged == 0) {
+        continue;
+      }
+      auto it = shard.entries.find(tagged - 1);
+      if (it != shard.entries.end() && it->second.freq < EVICTION_MAX_FREQ) {
+        it->second.freq += 1;
+      }
+    }
+  }
+
+  void remove_locked(Shard &shard, std::unordered_map<PageId, Entry>::iterator it) {
+    Entry &entry = it->second;
+    if (entry.in_main) {
+      shard.main.erase(entry.pos);
+      shard.main_bytes -= entry.size;
+    } else {
+      shard.small.erase(entry.pos);
+      shard.small_bytes -= entry.size;
+    }
+    total_bytes_.fetch_sub(entry.size, std::memory_order_relaxed);
+    shard.entries.erase(it);
+  }
+
+  void remember_ghost_locked(Shard &shard, PageId pid) {
+    if (shard.ghost.insert(pid).second) {
+      shard.ghost_order.push_back(pid);
+    }
+    // ghost 记住的pid数量不超过main中的页面数
+    size_t limit = std::max<size_t>(shard.main.size(), 64);
+    while (shard.ghost_order.size() > limit) {
+      shard.ghost.erase(shard.ghost_order.front());
+      shard.ghost_order.pop_front();
+    }
+  }
+
+  // small的队头: 被再次访问过的进入main, 否则淘汰并记入ghost
+  void evict_small_locked(Shard &shard, std::vector<PageId> &victims) {
+    PageId pid = shard.small.front();
+    Entry &entry = shard.entries.at(pid);
+    shard.small.pop_front();
+    shard.small_bytes -= entry.size;
+    if (entry.freq > 0) {
+      entry.freq = 0;
+      entry.in_main = true;
+      entry.pos = shard.main.insert(shard.main.end(), pid);
+      shard.main_bytes += entry.size;
+      return;
+    }
+    total_bytes_.fetch_sub(entry.size, std::memory_order_relaxed);
+    shard.entries.erase(pid);
+    remember_ghost_locked(shard, pid);
+    victims.push_back(pid);
+  }
+
+  void evict_main_locked(Shard &shard, std::vector<PageId> &victims) {
+    PageId pid = shard.main.front();
+    Entry &entry = shard.entries.at(pid);
+    shard.main.pop_front();
+    if (entry.freq > 0) {
+      entry.freq -= 1;
+      entry.pos = shard.main.insert(shard.main.end(), pid);
+      return;
+    }
+    shard.main_bytes -= entry.size;
+    total_bytes_.fetch_sub(entry.size, std::memory_order_relaxed);
+    shard.entries.erase(pid);
+    victims.push_back(pid);
+  }
+
+public:
+  explicit PageEvictor(size_t capacity)
+      : shard_capacity_(std::max<size_t>(capacity / EVICTION_SHARDS, 1)), shards_(new Shard[EVICTION_SHARDS]),
+        total_bytes_(0) {}
+
+  // 读路径: 记录一次访问, 不加锁
+  void accessed(PageId pid) {
+    Shard &shard = shards_[shard_index(pid)];
+    uint64_t at = shard.read_tail.fetch_add(1, std::memory_order_relaxed);
+    shard.reads[at & (EVICTION_READ_BUFFER - 1)].store(pid + 1, std::memory_order_release);
+    if ((at & (EVICTION_READ_BUFFER - 1)) == EVICTION_READ_BUFFER - 1 && shard.mu.try_lock()) {
+      drain_reads_locked(shard);
+      shard.mu.unlock();
+    }
+  }
+
+  // 页面进入缓存, 或者在缓存中的大小变了
+  void insert(PageId pid, size_t size) {
+    Shard &shard = shards_[shard_index(pid)];
+    std::scoped_lock<std::mutex> lock(shard.mu);
+    drain_reads_locked(shard);
+    auto it = shard.entries.find(pid);
+    if (it != shard.entries.end()) {
+      Entry &entry = it->second;
+      (entry.in_main ? shard.main_bytes : shard.small_bytes) += size - entry.size;
+      total_bytes_.fetch_add(size - entry.size, std::memory_order_relaxed);
+      entry.size = size;
+      return;
+    }
+    Entry entry {size, 0, shard.ghost.erase(pid) > 0, {}};
+    if (entry.in_main) {
+      entry.pos = shard.main.insert(shard.main.end(), pid);
+      shard.main_bytes += size;
+    } else {
+      entry.pos = shard.small.insert(shard.small.end(), pid);
+      shard.small_bytes += size;
+    }
+    shard.entries.emplace(pid, entry);
+    total_bytes_.fetch_add(size, std::memory_order_relaxed);
+  }
+
+  // 页面不在内存中了(被释放, 或者由调用者丢掉了数据)
+  void erase(PageId pid) {
+    Shard &shard = shards_[shard_index(pid)];
+    std::scoped_lock<std::mutex> lock(shard.mu);
+    auto it = shard.entries.find(pid);
+    if (it != shard.entries.end()) {
+      remove_locked(shard, it);
+    }
+  }
+
+  // pid 所在的分片超出容量时选出要淘汰的页面, 它们已经不再被记账
+  std::vector<PageId> evict(PageId pid) {
+    std::vector<PageId> victims;
+    Shard &shard = shards_[shard_index(pid)];
+    std::scoped_lock<std::mutex> lock(shard.mu);
+    size_t small_target = shard_capacity_ / 10;
+    while (shard.small_bytes + shard.main_bytes > shard_capacity_) {
+      if (!shard.small.empty() && (shard.small_bytes > small_target || shard.main.empty())) {
+        evict_small_locked(shard, victims);
+      } else {
+        evict_main_locked(shard, victims);
+      }
+    }
+    return victims;
+  }
+
+  bool contains(PageId pid) {
+    Shard &shard = shards_[shard_index(pid)];
+    std::scoped_lock<std::mutex> lock(shard.mu);
+    return shard.entries.count(pid) > 0;
+  }
+
+  size_t size_in_bytes() const {
+    return total_bytes_.load(std::memory_order_relaxed);
+  }
+};
@@ -1,11 +1,46 @@
 #pragma once
+
+/*
+大对象堆
+
+超过一定大小的页面不写进日志, 而是写进heap, 日志中只记录16字节的HeapId.
+页面重写时不需要再复制大对象, 日志也不会被大对象撑大.
+
+每个slab class (32KB起的2的幂) 一个文件: <path>.heap.<slab_id>, 槽位 i 在文件的 i * slab_size 处.
+槽位内容: [len(8)][original_lsn(8)][crc32(4)][pad(4)][数据], 读的时候校验crc和original_lsn,
+防止读到已经被重用的槽位.
+
+写入时先fdatasync再返回HeapId, 之后日志里的blob消息落盘时heap中的数据一定已经在磁盘上.
+释放由SegmentAccountant延迟到替换它的写入稳定之后, 否则崩溃后恢复出来的旧版本可能已经被覆盖.
+
+释放的槽位马上打洞还给文件系统, 分配时优先使用低offset的槽位, 尾部的空闲槽位直接截断 (见Slab).
+*/
+
 #include "def_types.h"
 #include <tuple>
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
 #include <stdexcept>
 #include <limits>
+#include <iterator>
 #include <memory>
-#include "../util/concurrent_stack.h"
+#include <mutex>
+#include <set>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <unistd.h>
+
+#include "io_unix.h"
+#include "../util/common_def.h"
+#include "../util/pcrc.h"
 
 
 using SlabId = uint8_t;
@@ -80,3 +115,269 @@ struct HeapId {
 };
 
 
+// 槽位头部: len(8) + original_lsn(8) + crc32(4) + flags(1) + pad(3)
+constexpr size_t HEAP_ITEM_HEADER_LEN = 24;
+
+// HeapId::location 的高32位只能放下32个slab class
+constexpr size_t HEAP_SLAB_COUNT = 32;
+
+// 一个slab class的占用情况
+struct SlabStats {
+  SlabId slab_id;
+  uint64_t slot_size;
+  uint64_t slots; // 文件中的槽位数, 文件长度 = slots * slot_size
+  uint64_t used;  // 正在使用的槽位数
+};
+
+// 一个slab class的文件和槽位分配
+//
+// 空闲槽位按offset排序, 总是先分配最低的, 这样活对象向文件头部聚集, 尾部的空闲槽位可以直接截掉.
+// 中间的空闲槽位用 FALLOC_FL_PUNCH_HOLE 把空间还给文件系统, 文件系统不支持时只记录一次警告.
+// punch_on_free 为false时释放不打洞, 空闲槽位等着被重新分配, 重启时initialize统一打洞.
+// 分配本身只是在有序集合上的几次操作, 相比每次写入的fdatasync可以忽略, 所以用一把锁保护
+class Slab {
+  SlabId id_;
+  uint64_t slot_size_;
+  int fd_;
+  std::mutex mu_;
+  std::set<SlabIdx> free_; // 低offset优先
+  uint64_t tip_ = 0;       // 文件中的槽位数
+  uint64_t used_ = 0;
+  std::atomic<bool> punch_supported_;
+  bool punch_on_free_;
+
+  // 在 mu_ 之外调用: 槽位还不在free_里, 不会有人同时写它
+  void punch(uint64_t first, uint64_t count) {
+    if (count == 0 || !punch_supported_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    if (::fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, static_cast<off_t>(first * slot_size_),
+                    static_cast<off_t>(count * slot_size_)) != 0) {
+      if (errno == EOPNOTSUPP || errno == ENOSYS) {
+        punch_supported_.store(false, std::memory_order_relaxed);
+        tlog_warn << "heap slab " << static_cast<int>(id_) << " cannot punch holes, freed space is kept";
+      } else {
+        tlog_warn << "failed to punch hole in heap slab " << static_cast<int>(id_) << ": " << std::strerror(errno);
+      }
+    }
+  }
+
+  // 持有 mu_ 时调用, 截掉尾部连续的空闲槽位
+  void trim_locked() {
+    uint64_t tip = tip_;
+    while (tip > 0 && !free_.empty() && *free_.rbegin() == tip - 1) {
+      free_.erase(std::prev(free_.end()));
+      --tip;
+    }
+    if (tip == tip_) {
+      return;
+    }
+    if (::ftruncate(fd_, static_cast<off_t>(tip * slot_size_)) != 0) {
+      tlog_warn << "failed to truncate heap slab " << static_cast<int>(id_) << ": " << std::strerror(errno);
+    }
+    tip_ = tip;
+  }
+
+public:
+  Slab(SlabId id, const std::string &path, bool punch_on_free)
+      : id_(id), slot_size_(slab_id_to_size(id)), punch_supported_(true), punch_on_free_(punch_on_free) {
+    fd_ = ::open(path.c_str(), O_CREAT | O_RDWR, 0644);
+    if (fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(), "open " + path);
+    }
+  }
+
+  NO_COPY_MOVE(Slab);
+
+  ~Slab() {
+    ::close(fd_);
+  }
+
+  int fd() const { return fd_; }
+  uint64_t slot_size() const { return slot_size_; }
+
+  SlabIdx allocate() {
+    std::scoped_lock<std::mutex> lock(mu_);
+    SlabIdx idx;
+    if (!free_.empty()) {
+      idx = *free_.begin();
+      free_.erase(free_.begin());
+    } else {
+      if (tip_ > std::numeric_limits<SlabIdx>::max()) {
+        throw std::runtime_error("heap slab " + std::to_string(id_) + " is full");
+      }
+      idx = static_cast<SlabIdx>(tip_++);
+    }
+    ++used_;
+    return idx;
+  }
+
+  void free(SlabIdx idx) {
+    if (punch_on_free_) {
+      punch(idx, 1);
+    }
+    std::scoped_lock<std::mutex> lock(mu_);
+    assert(idx < tip_ && used_ > 0);
+    free_.insert(idx);
+    --used_;
+    trim_locked();
+  }
+
+  // 恢复时使用, live 已经排好序; 不在live中的槽位全部释放
+  void initialize(const std::vector<SlabIdx> &live) {
+    uint64_t tip = live.empty() ? 0 : static_cast<uint64_t>(live.back()) + 1;
+    std::set<SlabIdx> free;
+    uint64_t run_start = 0;
+    for (uint64_t idx = 0, at = 0; idx <= tip; ++idx) {
+      if (idx < tip && !(at < live.size() && live[at] == idx)) {
+        free.insert(static_cast<SlabIdx>(idx));
+        continue;
+      }
+      punch(run_start, idx - run_start); // 连续的空闲槽位一次打洞
+      run_start = idx + 1;
+      ++at;
+    }
+    std::scoped_lock<std::mutex> lock(mu_);
+    free_ = std::move(free);
+    tip_ = tip;
+    used_ = live.size();
+    if (::ftruncate(fd_, static_cast<off_t>(tip * slot_size_)) != 0) {
+      tlog_warn << "failed to truncate heap slab " << static_cast<int>(id_) << ": " << std::strerror(errno);
+    }
+  }
+
+  SlabStats stats() {
+    std::scoped_lock<std::mutex> lock(mu_);
+    return SlabStats {id_, slot_size_, tip_, used_};
+  }
+};
+
+class Heap {
+  std::string path_;
+  bool punch_on_free_;
+  std::mutex open_mu_;
+  std::array<std::unique_ptr<Slab>, HEAP_SLAB_COUNT> slabs_;
+  std::array<std::atomic<Slab *>, HEAP_SLAB_COUNT> opened_;
+
+  // 文件在第一次使用时才创建
+  Slab &slab(SlabId id) {
+    if (id >= HEAP_SLAB_COUNT) {
+      throw std::invalid_argument("heap item too large");
+    }
+    Slab *slab = opened_[id].load(std::memory_order_acquire);
+    if (slab != nullptr) {
+      return *slab;
+    }
+    std::scoped_lock<std::mutex> lock(open_mu_);
+    if (!slabs_[id]) {
+      slabs_[id] = std::make_unique<Slab>(id, path_ + ".heap." + std::to_string(id), punch_on_free_);
+      opened_[id].store(slabs_[id].get(), std::memory_order_release);
+    }
+    return *slabs_[id];
+  }
+
+  // 覆盖len, original_lsn, flags和数据
+  static uint32_t item_crc(const unsigned char *header, const unsigned char *data, size_t len) {
+    Crc32c crc;
+    crc.update(header, 16).update(header + 20, 1).update(data, len);
+    return crc.finish();
+  }
+
+public:
+  explicit Heap(std::string path, bool punch_on_free = true) : path_(std::move(path)), punch_on_free_(punch_on_free) {
+    for (auto &slab : opened_) {
+      slab.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  NO_COPY_MOVE(Heap);
+
+  // 写入一个大对象, 返回时数据已经落盘. flags 原样保存, 由调用者解释(例如MSG_FLAG_COMPRESSED)
+  HeapId write(const unsigned char *data, size_t len, Lsn original_lsn, uint8_t flags = 0) {
+    SlabId id = size_to_slab_id(len + HEAP_ITEM_HEADER_LEN);
+    Slab &s = slab(id);
+    SlabIdx idx = s.allocate();
+    HeapId heap_id = HeapId::compose(id, idx, original_lsn);
+
+    std::vector<unsigned char> buf(HEAP_ITEM_HEADER_LEN + len);
+    uint64_t len64 = len;
+    std::memcpy(buf.data(), &len64, 8);
+    std::memcpy(buf.data() + 8, &original_lsn, 8);
+    buf[20] = flags;
+    uint32_t crc = item_crc(buf.data(), data, len);
+    std::memcpy(buf.data() + 16, &crc, 4);
+    std::memcpy(buf.data() + HEAP_ITEM_HEADER_LEN, data, len);
+    try {
+      pwrite_all(s.fd(), buf.data(), buf.size(), heap_id.offset());
+      if (::fdatasync(s.fd()) != 0) {
+        throw std::system_error(errno, std::generic_category(), "fdatasync heap");
+      }
+    } catch (...) {
+      s.free(idx);
+      throw;
+    }
+    return heap_id;
+  }
+
+  // 槽位已经被重用或者损坏时抛出异常
+  std::vector<unsigned char> read(HeapId heap_id, uint8_t *flags = nullptr) {
+    Slab &s = slab(std::get<0>(heap_id.decompose()));
+    std::vector<unsigned char> buf(s.slot_size());
+    size_t n = pread_exact(s.fd(), buf.data(), buf.size(), heap_id.offset());
+    uint64_t len;
+    Lsn original_lsn;
+    uint32_t crc;
+    std::memcpy(&len, buf.data(), 8);
+    std::memcpy(&original_lsn, buf.data() + 8, 8);
+    std::memcpy(&crc, buf.data() + 16, 4);
+    if (n < HEAP_ITEM_HEADER_LEN || len > n - HEAP_ITEM_HEADER_LEN || original_lsn != heap_id.original_lsn ||
+        item_crc(buf.data(), buf.data() + HEAP_ITEM_HEADER_LEN, len) != crc) {
+      throw std::runtime_error("corrupted heap item at " + std::to_string(heap_id.location));
+    }
+    if (flags != nullptr) {
+      *flags = buf[20];
+    }
+    buf.erase(buf.begin(), buf.begin() + HEAP_ITEM_HEADER_LEN);
+    buf.resize(len);
+    return buf;
+  }
+
+  // 槽位立即可以重用, 调用者负责保证旧版本已经不会再被读到 (见 SegmentAccountant)
+  void free(HeapId heap_id) {
+    auto [id, idx, _] = heap_id.decompose();
+    slab(id).free(idx);
+  }
+
+  // 已经打开的slab的占用情况
+  std::vector<SlabStats> stats() {
+    std::vector<SlabStats> result;
+    for (auto &slab : opened_) {
+      Slab *s = slab.load(std::memory_order_acquire);
+      if (s != nullptr) {
+        result.push_back(s->stats());
+      }
+    }
+    return result;
+  }
+
+  // 根据恢复出来的活对象重建空闲槽位, 只能在使用之前调用一次
+  void initialize(std::vector<HeapId> live) {
+    std::array<std::vector<SlabIdx>, HEAP_SLAB_COUNT> by_slab;
+    for (auto &heap_id : live) {
+      auto [id, idx, _] = heap_id.decompose();
+      if (id < HEAP_SLAB_COUNT) {
+        by_slab[id].push_back(idx);
+      }
+    }
+    for (SlabId id = 0; id < HEAP_SLAB_COUNT; ++id) {
+      auto &idxs = by_slab[id];
+      std::sort(idxs.begin(), idxs.end());
+      idxs.erase(std::unique(idxs.begin(), idxs.end()), idxs.end());
+      std::string file = path_ + ".heap." + std::to_string(id);
+      if (idxs.empty() && ::access(file.c_str(), F_OK) != 0) {
+        continue;
+      }
+      slab(id).initialize(idxs);
+    }
+  }
+};
@@ -1 +1,902 @@
 #pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <cassert>
+#include <cstdlib>
+#include <new>
+
+#include "constant.h"
+#include "../util/common_def.h"
+#include "../3rd/log/tlog.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+// 写满len字节, 失败时抛出 std::system_error
+inline void pwrite_all(int fd, const unsigned char *buf, size_t len, uint64_t offset) {
+  while (len > 0) {
+    ssize_t n = ::pwrite(fd, buf, len, static_cast<off_t>(offset));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "pwrite");
+    }
+    buf += n;
+    len -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+}
+
+// 读满len字节, 返回实际读到的字节数(遇到文件结尾时小于len)
+inline size_t pread_exact(int fd, unsigned char *buf, size_t len, uint64_t offset) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t n = ::pread(fd, buf + done, len - done, static_cast<off_t>(offset + done));
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "pread");
+    }
+    if (n == 0) {
+      break;
+    }
+    done += static_cast<size_t>(n);
+  }
+  return done;
+}
+
+
+inline void fsync_fd(int fd) {
+  if (::fsync(fd) != 0) {
+    throw std::system_error(errno, std::generic_category(), "fsync");
+  }
+}
+
+// rename之后fsync所在目录, 否则崩溃之后目录项可能还指向旧文件
+inline void fsync_parent_dir(const std::string &path) {
+  std::string dir = path.find('/') == std::string::npos ? "." : path.substr(0, path.rfind('/') + 1);
+  int dir_fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync_fd(dir_fd);
+    ::close(dir_fd);
+  }
+}
+
+
+// 打开日志文件, direct为true时先尝试O_DIRECT, 文件系统不支持时退回普通模式
+inline int open_log_file(const char *path, bool create, bool direct) {
+  int flags = O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0);
+#if defined(O_DIRECT)
+  if (direct) {
+    int fd = ::open(path, flags | O_DIRECT, 0644);
+    if (fd >= 0) {
+      return fd;
+    }
+    if (errno != EINVAL) {
+      throw std::system_error(errno, std::generic_category(), "open");
+    }
+  }
+#else
+  (void)direct;
+#endif
+  int fd = ::open(path, flags, 0644);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), "open");
+  }
+  return fd;
+}
+
+inline size_t align_up(size_t v, size_t align) {
+  return (v + align - 1) & ~(align - 1);
+}
+
+inline size_t align_down(size_t v, size_t align) {
+  return v & ~(align - 1);
+}
+
+
+#if defined(__linux__)
+
+// 直接基于系统调用的io_uring封装, 不依赖liburing
+// 提交和收割各用一把锁: SQ只允许单生产者, CQ由等待者轮流收割,
+// 收割到的其他请求的结果放进done_, 由对应的等待者取走.
+// 同一时刻只有一个等待者(reaping_)在io_uring_enter中阻塞, 阻塞期间不持有cq_mu_,
+// 其他等待者在cq_cv_上等它收割完成; 它在内核中时别人不收割CQ, 它等的cqe不会被先拿走
+class IoUring {
+  int ring_fd_;
+  unsigned entries_;
+
+  void *sq_ptr_;
+  size_t sq_ring_sz_;
+  void *cq_ptr_;
+  size_t cq_ring_sz_;
+  io_uring_sqe *sqes_;
+  size_t sqes_sz_;
+
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_mask_;
+  unsigned *sq_array_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned *cq_mask_;
+  io_uring_cqe *cqes_;
+
+  std::mutex sq_mu_;
+  unsigned inflight_; // 受sq_mu_保护, 不超过entries_, 保证CQ不会溢出
+  uint64_t next_ticket_;
+
+  std::mutex cq_mu_;
+  std::condition_variable cq_cv_;
+  bool reaping_; // 有等待者正在内核中等待完成, 受cq_mu_保护
+  std::unordered_map<uint64_t, int> done_;
+
+  static int sys_setup(unsigned entries, io_uring_params *p) {
+    return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+  }
+
+  static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+  }
+
+  static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+  }
+
+  template <class T> static T *at(void *base, unsigned off) {
+    return reinterpret_cast<T *>(static_cast<unsigned char *>(base) + off);
+  }
+
+  // 调用者持有cq_mu_, 返回收割到的cqe数量
+  unsigned reap_locked() {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    while (head != tail) {
+      const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+      done_[cqe.user_data] = cqe.res;
+      ++head;
+      ++reaped;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    if (reaped > 0) {
+      {
+        std::scoped_lock<std::mutex> lock(sq_mu_);
+        inflight_ -= reaped;
+      }
+      cq_cv_.notify_all();
+    }
+    return reaped;
+  }
+
+  // 调用者持有cq_mu_, 并且知道至少有一个请求还在内核中. 等到有新的cqe被收割之后返回, 调用者重新检查自己的条件.
+  // 已经有收割者时等它唤醒; 否则自己成为收割者, 在io_uring_enter中阻塞时释放cq_mu_
+  void wait_some(std::unique_lock<std::mutex> &lock) {
+    if (reaping_) {
+      cq_cv_.wait(lock);
+      return;
+    }
+    if (reap_locked() > 0) {
+      return;
+    }
+    reaping_ = true;
+    lock.unlock();
+    int ret = sys_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS);
+    int err = errno;
+    lock.lock();
+    reaping_ = false;
+    reap_locked();
+    // 没有收割到也要唤醒, 让等待者中的一个接着进入内核
+    cq_cv_.notify_all();
+    if (ret < 0 && err != EINTR) {
+      throw std::system_error(err, std::generic_category(), "io_uring_enter getevents");
+    }
+  }
+
+  void unmap() {
+    if (sqes_ != nullptr) {
+      ::munmap(sqes_, sqes_sz_);
+    }
+    if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) {
+      ::munmap(cq_ptr_, cq_ring_sz_);
+    }
+    if (sq_ptr_ != nullptr) {
+      ::munmap(sq_ptr_, sq_ring_sz_);
+    }
+  }
+
+public:
+  explicit IoUring(unsigned entries)
+      : ring_fd_(-1), entries_(0), sq_ptr_(nullptr), sq_ring_sz_(0), cq_ptr_(nullptr), cq_ring_sz_(0),
+        sqes_(nullptr), sqes_sz_(0), inflight_(0), next_ticket_(1), reaping_(false) {
+    io_uring_params p;
+    std::memset(&p, 0, sizeof(p));
+    ring_fd_ = sys_setup(entries, &p);
+    if (ring_fd_ < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+    }
+    entries_ = p.sq_entries;
+
+    sq_ring_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+      sq_ring_sz_ = cq_ring_sz_ = std::max(sq_ring_sz_, cq_ring_sz_);
+    }
+    sq_ptr_ = ::mmap(nullptr, sq_ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                     IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      sq_ptr_ = nullptr;
+      int err = errno;
+      ::close(ring_fd_);
+      throw std::system_error(err, std::generic_category(), "mmap sq ring");
+    }
+    if (single_mmap) {
+      cq_ptr_ = sq_ptr_;
+    } else {
+      cq_ptr_ = ::mmap(nullptr, cq_ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                       IORING_OFF_CQ_RING);
+      if (cq_ptr_ == MAP_FAILED) {
+        cq_ptr_ = nullptr;
+        int err = errno;
+        unmap();
+        ::close(ring_fd_);
+        throw std::system_error(err, std::generic_category(), "mmap cq ring");
+      }
+    }
+    sqes_sz_ = p.sq_entries * sizeof(io_uring_sqe);
+    void *sqes = ::mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_,
+                        IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      int err = errno;
+      unmap();
+      ::close(ring_fd_);
+      throw std::system_error(err, std::generic_category(), "mmap sqes");
+    }
+    sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+    sq_head_ = at<unsigned>(sq_ptr_, p.sq_off.head);
+    sq_tail_ = at<unsigned>(sq_ptr_, p.sq_off.tail);
+    sq_mask_ = at<unsigned>(sq_ptr_, p.sq_off.ring_mask);
+    sq_array_ = at<unsigned>(sq_ptr_, p.sq_off.array);
+    cq_head_ = at<unsigned>(cq_ptr_, p.cq_off.head);
+    cq_tail_ = at<unsigned>(cq_ptr_, p.cq_off.tail);
+    cq_mask_ = at<unsigned>(cq_ptr_, p.cq_off.ring_mask);
+    cqes_ = at<io_uring_cqe>(cq_ptr_, p.cq_off.cqes);
+  }
+
+  IoUring(const IoUring &) = delete;
+  IoUring &operator=(const IoUring &) = delete;
+
+  ~IoUring() {
+    unmap();
+    if (ring_fd_ >= 0) {
+      ::close(ring_fd_);
+    }
+  }
+
+  unsigned entries() const {
+    return entries_;
+  }
+
+  // 注册之后可以用下标代替fd (IOSQE_FIXED_FILE)
+  void register_files(const std::vector<int> &fds) {
+    if (sys_register(ring_fd_, IORING_REGISTER_FILES, fds.data(), static_cast<unsigned>(fds.size())) < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_register files");
+    }
+  }
+
+  // 注册之后可以用 READ_FIXED/WRITE_FIXED, 省去每次IO时的页面pin
+  void register_buffers(const std::vector<iovec> &iovs) {
+    if (sys_register(ring_fd_, IORING_REGISTER_BUFFERS, iovs.data(), static_cast<unsigned>(iovs.size())) < 0) {
+      throw std::system_error(errno, std::generic_category(), "io_uring_register buffers");
+    }
+  }
+
+  // fill 负责填写sqe, 返回用于wait的ticket
+  template <class Fill> uint64_t submit(Fill &&fill) {
+    return submit_batch(1, [&fill](size_t, io_uring_sqe *sqe) { fill(sqe); }).front();
+  }
+
+  // 一次io_uring_enter提交一批请求, fill(i, sqe) 填写第i个.
+  // 不超过entries()的一批等到队列有足够空位之后整批提交, 用IOSQE_IO_LINK串起来的请求不会被拆开;
+  // 更大的批次分几次提交
+  template <class Fill> std::vector<uint64_t> submit_batch(size_t count, Fill &&fill) {
+    std::vector<uint64_t> tickets;
+    tickets.reserve(count);
+    std::unique_lock<std::mutex> lock(sq_mu_);
+    while (tickets.size() < count) {
+      size_t want = std::min<size_t>(count - tickets.size(), entries_);
+      while (entries_ - inflight_ < want) {
+        // 队列已满, 帮忙收割, 避免所有线程都在提交而没有人收割.
+        // 在cq_mu_下重新检查: 只有持有cq_mu_才能收割, 检查之后在飞的请求不会被别人收走
+        lock.unlock();
+        {
+          std::unique_lock<std::mutex> cq_lock(cq_mu_);
+          bool full;
+          {
+            std::scoped_lock<std::mutex> sq_lock(sq_mu_);
+            full = entries_ - inflight_ < want;
+          }
+          if (full) {
+            wait_some(cq_lock);
+          }
+        }
+        lock.lock();
+      }
+
+      unsigned n = static_cast<unsigned>(std::min<size_t>(count - tickets.size(), entries_ - inflight_));
+      unsigned tail = *sq_tail_;
+      for (unsigned k = 0; k < n; ++k) {
+        unsigned idx = (tail + k) & *sq_mask_;
+        io_uring_sqe *sqe = &sqes_[idx];
+        std::memset(sqe, 0, sizeof(*sqe));
+        fill(tickets.size() + k, sqe);
+        sqe->user_data = next_ticket_ + k;
+        sq_array_[idx] = idx;
+      }
+      __atomic_store_n(sq_tail_, tail + n, __ATOMIC_RELEASE);
+
+      unsigned submitted = 0;
+      while (submitted < n) {
+        int ret = sys_enter(ring_fd_, n - submitted, 0, 0);
+        if (ret > 0) {
+          submitted += static_cast<unsigned>(ret);
+          continue;
+        }
+        int err = ret < 0 ? errno : EAGAIN;
+        if (err == EINTR) {
+          continue;
+        }
+        if (submitted == 0) {
+          // 回滚, 这批sqe没有被内核消费; 之前几批已经在飞, 交给调用者处理剩下的部分
+          __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+          if (tickets.empty()) {
+            throw std::system_error(err, std::generic_category(), "io_uring_enter");
+          }
+          return tickets;
+        }
+        if (err != EAGAIN && err != EBUSY) {
+          throw std::system_error(err, std::generic_category(), "io_uring_enter");
+        }
+        // 一部分已经被内核消费, 不能回滚, 等内核腾出资源之后继续提交剩下的
+        std::this_thread::yield();
+      }
+      for (unsigned k = 0; k < n; ++k) {
+        tickets.push_back(next_ticket_++);
+      }
+      inflight_ += n;
+    }
+    return tickets;
+  }
+
+  // 等待ticket完成, 返回cqe的res(负数为-errno)
+  int wait(uint64_t ticket) {
+    std::unique_lock<std::mutex> lock(cq_mu_);
+    while (true) {
+      auto it = done_.find(ticket);
+      if (it != done_.end()) {
+        int res = it->second;
+        done_.erase(it);
+        return res;
+      }
+      wait_some(lock);
+    }
+  }
+};
+
+#endif
+
+
+enum IoBackendKind {
+  IoBackendPosix,
+  IoBackendUring,
+};
+
+// 日志文件的IO入口
+// 优先使用io_uring(注册的fd和缓冲区), 内核不支持或初始化失败时退回pread/pwrite,
+// 也可以在运行时通过use_uring=false强制使用pread/pwrite
+//
+// 以O_DIRECT打开的fd要求缓冲区、长度和偏移量都按DIRECT_IO_ALIGNMENT对齐:
+// 写入方(IoBufs)负责对齐, 读取时不对齐的请求经过对齐的中转缓冲区;
+// 如果文件系统在写入时才拒绝O_DIRECT(EINVAL), 就去掉O_DIRECT继续
+class SegmentIo {
+  int fd_;
+  IoBackendKind kind_;
+  std::atomic<bool> direct_;
+#if defined(__linux__)
+  std::unique_ptr<IoUring> ring_;
+#endif
+  // 已注册缓冲区的起始地址 -> (下标, 长度)
+  std::vector<std::pair<const unsigned char *, size_t>> fixed_bufs_;
+
+  // posix 模式下异步接口同步执行, 结果暂存在这里
+  std::mutex posix_mu_;
+  std::unordered_map<uint64_t, int> posix_done_;
+  uint64_t posix_next_ticket_;
+
+  int fixed_index(const unsigned char *buf, size_t len) const {
+    for (size_t i = 0; i < fixed_bufs_.size(); ++i) {
+      const unsigned char *base = fixed_bufs_[i].first;
+      if (buf >= base && buf + len <= base + fixed_bufs_[i].second) {
+        return static_cast<int>(i);
+      }
+    }
+    return -1;
+  }
+
+  static bool is_aligned(const void *buf, size_t len, uint64_t offset) {
+    return (reinterpret_cast<uintptr_t>(buf) | len | offset) % DIRECT_IO_ALIGNMENT == 0;
+  }
+
+  // 去掉O_DIRECT, 返回是否成功
+  bool disable_direct() {
+#if defined(O_DIRECT)
+    int flags = ::fcntl(fd_, F_GETFL);
+    if (flags < 0 || ::fcntl(fd_, F_SETFL, flags & ~O_DIRECT) < 0) {
+      return false;
+    }
+    direct_.store(false, std::memory_order_release);
+    tlog_warn << "O_DIRECT rejected by the filesystem, falling back to buffered io";
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  static int check(int res, const char *what) {
+    if (res < 0) {
+      throw std::system_error(-res, std::generic_category(), what);
+    }
+    return res;
+  }
+
+public:
+  explicit SegmentIo(int fd, bool use_uring = true, unsigned queue_depth = 128)
+      : fd_(fd), kind_(IoBackendPosix), direct_(false), posix_next_ticket_(1) {
+#if defined(O_DIRECT)
+    int flags = ::fcntl(fd_, F_GETFL);
+    direct_.store(flags >= 0 && (flags & O_DIRECT) != 0, std::memory_order_relaxed);
+#endif
+#if defined(__linux__)
+    if (use_uring) {
+      try {
+        ring_ = std::make_unique<IoUring>(queue_depth);
+        ring_->register_files({fd_});
+        kind_ = IoBackendUring;
+      } catch (const std::system_error &) {
+        ring_.reset();
+      }
+    }
+#else
+    (void)use_uring;
+    (void)queue_depth;
+#endif
+  }
+
+  SegmentIo(const SegmentIo &) = delete;
+  SegmentIo &operator=(const SegmentIo &) = delete;
+
+  IoBackendKind kind() const {
+    return kind_;
+  }
+
+  int fd() const {
+    return fd_;
+  }
+
+  bool direct() const {
+    return direct_.load(std::memory_order_acquire);
+  }
+
+  // 只能在发起任何IO之前调用一次; 注册失败时这些缓冲区按普通缓冲区处理
+  void register_buffers(const std::vector<std::pair<unsigned char *, size_t>> &bufs) {
+#if defined(__linux__)
+    if (kind_ != IoBackendUring || bufs.empty()) {
+      return;
+    }
+    std::vector<iovec> iovs;
+    iovs.reserve(bufs.size());
+    for (auto &buf : bufs) {
+      iovs.push_back(iovec{buf.first, buf.second});
+    }
+    try {
+      ring_->register_buffers(iovs);
+    } catch (const std::system_error &) {
+      return;
+    }
+    for (auto &buf : bufs) {
+      fixed_bufs_.emplace_back(buf.first, buf.second);
+    }
+#else
+    (void)bufs;
+#endif
+  }
+
+  uint64_t submit_write(const unsigned char *buf, size_t len, uint64_t offset) {
+#if defined(__linux__)
+    if (kind_ == IoBackendUring) {
+      int buf_index = fixed_index(buf, len);
+      return ring_->submit([&](io_uring_sqe *sqe) {
+        sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->off = offset;
+        sqe->buf_index = buf_index >= 0 ? static_cast<uint16_t>(buf_index) : 0;
+      });
+    }
+#endif
+    ssize_t n = ::pwrite(fd_, buf, len, static_cast<off_t>(offset));
+    std::scoped_lock<std::mutex> lock(posix_mu_);
+    uint64_t ticket = posix_next_ticket_++;
+    posix_done_[ticket] = n < 0 ? -errno : static_cast<int>(n);
+    return ticket;
+  }
+
+  uint64_t submit_read(unsigned char *buf, size_t len, uint64_t offset) {
+#if defined(__linux__)
+    if (kind_ == IoBackendUring) {
+      int buf_index = fixed_index(buf, len);
+      return ring_->submit([&](io_uring_sqe *sqe) {
+        sqe->opcode = buf_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->off = offset;
+        sqe->buf_index = buf_index >= 0 ? static_cast<uint16_t>(buf_index) : 0;
+      });
+    }
+#endif
+    ssize_t n = ::pread(fd_, buf, len, static_cast<off_t>(offset));
+    std::scoped_lock<std::mutex> lock(posix_mu_);
+    uint64_t ticket = posix_next_ticket_++;
+    posix_done_[ticket] = n < 0 ? -errno : static_cast<int>(n);
+    return ticket;
+  }
+
+  // 文件中的一段连续区间, 依次读进iovs
+  struct ReadVec {
+    uint64_t offset;
+    std::vector<iovec> iovs;
+  };
+
+  static size_t iov_total(const std::vector<iovec> &iovs) {
+    size_t total = 0;
+    for (auto &iov : iovs) {
+      total += iov.iov_len;
+    }
+    return total;
+  }
+
+  // 一组区间一起读完, 任何一个没有读满(越过文件结尾)时抛出异常
+  // io_uring 下所有区间作为READV一次提交; 否则每个区间一次preadv.
+  // direct模式下iovec通常不对齐, 逐个经过read_at的中转缓冲区
+  void read_vectored(std::vector<ReadVec> &reads) {
+    if (reads.empty()) {
+      return;
+    }
+    std::vector<size_t> done(reads.size(), 0);
+    if (direct()) {
+      for (auto &read : reads) {
+        uint64_t offset = read.offset;
+        for (auto &iov : read.iovs) {
+          if (read_at(static_cast<unsigned char *>(iov.iov_base), iov.iov_len, offset) != iov.iov_len) {
+            throw std::runtime_error("vectored read beyond the end of the file");
+          }
+          offset += iov.iov_len;
+        }
+      }
+      return;
+    }
+#if defined(__linux__)
+    if (kind_ == IoBackendUring) {
+      auto tickets = ring_->submit_batch(reads.size(), [&reads](size_t i, io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_READV;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->addr = reinterpret_cast<uint64_t>(reads[i].iovs.data());
+        sqe->len = static_cast<uint32_t>(reads[i].iovs.size());
+        sqe->off = reads[i].offset;
+      });
+      std::exception_ptr error;
+      for (size_t i = 0; i < reads.size(); ++i) {
+        int n = i < tickets.size() ? ring_->wait(tickets[i]) : -EAGAIN;
+        if (n >= 0) {
+          done[i] = static_cast<size_t>(n);
+        } else if (n != -EINTR && n != -EAGAIN && !error) {
+          // 先收割完所有请求, iovec在它们完成之前必须有效
+          error = std::make_exception_ptr(std::system_error(-n, std::generic_category(), "readv"));
+        }
+      }
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+#endif
+    // posix, 或者短读之后剩下的部分
+    for (size_t i = 0; i < reads.size(); ++i) {
+      std::vector<iovec> iovs = reads[i].iovs;
+      size_t total = iov_total(iovs);
+      size_t skip = done[i];
+      size_t first = 0;
+      while (done[i] < total) {
+        for (; first < iovs.size() && skip >= iovs[first].iov_len; ++first) {
+          skip -= iovs[first].iov_len;
+        }
+        iovs[first].iov_base = static_cast<unsigned char *>(iovs[first].iov_base) + skip;
+        iovs[first].iov_len -= skip;
+        ssize_t n = ::preadv(fd_, iovs.data() + first, static_cast<int>(iovs.size() - first),
+                             static_cast<off_t>(reads[i].offset + done[i]));
+        if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+          skip = 0;
+          continue;
+        }
+        if (n < 0) {
+          throw std::system_error(errno, std::generic_category(), "preadv");
+        }
+        if (n == 0) {
+          throw std::runtime_error("vectored read beyond the end of the file");
+        }
+        done[i] += static_cast<size_t>(n);
+        skip = static_cast<size_t>(n);
+      }
+    }
+  }
+
+  uint64_t submit_fsync(bool datasync = true) {
+#if defined(__linux__)
+    if (kind_ == IoBackendUring) {
+      return ring_->submit([&](io_uring_sqe *sqe) {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->flags = IOSQE_FIXED_FILE;
+        sqe->fd = 0;
+        sqe->fsync_flags = datasync ? IORING_FSYNC_DATASYNC : 0;
+      });
+    }
+#endif
+    int ret = datasync ? ::fdatasync(fd_) : ::fsync(fd_);
+    std::scoped_lock<std::mutex> lock(posix_mu_);
+    uint64_t ticket = posix_next_ticket_++;
+    posix_done_[ticket] = ret < 0 ? -errno : 0;
+    return ticket;
+  }
+
+  // 返回请求的结果, 负数为-errno
+  int wait(uint64_t ticket) {
+#if defined(__linux__)
+    if (kind_ == IoBackendUring) {
+      return ring_->wait(ticket);
+    }
+#endif
+    std::scoped_lock<std::mutex> lock(posix_mu_);
+    auto it = posix_done_.find(ticket);
+    int res = it->second;
+    posix_done_.erase(it);
+    return res;
+  }
+
+  // 同步写满len字节, 短写时继续提交剩余部分
+  // direct模式下调用者保证buf/len/offset对齐
+  void write_at(const unsigned char *buf, size_t len, uint64_t offset) {
+    assert(!direct() || is_aligned(buf, len, offset));
+    while (len > 0) {
+      int n = wait(submit_write(buf, len, offset));
+      if (n == -EINTR || n == -EAGAIN) {
+        continue;
+      }
+      if (n == -EINVAL && direct() && disable_direct()) {
+        continue;
+      }
+      check(n, "write");
+      buf += n;
+      len -= static_cast<size_t>(n);
+      offset += static_cast<uint64_t>(n);
+    }
+  }
+
+  // 同步读满len字节, 返回实际读到的字节数(遇到文件结尾时小于len)
+  size_t read_at(unsigned char *buf, size_t len, uint64_t offset) {
+    if (direct() && !is_aligned(buf, len, offset)) {
+      return read_unaligned(buf, len, offset);
+    }
+    size_t done = 0;
+    while (done < len) {
+      if (done > 0 && direct() && !is_aligned(buf + done, len - done, offset + done)) {
+        // 短读之后剩余部分不再对齐
+        return done + read_unaligned(buf + done, len - done, offset + done);
+      }
+      int n = wait(submit_read(buf + done, len - done, offset + done));
+      if (n == -EINTR || n == -EAGAIN) {
+        continue;
+      }
+      check(n, "read");
+      if (n == 0) {
+        break;
+      }
+      done += static_cast<size_t>(n);
+    }
+    return done;
+  }
+
+  // direct模式下读取不对齐的区间: 读入覆盖它的对齐区间再拷贝出来
+  size_t read_unaligned(unsigned char *buf, size_t len, uint64_t offset) {
+    uint64_t start = align_down(offset, DIRECT_IO_ALIGNMENT);
+    size_t span = align_up(offset + len - start, DIRECT_IO_ALIGNMENT);
+    std::unique_ptr<unsigned char, decltype(&std::free)> bounce(
+        static_cast<unsigned char *>(std::aligned_alloc(DIRECT_IO_ALIGNMENT, span)), &std::free);
+    if (!bounce) {
+      throw std::bad_alloc();
+    }
+    size_t got = read_at(bounce.get(), span, start);
+    size_t skip = offset - start;
+    if (got <= skip) {
+      return 0;
+    }
+    size_t n = std::min(len, got - skip);
+    std::memcpy(buf, bounce.get() + skip, n);
+    return n;
+  }
+
+  void sync(bool datasync = true) {
+    check(wait(submit_fsync(datasync)), "fsync");
+  }
+
+  // 写满len字节并fdatasync. io_uring 下写入和用IOSQE_IO_LINK接在它后面的fsync一次提交,
+  // 只进入内核一次, fsync也不用等写入的结果回到用户态才发出; 短写或出错时退回write_at + sync
+  void write_sync(const unsigned char *buf, size_t len, uint64_t offset) {
+    assert(!direct() || is_aligned(buf, len, offset));
+#if defined(__linux__)
+    if (kind_ == IoBackendUring && len > 0 && ring_->entries() >= 2) {
+      int buf_index = fixed_index(buf, len);
+      auto tickets = ring_->submit_batch(2, [&](size_t i, io_uring_sqe *sqe) {
+        sqe->fd = 0;
+        if (i == 0) {
+          sqe->opcode = buf_index >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+          sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+          sqe->addr = reinterpret_cast<uint64_t>(buf);
+          sqe->len = static_cast<uint32_t>(len);
+          sqe->off = offset;
+          sqe->buf_index = buf_index >= 0 ? static_cast<uint16_t>(buf_index) : 0;
+        } else {
+          sqe->opcode = IORING_OP_FSYNC;
+          sqe->flags = IOSQE_FIXED_FILE;
+          sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        }
+      });
+      int written = ring_->wait(tickets[0]);
+      int synced = tickets.size() > 1 ? ring_->wait(tickets[1]) : -EAGAIN;
+      if (written == static_cast<int>(len) && synced == 0) {
+        return;
+      }
+      if (written > 0) {
+        buf += written;
+        len -= static_cast<size_t>(written);
+        offset += static_cast<uint64_t>(written);
+      }
+    }
+#endif
+    write_at(buf, len, offset);
+    sync();
+  }
+};
+
+
+// 日志文件按segment建立的只读内存映射
+// 第一次访问时映射整个segment, 之后的读取直接拿到指向映射的指针, 没有系统调用也没有拷贝.
+// 调用者只能访问已经写入文件的范围; segment被重用之前用detach取下映射, 等读者离开之后再unmap.
+class SegmentMap {
+public:
+  struct Mapping {
+    unsigned char *addr = nullptr;
+    size_t len = 0;
+    size_t skip = 0; // segment起点相对映射起点的偏移, segment_size不是页大小的倍数时不为0
+  };
+
+private:
+  int fd_;
+  size_t segment_size_;
+  size_t page_size_;
+  std::shared_mutex mu_;
+  std::unordered_map<uint64_t, Mapping> mappings_;
+  std::atomic<bool> failed_; // 映射失败过一次之后不再尝试
+
+public:
+  SegmentMap(int fd, size_t segment_size)
+      : fd_(fd), segment_size_(segment_size), page_size_(static_cast<size_t>(::sysconf(_SC_PAGESIZE))),
+        failed_(false) {}
+
+  NO_COPY_MOVE(SegmentMap);
+
+  ~SegmentMap() {
+    for (auto &entry : mappings_) {
+      unmap(entry.second);
+    }
+  }
+
+  // segment_offset 处segment的起始地址, 不能映射时返回nullptr, 调用者退回普通的读
+  const unsigned char *segment(uint64_t segment_offset) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mu_);
+      auto it = mappings_.find(segment_offset);
+      if (it != mappings_.end()) {
+        return it->second.addr + it->second.skip;
+      }
+    }
+    if (failed_.load(std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    auto it = mappings_.find(segment_offset);
+    if (it != mappings_.end()) {
+      return it->second.addr + it->second.skip;
+    }
+    Mapping mapping;
+    uint64_t start = segment_offset / page_size_ * page_size_;
+    mapping.skip = static_cast<size_t>(segment_offset - start);
+    mapping.len = mapping.skip + segment_size_;
+    void *addr = ::mmap(nullptr, mapping.len, PROT_READ, MAP_SHARED, fd_, static_cast<off_t>(start));
+    if (addr == MAP_FAILED) {
+      failed_.store(true, std::memory_order_relaxed);
+      tlog_warn << "failed to mmap log segment at " << segment_offset << ": " << std::strerror(errno)
+                << ", falling back to pread";
+      return nullptr;
+    }
+    mapping.addr = static_cast<unsigned char *>(addr);
+    ::madvise(addr, mapping.len, MADV_RANDOM);
+    mappings_.emplace(segment_offset, mapping);
+    return mapping.addr + mapping.skip;
+  }
+
+  // 取下映射, 之后的segment()会重新映射. 返回的映射由调用者在安全之后unmap
+  Mapping detach(uint64_t segment_offset) {
+    std::unique_lock<std::shared_mutex> lock(mu_);
+    auto it = mappings_.find(segment_offset);
+    if (it == mappings_.end()) {
+      return Mapping {};
+    }
+    Mapping mapping = it->second;
+    mappings_.erase(it);
+    return mapping;
+  }
+
+  static void unmap(const Mapping &mapping) {
+    if (mapping.addr != nullptr) {
+      ::munmap(mapping.addr, mapping.len);
+    }
+  }
+
+  size_t mapped_count() {
+    std::shared_lock<std::shared_mutex> lock(mu_);
+    return mappings_.size();
+  }
+};
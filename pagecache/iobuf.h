@@ -2,17 +2,34 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <memory>
 #include <atomic>
 #include <cassert>
+#include <thread>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <map>
 
 // Lsn, LogOffset, PageId
 #include "def_types.h"
 #include "../util/cache_padded.h"
+#include "../util/common_def.h"
 #include "../header.h"
 #include "../slice.h"
 #include "constant.h"
 #include "logger.h"
+#include "io_unix.h"
+#include "../config.h"
+#include "../threadpool.h"
+#include "../util/concurrent_stack.h"
+#include "segment.h"
 
 
 // 8KB 对齐的缓冲区
@@ -26,6 +43,8 @@ public:
     constexpr size_t alignment = 8192; // 8KB 对齐
     size_t aligned_size = (len + alignment - 1) & ~(alignment - 1);
     ptr = static_cast<unsigned char*>(std::aligned_alloc(alignment, aligned_size));
+    // 未写入的区域必须是全零, 恢复时据此判断segment的结尾
+    std::memset(ptr, 0, aligned_size);
   }
 
   // 禁止拷贝，允许移动
@@ -44,53 +63,827 @@ public:
 };
 
 
+enum ReserveStatus {
+  ReserveOk,
+  ReserveSealed, // 已被冻结, 需要等待下一个IoBuf被安装
+  ReserveFull,   // 剩余空间不足, 调用者需要seal当前IoBuf
+};
+
 
 // IoBuf,
 // 一个AlignedBuf 可能包含多个不同的IoBuf,每个IoBuf都有不同的base
+//
+// 多个writer通过对header_的CAS无锁地预留空间:
+//   1. try_reserve: 同时增加offset和n_writers
+//   2. 在预留到的区间内写入数据
+//   3. exit_reservation: 减少n_writers
+// seal之后不再接受新的预留, 最后一个离开的writer(或者seal时已经没有writer的sealer)
+// 负责把这个IoBuf写出
 class IoBuf {
-  std::shared_ptr<std::atomic<AlignedBuf *>> buf_;
+  std::shared_ptr<AlignedBuf> buf_;
   cache_padded_t<std::atomic<uint64_t>> header_;
   size_t base_; // 当前IoBuf在AlignedBuf中的偏移量
-  bool from_tip_;
+  // from_tip_/capacity_ 会被持有旧指针的线程读到, 用原子变量避免数据竞争,
+  // 这种读取的结果总会因为salt不匹配而在CAS时被丢弃
+  std::atomic<bool> from_tip_; // 是否接在同一个segment中上一个IoBuf的尾部
   Lsn stored_max_stable_lsn_;
+  std::atomic<bool> in_use_; // 已安装, 或者已冻结但还没有写出
+  size_t lane_; // 所属的lane, 不随重用改变
 public:
   LogOffset offset_;
-  Lsn lsn_;
-  size_t capacity_;
+  std::atomic<Lsn> lsn_; // flush/on_stable会读取可能正在被重用的IoBuf
+  std::atomic<size_t> capacity_;
+
+  // 空的IoBuf处于冻结状态, 在reset之前不接受预留
+  explicit IoBuf(size_t lane = 0)
+      : base_(0), from_tip_(false), stored_max_stable_lsn_(-1), in_use_(false), lane_(lane), offset_(0), lsn_(0),
+        capacity_(0) {
+    header_().store(HeaderUtil::mk_sealed(0), std::memory_order_relaxed);
+  }
 
+  IoBuf(std::shared_ptr<AlignedBuf> buf, size_t base, LogOffset offset, Lsn lsn, bool from_tip) : IoBuf() {
+    reset(std::move(buf), base, offset, lsn, from_tip);
+  }
 
+  NO_COPY_MOVE(IoBuf);
 
-private:
+  // 在ring中被重用时重新初始化, header由之后的store_segment_header/store_tip_header设置
+  void reset(std::shared_ptr<AlignedBuf> buf, size_t base, LogOffset offset, Lsn lsn, bool from_tip) {
+    assert(HeaderUtil::is_sealed(get_header()));
+    buf_ = std::move(buf);
+    base_ = base;
+    from_tip_.store(from_tip, std::memory_order_relaxed);
+    offset_ = offset;
+    lsn_.store(lsn, std::memory_order_relaxed);
+    capacity_.store(buf_->len - base, std::memory_order_relaxed);
+    assert(base <= buf_->len);
+    assert(capacity_ <= MAX_HEADER_OFFSET);
+    in_use_.store(true, std::memory_order_relaxed);
+  }
+
+  // 写出完成, 这个IoBuf可以被ring重用
+  // 对AlignedBuf的引用保留到下一次reset: 冻结它的线程可能还在用它安装下一个IoBuf
+  void mark_written() {
+    in_use_.store(false, std::memory_order_release);
+  }
+
+  bool in_use() const {
+    return in_use_.load(std::memory_order_acquire);
+  }
 
   // 一个新的segment初始化的时候会调用这个函数
   // 在数据恢复的时候，会读取buffer 头部的segment header
   void store_segment_header(Header last, Lsn lsn, Lsn max_stable_lsn) {
     assert(capacity_ >= SEG_HEADER_LEN);
-    unsigned char *buf_ptr = buf_->load()->ptr;
+    assert(!from_tip_);
+    unsigned char *buf_ptr = buf_->ptr;
     stored_max_stable_lsn_ = max_stable_lsn;
-    lsn_ = lsn;
+    lsn_.store(lsn, std::memory_order_relaxed);
     SegmentHeader header = SegmentHeader {lsn, max_stable_lsn, true};
     unsigned char seg_header_buf[SEG_HEADER_LEN] = {0};
 
     header.to_char(seg_header_buf);
     std::memcpy(buf_ptr, seg_header_buf, SEG_HEADER_LEN);
 
-    // 这里有问题
-    auto last_salt = HeaderUtil::salt(last);
-    auto new_salt = HeaderUtil::bump_salt(last_salt);
+    // 新的salt保证其他线程基于旧header准备的CAS一定失败
+    auto new_salt = HeaderUtil::bump_salt(last);
     auto bumped = HeaderUtil::bump_offset(new_salt, SEG_HEADER_LEN);
     this->set_header(bumped);
   }
-public:
+
+  // 接在上一个IoBuf尾部的IoBuf没有segment header, 只需要换一个新的salt
+  void store_tip_header(Header last, Lsn max_stable_lsn) {
+    stored_max_stable_lsn_ = max_stable_lsn;
+    assert(from_tip_);
+    this->set_header(HeaderUtil::bump_salt(last));
+  }
+
   SliceMut get_mut_range(size_t at, size_t len) { // at是偏移量，len是长度
-    unsigned char *buf_ptr = buf_->load()->ptr;
-    size_t buf_len = buf_->load()->len;
-    assert(at + len <= buf_len);
+    unsigned char *buf_ptr = buf_->ptr;
+    size_t buf_len = buf_->len;
+    assert(this->base_ + at + len <= buf_len);
     return SliceMut(buf_ptr + this->base_ + at, len);
   }
 
+  Header get_header() const {
+    return header_().load(std::memory_order_acquire);
+  }
+
   void set_header(Header v) {
     header_().store(v, std::memory_order_release);
   }
 
-};
\ No newline at end of file
+  // 在当前IoBuf中预留len字节, 成功时buf_offset为相对base_的偏移量
+  ReserveStatus try_reserve(size_t len, size_t &buf_offset) {
+    Header header = get_header();
+    while (true) {
+      if (HeaderUtil::is_sealed(header)) {
+        return ReserveSealed;
+      }
+      if (UNLIKELY(HeaderUtil::n_writers(header) == MAX_WRITERS)) {
+        // writer 计数已满, 等待其他writer离开
+        std::this_thread::yield();
+        header = get_header();
+        continue;
+      }
+      size_t cur = HeaderUtil::offset(header);
+      if (cur + len > capacity_.load(std::memory_order_relaxed)) {
+        return ReserveFull;
+      }
+      Header bumped = HeaderUtil::incr_writers(HeaderUtil::bump_offset(header, len));
+      if (header_().compare_exchange_weak(header, bumped, std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+        buf_offset = cur;
+        return ReserveOk;
+      }
+    }
+  }
+
+  // 冻结当前IoBuf, 只有完成seal的那个线程返回true
+  // maxed 表示这个segment已经写满, 下一个IoBuf需要换新的segment
+  // sealed 返回seal之后的header, 如果其中n_writers为0则由调用者负责写出
+  bool try_seal(bool maxed, Header &sealed) {
+    Header header = get_header();
+    while (true) {
+      if (HeaderUtil::is_sealed(header)) {
+        return false;
+      }
+      Header new_header = HeaderUtil::mk_sealed(header);
+      if (maxed) {
+        new_header = HeaderUtil::mk_maxed(new_header);
+      }
+      if (header_().compare_exchange_weak(header, new_header, std::memory_order_acq_rel,
+                                          std::memory_order_acquire)) {
+        sealed = new_header;
+        return true;
+      }
+    }
+  }
+
+  // 离开预留, 返回true表示自己是最后一个离开已冻结IoBuf的writer, 需要负责写出
+  bool exit_reservation() {
+    Header prev = header_().fetch_sub(1ull << 24, std::memory_order_acq_rel);
+    assert(HeaderUtil::n_writers(prev) != 0);
+    Header now = HeaderUtil::decr_writers(prev);
+    return HeaderUtil::is_sealed(now) && HeaderUtil::n_writers(now) == 0;
+  }
+
+  unsigned char *data() {
+    return buf_->ptr + base_;
+  }
+
+  const std::shared_ptr<AlignedBuf> &aligned_buf() const {
+    return buf_;
+  }
+
+  size_t base() const {
+    return base_;
+  }
+
+  bool from_tip() const {
+    return from_tip_;
+  }
+
+  size_t lane() const {
+    return lane_;
+  }
+
+  Lsn stored_max_stable_lsn() const {
+    return stored_max_stable_lsn_;
+  }
+
+  // 所在segment起始处的lsn
+  Lsn segment_lsn() const {
+    return lsn_ - static_cast<Lsn>(base_);
+  }
+
+  // 没有任何消息写入
+  bool is_empty(Header header) const {
+    return HeaderUtil::offset(header) <= (from_tip_.load(std::memory_order_relaxed) ? 0 : SEG_HEADER_LEN);
+  }
+};
+
+
+
+// 管理一个预先分配好的IoBuf环
+// 当前IoBuf写满(maxed)或者超过flush_every_ms没有刷盘时会被冻结, 冻结它的线程
+// 立即安装环中的下一个IoBuf, 之后的写入者不需要等待磁盘IO
+// 被冻结的IoBuf在最后一个writer离开后交给后台的写线程写入文件
+//
+// log_lanes > 1 时有多个互相独立的IoBuf环(lane), 各自追加, 共享写线程和stable_lsn_.
+// 每个新segment从共享的计数器领取一段lsn区间, 所以所有lane的消息仍然在同一个lsn空间中,
+// 恢复时按lsn排序合并即可. 同一个页面的消息总是进入同一个lane, 保证页面内lsn递增;
+// 不同lane之间的写入只有在中间隔着一次落盘时才保证lsn先后.
+// stable_lsn_ 要求lsn连续, 所以等待某个lsn落盘时, 区间完全在它之前的其他lane的segment会被封口
+//
+// 批次 (见log.h中的Batch) 的清单注册在batches_中: 批次完整落盘之前, stable_lsn_ 停在清单之前,
+// 恢复时从不完整批次的清单处截断就不会丢掉已经公开为稳定的写入
+class IoBufs {
+  static constexpr size_t RING_SIZE = 8;
+  static constexpr size_t MAX_UNSYNCED_BUFS = RING_SIZE; // 积压这么多已写出的IoBuf时不再推迟fsync
+  static constexpr Lsn OPEN_BATCH = std::numeric_limits<Lsn>::max(); // 还没有提交的批次的结尾
+
+  struct Lane {
+    std::vector<std::unique_ptr<IoBuf>> ring;
+    std::atomic<IoBuf *> current {nullptr};
+    size_t current_idx = 0; // 只有完成seal的线程会修改, seal本身保证了串行
+    Lsn segment_lsn = -1;   // 正在写的segment, 由segments_mu_保护
+  };
+
+  int fd_;
+  size_t segment_size_;
+  uint64_t flush_every_ms_;
+
+  std::vector<std::unique_ptr<Lane>> lanes_;
+  std::atomic<Lsn> next_segment_lsn_; // 下一个segment的lsn
+  concurrent_stack<AlignedBuf *> free_bufs_;
+  std::atomic<LogOffset> next_segment_offset_; // 没有accountant时segment只追加不重用
+  std::shared_ptr<SegmentAccountant> accountant_;
+  std::atomic<bool> write_failed_;
+  std::shared_ptr<SegmentIo> io_;
+  bool pad_to_alignment_; // 日志以O_DIRECT打开时, 每次写出的长度和起点都要对齐
+
+  // 所有 <= stable_lsn_ 的lsn都已经写入并fsync
+  std::atomic<Lsn> stable_lsn_;
+  std::mutex stable_mu_;
+  std::condition_variable stable_cv_;
+  Lsn contiguous_lsn_; // 连续落盘到的位置, stable_lsn_ 可能因为没有落盘完整的批次停在它之前
+  std::map<Lsn, Lsn> stable_intervals_; // 已落盘但和contiguous_lsn_还不连续的区间 [start, end)
+  std::map<Lsn, Lsn> batches_; // 批次清单的lsn -> 批次中最后一条消息(包括结束消息)的lsn
+  std::multimap<Lsn, std::function<void()>> stable_callbacks_;
+  std::atomic<size_t> stable_waiters_; // 阻塞在make_stable中的线程和还没有调用的on_stable回调
+  // 已写出但还没有fsync的区间, 队列中没有待写的IoBuf时统一fsync一次 (见sync_due_locked)
+  std::mutex unsynced_mu_;
+  std::vector<std::pair<Lsn, Lsn>> unsynced_;
+  std::chrono::steady_clock::time_point last_sync_; // 受unsynced_mu_保护
+  std::atomic<size_t> pending_writes_;
+
+  // 开始写入的segment, lsn -> offset, 供增量快照使用
+  std::mutex segments_mu_;
+  bool track_segments_;
+  std::map<Lsn, LogOffset> segments_;
+
+  std::atomic<bool> shutdown_;
+  std::mutex flusher_mu_;
+  std::condition_variable flusher_cv_;
+  std::thread flusher_;
+
+  // 放在最后, 析构时最先等待所有写出完成. 多个写线程时IoBuf可能乱序写完, stable_intervals_负责拼接
+  ThreadPool writer_;
+
+  // 从池中取出一个AlignedBuf, 最后一个引用释放时归还
+  std::shared_ptr<AlignedBuf> alloc_buf() {
+    AlignedBuf *raw = nullptr;
+    auto popped = free_bufs_.pop();
+    if (popped.has_value()) {
+      raw = popped.value();
+    } else {
+      raw = new AlignedBuf(segment_size_);
+    }
+    return std::shared_ptr<AlignedBuf>(raw, [this](AlignedBuf *buf) { free_bufs_.push(buf); });
+  }
+
+  // 等待下一个槽位被写出之后重新初始化, 然后安装为当前IoBuf
+  void install_next(IoBuf &sealed_buf, Header sealed) {
+    Lane &lane = *lanes_[sealed_buf.lane()];
+    size_t next_idx = (lane.current_idx + 1) % RING_SIZE;
+    IoBuf &next = *lane.ring[next_idx];
+    while (next.in_use()) {
+      std::this_thread::yield();
+    }
+
+    size_t used = padded_len(HeaderUtil::offset(sealed), sealed_buf.capacity_);
+    size_t tip = sealed_buf.base() + used;
+    bool from_tip = continues_tip(sealed_buf, sealed);
+    if (from_tip) {
+      // 继续写同一个segment, 对齐产生的空隙属于被冻结的IoBuf
+      next.reset(sealed_buf.aligned_buf(), tip, sealed_buf.offset_ + used,
+                 sealed_buf.lsn_ + static_cast<Lsn>(used), true);
+    } else {
+      Lsn lsn = next_segment_lsn_.fetch_add(static_cast<Lsn>(segment_size_), std::memory_order_relaxed);
+      next.reset(alloc_buf(), 0, allocate_segment(lsn, sealed_buf.lane()), lsn, false);
+    }
+
+    // 先发布current, 再让header可用: 持有旧指针的线程只有在current更新之后
+    // 才可能在next上预留或者seal
+    lane.current_idx = next_idx;
+    lane.current.store(&next, std::memory_order_release);
+    Lsn stable = stable_lsn_.load(std::memory_order_acquire);
+    if (from_tip) {
+      next.store_tip_header(sealed, stable);
+    } else {
+      next.store_segment_header(sealed, next.lsn_, stable);
+    }
+  }
+
+  LogOffset allocate_segment(Lsn lsn, size_t lane) {
+    LogOffset offset = accountant_ ? accountant_->next(lsn, lane)
+                                   : next_segment_offset_.fetch_add(segment_size_, std::memory_order_relaxed);
+    std::scoped_lock<std::mutex> lock(segments_mu_);
+    Lsn &current = lanes_[lane]->segment_lsn;
+    if (!track_segments_) {
+      segments_.erase(current); // 只保留每个lane当前的segment, 开始记录时需要它们
+    }
+    current = lsn;
+    segments_[lsn] = offset;
+    return offset;
+  }
+
+  // 冻结之后剩余的空间是否留给下一个IoBuf
+  bool continues_tip(const IoBuf &iobuf, Header sealed) const {
+    size_t used = padded_len(HeaderUtil::offset(sealed), iobuf.capacity_);
+    return !HeaderUtil::is_maxed(sealed) && iobuf.capacity_ - used > MSG_HEADER_LEN;
+  }
+
+  // 冻结的IoBuf在lsn空间中覆盖的长度, 一直到下一个IoBuf的起点;
+  // 不再继续使用的segment尾部也算在内, 否则stable_lsn_会卡在这个空洞前面
+  size_t lsn_span(const IoBuf &iobuf, Header sealed) const {
+    if (continues_tip(iobuf, sealed)) {
+      return padded_len(HeaderUtil::offset(sealed), iobuf.capacity_);
+    }
+    return iobuf.capacity_;
+  }
+
+  // 写线程fsync之后调用, 推进stable_lsn_并唤醒等待者
+  void mark_stable(const std::vector<std::pair<Lsn, Lsn>> &intervals) {
+    std::vector<std::function<void()>> ready;
+    {
+      std::scoped_lock<std::mutex> lock(stable_mu_);
+      for (auto &interval : intervals) {
+        stable_intervals_[interval.first] = interval.second;
+      }
+      auto it = stable_intervals_.begin();
+      while (it != stable_intervals_.end() && it->first == contiguous_lsn_ + 1) {
+        contiguous_lsn_ = it->second - 1;
+        it = stable_intervals_.erase(it);
+      }
+      Lsn stable = held_back(contiguous_lsn_);
+      stable_lsn_.store(stable, std::memory_order_release);
+      auto end = stable_callbacks_.upper_bound(stable);
+      for (auto cb = stable_callbacks_.begin(); cb != end; ++cb) {
+        ready.emplace_back(std::move(cb->second));
+      }
+      stable_callbacks_.erase(stable_callbacks_.begin(), end);
+      stable_waiters_.fetch_sub(ready.size(), std::memory_order_relaxed);
+    }
+    stable_cv_.notify_all();
+    if (accountant_) {
+      accountant_->stabilize(stable_lsn_.load(std::memory_order_acquire));
+    }
+    for (auto &cb : ready) {
+      cb();
+    }
+  }
+
+  // 连续落盘到contiguous时可以公开的stable_lsn, 调用者持有stable_mu_.
+  // 越过了清单但还没有完整落盘的批次把它退回到清单之前; 从这个清单截断又会让更早开始、结束在它之后的批次不完整,
+  // 所以一直退到没有这样的批次为止. 已经公开并且完整落盘的批次不再需要记录
+  Lsn held_back(Lsn contiguous) {
+    Lsn stable = contiguous;
+    bool moved = true;
+    while (moved) {
+      moved = false;
+      for (auto &batch : batches_) {
+        if (batch.first > stable) {
+          break;
+        }
+        if (batch.second > stable) {
+          stable = batch.first - 1;
+          moved = true;
+          break;
+        }
+      }
+    }
+    for (auto it = batches_.begin(); it != batches_.end() && it->first <= stable;) {
+      it = it->second <= stable ? batches_.erase(it) : std::next(it);
+    }
+    return std::max(stable, stable_lsn_.load(std::memory_order_relaxed));
+  }
+
+  // 让lsn公开为稳定需要冻结到的位置: 挡住它的已提交批次必须整个写出, 调用者持有stable_mu_
+  Lsn seal_target(Lsn lsn) const {
+    for (auto &batch : batches_) {
+      if (batch.first > lsn) {
+        break;
+      }
+      if (batch.second != OPEN_BATCH) {
+        lsn = std::max(lsn, batch.second);
+      }
+    }
+    return lsn;
+  }
+
+  // 冻结每个lane中起点 <= lsn 的当前IoBuf, seal_owner 为false时不冻结lsn所在的那一个.
+  // segment的lsn区间完全在lsn之前时整个封口, 下一个segment会领到lsn之后的区间
+  void seal_through(Lsn lsn, bool seal_owner = true) {
+    for (auto &lane : lanes_) {
+      while (true) {
+        IoBuf *iobuf = lane->current.load(std::memory_order_acquire);
+        Header header = iobuf->get_header();
+        Lsn start = iobuf->lsn_.load(std::memory_order_relaxed);
+        Lsn end = start + static_cast<Lsn>(iobuf->capacity_.load(std::memory_order_relaxed));
+        if (HeaderUtil::salt(iobuf->get_header()) != HeaderUtil::salt(header)) {
+          continue; // 读的过程中被重用了
+        }
+        if (HeaderUtil::is_sealed(header)) {
+          // sealer 正在安装下一个IoBuf, 刚安装的IoBuf在header就位之前lsn_和header也对不上
+          std::this_thread::yield();
+          continue;
+        }
+        if (start > lsn) {
+          break;
+        }
+        if (end > lsn + 1) {
+          // lsn在这个IoBuf中, 冻结之后的IoBuf从lsn之后开始
+          if (seal_owner && !iobuf->is_empty(header)) {
+            seal_and_rotate(iobuf, false);
+          }
+          break;
+        }
+        seal_and_rotate(iobuf, true);
+      }
+    }
+  }
+
+  // 所有lane中已经预留过的最大lsn
+  Lsn reserved_tip() const {
+    Lsn tip = -1;
+    for (auto &lane : lanes_) {
+      while (true) {
+        IoBuf *iobuf = lane->current.load(std::memory_order_acquire);
+        Header header = iobuf->get_header();
+        Lsn lsn = iobuf->lsn_.load(std::memory_order_relaxed);
+        if (HeaderUtil::salt(iobuf->get_header()) != HeaderUtil::salt(header)) {
+          continue; // 读的过程中被重用了
+        }
+        if (HeaderUtil::is_sealed(header)) {
+          std::this_thread::yield(); // 等下一个IoBuf安装完成
+          continue;
+        }
+        // 空的IoBuf不会被冻结, 只需要等前一个
+        tip = std::max(tip, iobuf->is_empty(header) ? lsn - 1 : lsn + static_cast<Lsn>(HeaderUtil::offset(header)) - 1);
+        break;
+      }
+    }
+    return tip;
+  }
+
+  // direct模式下IoBuf写出的长度必须对齐, 对齐产生的空隙用MsgCanceled填充,
+  // 空隙小到放不下消息头时再多占一个对齐块
+  size_t padded_len(size_t used, size_t capacity) const {
+    if (!pad_to_alignment_) {
+      return used;
+    }
+    size_t padded = align_up(used, DIRECT_IO_ALIGNMENT);
+    if (padded != used && padded - used < MSG_HEADER_LEN) {
+      padded += DIRECT_IO_ALIGNMENT;
+    }
+    return std::min(padded, capacity);
+  }
+
+  // 推迟的fsync不能一直等下去: 持续有待写的IoBuf时, 积压的IoBuf太多, 距离上次fsync太久,
+  // 或者有人在等落盘时都立即fsync, 否则stable_lsn_会一直不动. 调用者持有unsynced_mu_
+  bool sync_due_locked() const {
+    if (unsynced_.empty()) {
+      return false;
+    }
+    return unsynced_.size() >= MAX_UNSYNCED_BUFS || stable_waiters_.load(std::memory_order_relaxed) > 0 ||
+           std::chrono::steady_clock::now() - last_sync_ >= std::chrono::milliseconds(std::max<uint64_t>(flush_every_ms_, 1));
+  }
+
+  void write_to_log(IoBuf *iobuf) {
+    pending_writes_.fetch_add(1, std::memory_order_acq_rel);
+    writer_.enqueue([this, iobuf] {
+      // mark_written之后iobuf可能已经被重用, 之后只使用这里记下的值
+      LogOffset offset = iobuf->offset_;
+      bool released = false;
+      try {
+        Header sealed = iobuf->get_header();
+        std::pair<Lsn, Lsn> interval(iobuf->lsn_, iobuf->lsn_ + static_cast<Lsn>(lsn_span(*iobuf, sealed)));
+        // 后面还有待写的IoBuf时推迟fsync, 让一次fsync覆盖尽可能多的提交.
+        // 多个写线程时先取走已写出的区间再fsync, 取走的区间一定在这次fsync之前写完.
+        // 要fsync时写入和fsync一起提交, 省掉一次等待
+        std::vector<std::pair<Lsn, Lsn>> synced;
+        bool sync_with_write = false;
+        {
+          std::scoped_lock<std::mutex> lock(unsynced_mu_);
+          sync_with_write = pending_writes_.load(std::memory_order_acquire) == 1 ||
+                            stable_waiters_.load(std::memory_order_relaxed) > 0 || sync_due_locked();
+          if (sync_with_write) {
+            synced.swap(unsynced_);
+            last_sync_ = std::chrono::steady_clock::now();
+          }
+        }
+        write_iobuf(*iobuf, sync_with_write);
+        if (sync_with_write) {
+          synced.push_back(interval);
+        } else {
+          std::scoped_lock<std::mutex> lock(unsynced_mu_);
+          unsynced_.push_back(interval);
+        }
+        released = true;
+        iobuf->mark_written();
+        // 最后离开的写线程fsync其他写线程留下的区间, 还有待写的IoBuf时按sync_due_locked决定
+        bool last = pending_writes_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+        std::vector<std::pair<Lsn, Lsn>> rest;
+        {
+          std::scoped_lock<std::mutex> lock(unsynced_mu_);
+          if (last || sync_due_locked()) {
+            rest.swap(unsynced_);
+            last_sync_ = std::chrono::steady_clock::now();
+          }
+        }
+        if (!rest.empty()) {
+          io_->sync();
+          synced.insert(synced.end(), rest.begin(), rest.end());
+        }
+        if (!synced.empty()) {
+          mark_stable(synced);
+        }
+      } catch (const std::exception &e) {
+        tlog_error << "failed to write iobuf at " << offset << ": " << e.what();
+        {
+          std::scoped_lock<std::mutex> lock(stable_mu_);
+          write_failed_.store(true, std::memory_order_release);
+        }
+        stable_cv_.notify_all();
+        if (!released) {
+          iobuf->mark_written();
+          pending_writes_.fetch_sub(1, std::memory_order_acq_rel);
+        }
+      }
+    });
+  }
+
+  // 此时iobuf已被冻结且没有writer, sync 为true时写入之后紧接着fdatasync
+  void write_iobuf(IoBuf &iobuf, bool sync) {
+    Header header = iobuf.get_header();
+    assert(HeaderUtil::is_sealed(header) && HeaderUtil::n_writers(header) == 0);
+    size_t len = HeaderUtil::offset(header);
+    size_t remaining = iobuf.capacity_ - len;
+    if (HeaderUtil::is_maxed(header) && remaining >= MSG_HEADER_LEN) {
+      // 用一条MsgCap填满segment的剩余部分
+      unsigned char *cap = iobuf.data() + len;
+      size_t cap_len = remaining - MSG_HEADER_LEN;
+      MessageHeader{0, MsgCap, static_cast<uint32_t>(cap_len), 0, iobuf.segment_lsn()}.to_char(cap);
+      MessageHeader::seal_crc(cap, cap_len);
+      len = iobuf.capacity_;
+    }
+    size_t padded = padded_len(len, iobuf.capacity_);
+    if (padded - len >= MSG_HEADER_LEN) {
+      unsigned char *pad = iobuf.data() + len;
+      size_t pad_len = padded - len - MSG_HEADER_LEN;
+      MessageHeader{0, MsgCanceled, static_cast<uint32_t>(pad_len), 0, iobuf.segment_lsn()}.to_char(pad);
+      MessageHeader::seal_crc(pad, pad_len);
+    }
+    len = padded;
+    if (len > 0 && sync) {
+      io_->write_sync(iobuf.data(), len, iobuf.offset_);
+    } else if (len > 0) {
+      io_->write_at(iobuf.data(), len, iobuf.offset_);
+    } else if (sync) {
+      io_->sync();
+    }
+  }
+
+  void run_flusher() {
+    std::unique_lock<std::mutex> lock(flusher_mu_);
+    while (!shutdown_.load(std::memory_order_acquire)) {
+      flusher_cv_.wait_for(lock, std::chrono::milliseconds(flush_every_ms_));
+      if (shutdown_.load(std::memory_order_acquire)) {
+        break;
+      }
+      seal_through(reserved_tip());
+    }
+  }
+
+public:
+  // 有accountant时由它分配segment, start_offset被忽略
+  IoBufs(const Inner &config, int fd, LogOffset start_offset = 0, Lsn start_lsn = 0,
+         std::shared_ptr<SegmentAccountant> accountant = nullptr)
+      : fd_(fd), segment_size_(config.segment_size), flush_every_ms_(config.flush_every_ms),
+        next_segment_lsn_(start_lsn), next_segment_offset_(start_offset), accountant_(std::move(accountant)),
+        write_failed_(false), io_(std::make_shared<SegmentIo>(fd, config.use_io_uring)), pad_to_alignment_(false),
+        stable_lsn_(start_lsn - 1), contiguous_lsn_(start_lsn - 1), stable_waiters_(0),
+        last_sync_(std::chrono::steady_clock::now()), pending_writes_(0), track_segments_(false),
+        shutdown_(false), writer_(std::max<size_t>(config.io_writers, 1)) {
+    if (accountant_ && accountant_->segment_size() != segment_size_) {
+      throw std::invalid_argument("accountant segment_size does not match config");
+    }
+    if (segment_size_ > MAX_HEADER_OFFSET + 1 || segment_size_ <= SEG_HEADER_LEN + MSG_HEADER_LEN) {
+      throw std::invalid_argument("segment_size must be in (SEG_HEADER_LEN + MSG_HEADER_LEN, 16MB]");
+    }
+    pad_to_alignment_ = io_->direct();
+    if (pad_to_alignment_ && segment_size_ % DIRECT_IO_ALIGNMENT != 0) {
+      throw std::invalid_argument("segment_size must be a multiple of DIRECT_IO_ALIGNMENT with O_DIRECT");
+    }
+    size_t lanes = std::max<size_t>(config.log_lanes, 1);
+    std::vector<std::pair<unsigned char *, size_t>> fixed;
+    for (size_t l = 0; l < lanes; ++l) {
+      auto lane = std::make_unique<Lane>();
+      lane->ring.reserve(RING_SIZE);
+      for (size_t i = 0; i < RING_SIZE; ++i) {
+        lane->ring.emplace_back(std::make_unique<IoBuf>(l));
+        auto *buf = new AlignedBuf(segment_size_);
+        fixed.emplace_back(buf->ptr, buf->len);
+        free_bufs_.push(buf);
+      }
+      lanes_.push_back(std::move(lane));
+    }
+    // 池中的缓冲区注册给io_uring, 写出时使用 WRITE_FIXED
+    io_->register_buffers(fixed);
+
+    for (size_t l = 0; l < lanes_.size(); ++l) {
+      Lsn lsn = next_segment_lsn_.fetch_add(static_cast<Lsn>(segment_size_), std::memory_order_relaxed);
+      IoBuf &first = *lanes_[l]->ring[0];
+      first.reset(alloc_buf(), 0, allocate_segment(lsn, l), lsn, false);
+      first.store_segment_header(HeaderUtil::mk_sealed(0), lsn, start_lsn - 1);
+      lanes_[l]->current.store(&first, std::memory_order_release);
+    }
+
+    if (flush_every_ms_ > 0) {
+      flusher_ = std::thread([this] { run_flusher(); });
+    }
+  }
+
+  NO_COPY_MOVE(IoBufs);
+
+  ~IoBufs() {
+    {
+      std::scoped_lock<std::mutex> lock(flusher_mu_);
+      shutdown_.store(true, std::memory_order_release);
+    }
+    flusher_cv_.notify_all();
+    if (flusher_.joinable()) {
+      flusher_.join();
+    }
+    // 其他lane封口之后, 日志尾部只有最后一个lane的segment不完整, 恢复时不会丢掉写过的数据
+    seal_through(reserved_tip());
+    seal_current();
+    writer_.shutdown();
+    lanes_.clear();
+    while (auto buf = free_bufs_.pop()) {
+      delete buf.value();
+    }
+  }
+
+  size_t segment_size() const {
+    return segment_size_;
+  }
+
+  const std::shared_ptr<SegmentIo> &io() const {
+    return io_;
+  }
+
+  size_t lanes() const {
+    return lanes_.size();
+  }
+
+  // 在 lane % lanes() 的当前IoBuf中预留, 返回这个IoBuf以及预留到的相对偏移量
+  IoBuf *reserve(size_t len, size_t &buf_offset, size_t lane = 0) {
+    if (UNLIKELY(write_failed_.load(std::memory_order_acquire))) {
+      throw std::runtime_error("log write failed");
+    }
+    Lane &target = *lanes_[lane % lanes_.size()];
+    while (true) {
+      IoBuf *iobuf = target.current.load(std::memory_order_acquire);
+      switch (iobuf->try_reserve(len, buf_offset)) {
+      case ReserveOk:
+        return iobuf;
+      case ReserveFull:
+        seal_and_rotate(iobuf, true);
+        break;
+      case ReserveSealed:
+        // sealer 正在安装下一个IoBuf
+        std::this_thread::yield();
+        break;
+      }
+    }
+  }
+
+  // 冻结iobuf并安装下一个IoBuf, 如果没有writer在其中则立即交给写线程
+  void seal_and_rotate(IoBuf *iobuf, bool maxed) {
+    Header sealed = 0;
+    if (!iobuf->try_seal(maxed, sealed)) {
+      return;
+    }
+    install_next(*iobuf, sealed);
+    if (HeaderUtil::n_writers(sealed) == 0) {
+      write_to_log(iobuf);
+    }
+  }
+
+  // 有数据时冻结每个lane的当前IoBuf, 剩余空间继续留给下一个IoBuf使用
+  void seal_current() {
+    for (auto &lane : lanes_) {
+      IoBuf *iobuf = lane->current.load(std::memory_order_acquire);
+      Header header = iobuf->get_header();
+      if (HeaderUtil::is_sealed(header) || iobuf->is_empty(header)) {
+        continue;
+      }
+      seal_and_rotate(iobuf, false);
+    }
+  }
+
+  void exit_reservation(IoBuf *iobuf) {
+    if (iobuf->exit_reservation()) {
+      write_to_log(iobuf);
+    }
+  }
+
+  Lsn stable_lsn() const {
+    return stable_lsn_.load(std::memory_order_acquire);
+  }
+
+  // 从现在开始记录新segment的位置
+  void track_segments() {
+    std::scoped_lock<std::mutex> lock(segments_mu_);
+    track_segments_ = true;
+  }
+
+  // 返回还有数据在 after 之后的segment, 之前的记录不再需要
+  std::map<Lsn, LogOffset> segments_after(Lsn after) {
+    std::scoped_lock<std::mutex> lock(segments_mu_);
+    while (!segments_.empty() && segments_.begin()->first + static_cast<Lsn>(segment_size_) - 1 <= after) {
+      segments_.erase(segments_.begin());
+    }
+    return segments_;
+  }
+
+  // 阻塞直到lsn落盘, lsn必须已经被预留过
+  // 同时等待的提交者共享同一次seal和fsync
+  void make_stable(Lsn lsn) {
+    if (stable_lsn() >= lsn) {
+      return;
+    }
+    Lsn sealed = -1;
+    std::unique_lock<std::mutex> lock(stable_mu_);
+    while (stable_lsn_.load(std::memory_order_acquire) < lsn && !write_failed_.load(std::memory_order_acquire)) {
+      // 挡在前面的批次提交之后要冻结的范围会变大
+      Lsn target = seal_target(lsn);
+      if (target > sealed) {
+        sealed = target;
+        lock.unlock();
+        seal_through(target);
+        lock.lock();
+        continue;
+      }
+      stable_waiters_.fetch_add(1, std::memory_order_relaxed);
+      stable_cv_.wait(lock);
+      stable_waiters_.fetch_sub(1, std::memory_order_relaxed);
+    }
+    if (stable_lsn_.load(std::memory_order_acquire) < lsn) {
+      throw std::runtime_error("log write failed");
+    }
+  }
+
+  // 把目前为止预留过的数据全部落盘, 返回之后的stable lsn
+  Lsn flush() {
+    make_stable(reserved_tip());
+    return stable_lsn();
+  }
+
+  // lsn落盘后在写线程上调用cb, 已经落盘时立即在当前线程调用
+  void on_stable(Lsn lsn, std::function<void()> cb) {
+    Lsn target = lsn;
+    {
+      std::scoped_lock<std::mutex> lock(stable_mu_);
+      if (stable_lsn_.load(std::memory_order_acquire) < lsn) {
+        stable_callbacks_.emplace(lsn, std::move(cb));
+        stable_waiters_.fetch_add(1, std::memory_order_relaxed);
+        cb = nullptr;
+        target = seal_target(lsn);
+      }
+    }
+    if (cb) {
+      cb();
+      return;
+    }
+    seal_through(target);
+  }
+
+  // 之后在任何lane中的预留都排在lsn之后, lsn必须已经被预留过
+  void order_after(Lsn lsn) {
+    seal_through(lsn, false);
+  }
+
+  // lsn处的批次清单已经预留但还没有写出, 批次结束并且完整落盘之前stable_lsn不会越过它
+  void hold_stable(Lsn manifest_lsn) {
+    std::scoped_lock<std::mutex> lock(stable_mu_);
+    batches_.emplace(manifest_lsn, OPEN_BATCH);
+  }
+
+  // 批次结束, last 是其中最后一条消息(包括结束消息)的lsn. 在写出结束消息之前调用
+  void release_stable(Lsn manifest_lsn, Lsn last) {
+    bool waited = false;
+    {
+      std::scoped_lock<std::mutex> lock(stable_mu_);
+      batches_[manifest_lsn] = last;
+      waited = !stable_callbacks_.empty() && stable_callbacks_.rbegin()->first >= manifest_lsn;
+    }
+    stable_cv_.notify_all(); // make_stable 重新计算要冻结的范围
+    if (waited) {
+      seal_through(last);
+    }
+  }
+};
@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include "def_types.h"
+#include "constant.h"
+#include "disk_pointer.h"
+#include "iobuf.h"
+#include "logger.h"
+#include "reservation.h"
+#include "snapshot_file.h"
+#include "../config.h"
+
+
+class Batch;
+
+// 日志的写入端
+// 所有writer并发地在当前IoBuf中预留空间, IoBuf的轮换和写出由IoBufs负责
+class Log {
+  friend class Batch;
+
+  Inner config_;
+  int fd_;
+  int owned_fd_; // 由Log自己打开的文件, 析构时关闭
+  std::unique_ptr<IoBufs> iobufs_;
+  std::unique_ptr<Snapshotter> snapshotter_; // 调用enable_snapshots之后才有
+
+public:
+  // 有accountant时由它分配和回收segment, start_offset被忽略
+  Log(const Inner &config, int fd, LogOffset start_offset = 0, Lsn start_lsn = 0,
+      std::shared_ptr<SegmentAccountant> accountant = nullptr)
+      : config_(config), fd_(fd), owned_fd_(-1),
+        iobufs_(std::make_unique<IoBufs>(config, fd, start_offset, start_lsn, std::move(accountant))) {}
+
+  // 按配置打开 config.path, use_direct_io 时尝试O_DIRECT
+  explicit Log(const Inner &config, LogOffset start_offset = 0, Lsn start_lsn = 0)
+      : config_(config), owned_fd_(open_log_file(config.path.c_str(), true, config.use_direct_io)) {
+    fd_ = owned_fd_;
+    try {
+      iobufs_ = std::make_unique<IoBufs>(config, owned_fd_, start_offset, start_lsn);
+    } catch (...) {
+      ::close(owned_fd_);
+      throw;
+    }
+  }
+
+  ~Log() {
+    snapshotter_.reset();
+    iobufs_.reset();
+    if (owned_fd_ >= 0) {
+      ::close(owned_fd_);
+    }
+  }
+
+  NO_COPY_MOVE(Log);
+
+  int fd() const {
+    return fd_;
+  }
+
+  // 读路径与写线程共用同一个IO后端, 读写可以在同一个队列中重叠
+  SegmentIo &io() const {
+    return *iobufs_->io();
+  }
+
+  // 单条消息的最大负载
+  size_t max_payload() const {
+    return iobufs_->segment_size() - SEG_HEADER_LEN - MSG_HEADER_LEN;
+  }
+
+  Reservation reserve(MessageKind kind, PageId pid, size_t payload_len) {
+    if (payload_len > max_payload()) {
+      throw std::invalid_argument("message does not fit in a segment");
+    }
+    size_t total = MSG_HEADER_LEN + payload_len;
+    size_t at = 0;
+    // 同一个页面总是写进同一个lane, 页面内的lsn保持递增
+    IoBuf *iobuf = iobufs_->reserve(total, at, static_cast<size_t>(pid));
+    MessageHeader header{0, kind, static_cast<uint32_t>(payload_len), pid, iobuf->segment_lsn()};
+    LogOffset offset = iobuf->offset_ + at;
+    Lsn lsn = iobuf->lsn_ + static_cast<Lsn>(at);
+    return Reservation(this, iobuf, iobuf->get_mut_range(at, total), header, DiskPtr::new_inline(offset), lsn);
+  }
+
+  // 数据写进heap, 日志中只记录HeapId, kind 必须是blob类型的消息
+  // 先写heap(包括fdatasync)再预留, 预留期间IoBuf不能写出, 不能让它等heap的IO.
+  // HeapId里的original_lsn取写heap之前的stable_lsn + 1, 不大于之后预留到的lsn. 槽位要等替换它的写入落盘之后
+  // 才会被重用, 那时stable_lsn已经越过旧消息, 所以同一个槽位上的original_lsn严格递增, 仍然能识别重用
+  Reservation reserve_blob(MessageKind kind, PageId pid, Heap &heap, const unsigned char *data, size_t len,
+                           uint8_t flags = 0) {
+    if (kind != MsgBlobNode && kind != MsgBlobLink && kind != MsgBlobMeta) {
+      throw std::invalid_argument("not a blob message kind");
+    }
+    HeapId heap_id = heap.write(data, len, stable_lsn() + 1, flags);
+    try {
+      auto reservation = reserve(kind, pid, HEAP_ID_LEN);
+      reservation.set_heap_id(heap_id);
+      return reservation;
+    } catch (...) {
+      heap.free(heap_id);
+      throw;
+    }
+  }
+
+  // 拷贝一段数据进日志, 返回lsn和位置
+  std::pair<Lsn, DiskPtr> write(MessageKind kind, PageId pid, const unsigned char *data, size_t len) {
+    auto reservation = reserve(kind, pid, len);
+    if (len > 0) {
+      std::memcpy(reservation.payload().data(), data, len);
+    }
+    return reservation.complete();
+  }
+
+  void exit_reservation(IoBuf *iobuf) {
+    iobufs_->exit_reservation(iobuf);
+  }
+
+  // 每完成一次写入调用一次, 用于按 snapshot_after_ops 触发快照
+  void count_op() {
+    if (snapshotter_) {
+      snapshotter_->count_op();
+    }
+  }
+
+  // 开始周期性地生成快照, base 是启动时恢复出来的结果, path 为空时使用 config.path + ".snapshot"
+  void enable_snapshots(Snapshot base, std::string path = "") {
+    if (path.empty()) {
+      path = config_.path + ".snapshot";
+    }
+    iobufs_->track_segments();
+    snapshotter_ = std::make_unique<Snapshotter>(
+        config_, fd_, std::move(path), std::move(base), [this] { return iobufs_->stable_lsn(); },
+        [this](Lsn after) { return iobufs_->segments_after(after); });
+  }
+
+  // 立即把当前已经落盘的数据写进快照, 返回快照的lsn
+  Lsn snapshot() {
+    if (!snapshotter_) {
+      throw std::logic_error("snapshots are not enabled");
+    }
+    return snapshotter_->take_snapshot();
+  }
+
+  // 冻结当前IoBuf, 写出由后台写线程完成
+  void roll() {
+    iobufs_->seal_current();
+  }
+
+  // 所有 <= stable_lsn() 的数据都已经落盘
+  Lsn stable_lsn() const {
+    return iobufs_->stable_lsn();
+  }
+
+  // 阻塞直到lsn落盘
+  void make_stable(Lsn lsn) {
+    iobufs_->make_stable(lsn);
+  }
+
+  // 把目前为止写入的数据全部落盘, 返回落盘后的stable lsn
+  Lsn flush() {
+    return iobufs_->flush();
+  }
+
+  // lsn落盘后调用cb, cb运行在写线程上, 不应该阻塞
+  void on_stable(Lsn lsn, std::function<void()> cb) {
+    iobufs_->on_stable(lsn, std::move(cb));
+  }
+};
+
+
+// 一组要么全部恢复, 要么全部丢弃的写入
+//
+// 构造时在BATCH_MANIFEST_PID上写一条MsgBatchManifest, 之后所有lane中的预留都排在它之后.
+// 属于批次的消息把lsn交给add, commit 再写一条MsgBatchCommit, 记下清单的lsn和其中最大的lsn.
+// 恢复时找不到结束消息, 或者日志没有到达批次的最后一条消息, 就从清单处截断 (见recovery.h), 批次中的写入一条都不会出现;
+// 批次完整落盘之前stable_lsn不会越过清单, 所以截断不会丢掉已经稳定的写入.
+// 清单写完就离开预留, 批次打开期间不会占着IoBuf不让它写出.
+// 一个Batch只在一个线程中使用, 结束之前不能等待清单之后的lsn落盘. 析构时还没有提交则放弃
+class Batch {
+  static constexpr Lsn OPEN = std::numeric_limits<Lsn>::max(); // 清单的负载, 批次的结尾在结束消息里
+
+  Log &log_;
+  Lsn manifest_;
+  Lsn last_;
+  bool closed_;
+
+  // 写出结束消息, last 为-1时不覆盖任何消息. 返回批次中最大的lsn
+  Lsn close(Lsn last) {
+    assert(!closed_);
+    closed_ = true;
+    auto end = log_.reserve(MsgBatchCommit, BATCH_MANIFEST_PID, 2 * sizeof(Lsn));
+    std::memcpy(end.payload().data(), &manifest_, sizeof(Lsn));
+    std::memcpy(end.payload().data() + sizeof(Lsn), &last, sizeof(Lsn));
+    Lsn through = std::max(last, end.lsn());
+    log_.iobufs_->release_stable(manifest_, through);
+    end.complete();
+    return through;
+  }
+
+public:
+  explicit Batch(Log &log) : log_(log), manifest_(-1), last_(-1), closed_(false) {
+    auto manifest = log.reserve(MsgBatchManifest, BATCH_MANIFEST_PID, sizeof(Lsn));
+    manifest_ = manifest.lsn();
+    last_ = manifest_;
+    std::memcpy(manifest.payload().data(), &OPEN, sizeof(Lsn));
+    // 清单离开预留之前登记, 它不会在登记之前落盘
+    log_.iobufs_->hold_stable(manifest_);
+    manifest.complete();
+    log_.iobufs_->order_after(manifest_);
+  }
+
+  ~Batch() {
+    if (closed_) {
+      return;
+    }
+    try {
+      abort();
+    } catch (const std::exception &e) {
+      tlog_error << "failed to abort batch at lsn " << manifest_ << ": " << e.what();
+    }
+  }
+
+  NO_COPY_MOVE(Batch);
+
+  // 清单的lsn
+  Lsn lsn() const {
+    return manifest_;
+  }
+
+  void add(Lsn lsn) {
+    last_ = std::max(last_, lsn);
+  }
+
+  // 写出结束消息, 返回批次最后一条消息的lsn, make_stable 它之后整个批次都已落盘
+  Lsn commit() {
+    return close(last_);
+  }
+
+  // 放弃批次: 结束消息不覆盖任何写入, 已经写进日志的消息不再保证原子性, 恢复时像普通写入一样处理.
+  // 不会因为这个批次截断之后的日志
+  void abort() {
+    close(-1);
+  }
+};
+
+
+inline void Reservation::flush(bool valid) {
+  assert(!flushed_);
+  flushed_ = true;
+  if (!valid) {
+    header_.kind = MsgCanceled;
+  }
+  header_.to_char(data_.data());
+  MessageHeader::seal_crc(data_.data(), header_.len);
+  log_->exit_reservation(buf_);
+  if (valid) {
+    log_->count_op();
+  }
+}
@@ -17,12 +17,12 @@ struct SegmentHeader {
   
 
   void to_char(unsigned char *buf /* buf_len = SEG_HEADER_LEN*/) {
-    tlog_info << "Segment to char";
+    tlog_debug << "Segment to char";
     uint64_t xor_lsn = (lsn ^  0x7FFFFFFFFFFFFFFF);
     const unsigned char *lsn_arr = reinterpret_cast<const unsigned char*>(&xor_lsn); // 8 bytes
 
     uint64_t xor_max_stable_lsn = (max_stable_lsn ^ 0x7FFFFFFFFFFFFFFF);
-    const unsigned char *highest_stable_lsn_arr = reinterpret_cast<const unsigned char *>(xor_max_stable_lsn); // 8bytes
+    const unsigned char *highest_stable_lsn_arr = reinterpret_cast<const unsigned char *>(&xor_max_stable_lsn); // 8bytes
 
     // copy
     std::memcpy(buf + 4, lsn_arr, 8);
@@ -33,10 +33,95 @@ struct SegmentHeader {
     auto crc_res = crc32_buf(buf + 4, SEG_HEADER_LEN - 4);
     std::memcpy(buf, &crc_res, 4);
   }
+
+  // crc不匹配(未写入或者写了一半)时 ok = false
+  static SegmentHeader from_char(const unsigned char *buf /* buf_len = SEG_HEADER_LEN*/) {
+    SegmentHeader header {0, 0, false};
+    uint32_t crc_expected;
+    std::memcpy(&crc_expected, buf, 4);
+    if (crc32_buf(buf + 4, SEG_HEADER_LEN - 4) != crc_expected) {
+      return header;
+    }
+    uint64_t xor_lsn;
+    uint64_t xor_max_stable_lsn;
+    std::memcpy(&xor_lsn, buf + 4, 8);
+    std::memcpy(&xor_max_stable_lsn, buf + 12, 8);
+    header.lsn = static_cast<Lsn>(xor_lsn ^ 0x7FFFFFFFFFFFFFFF);
+    header.max_stable_lsn = static_cast<Lsn>(xor_max_stable_lsn ^ 0x7FFFFFFFFFFFFFFF);
+    header.ok = true;
+    return header;
+  }
 };
 
 
+// 日志中每条消息的类型
+// 0 保留给未写入的区域（全零），恢复时遇到即认为segment到此结束
+enum MessageKind : uint8_t {
+  MsgCorrupted = 0,
+  MsgCanceled = 1, // 预留后被放弃的空间
+  MsgCap = 2,      // segment 尾部的填充
+  MsgBatchManifest = 3,
+  MsgFree = 4,
+  MsgCounter = 5,
+  MsgInlineMeta = 6,
+  MsgBlobMeta = 7,
+  MsgInlineNode = 8,
+  MsgBlobNode = 9,
+  MsgInlineLink = 10,
+  MsgBlobLink = 11,
+  MsgBatchCommit = 12, // 批次的结束, 负载是清单的lsn和批次最后一条消息的lsn (见log.h中的Batch)
+};
+
+// 负载是压缩过的页面 (见 compression.h)
+constexpr uint8_t MSG_FLAG_COMPRESSED = 1;
+
+// 消息头, 布局:
+// [0..4) crc32, 覆盖 [4..MSG_HEADER_LEN + len)
+// [4] kind, [5] flags, [6..8) 填充
+// [8..12) 负载长度
+// [12..20) page id
+// [20..28) 所在segment的lsn, segment被重用之后, 旧的消息即使crc正确也会因为lsn不匹配而被忽略
+struct MessageHeader {
+  uint32_t crc32;
+  MessageKind kind;
+  uint32_t len;
+  PageId pid;
+  Lsn segment_lsn;
+  uint8_t flags = 0; // MSG_FLAG_*, 恢复时不关心
+
+  // 只写入 [4..MSG_HEADER_LEN), crc 需要在负载写完之后由 seal_crc 填写
+  void to_char(unsigned char *buf /* buf_len >= MSG_HEADER_LEN */) const {
+    std::memset(buf + 4, 0, 4);
+    buf[4] = static_cast<unsigned char>(kind);
+    buf[5] = flags;
+    std::memcpy(buf + 8, &len, 4);
+    std::memcpy(buf + 12, &pid, 8);
+    std::memcpy(buf + 20, &segment_lsn, 8);
+  }
+
+  static MessageHeader from_char(const unsigned char *buf) {
+    MessageHeader header;
+    std::memcpy(&header.crc32, buf, 4);
+    header.kind = static_cast<MessageKind>(buf[4]);
+    header.flags = buf[5];
+    std::memcpy(&header.len, buf + 8, 4);
+    std::memcpy(&header.pid, buf + 12, 8);
+    std::memcpy(&header.segment_lsn, buf + 20, 8);
+    return header;
+  }
 
-class Log {
+  // 消息头和负载在缓冲区中是连续的, 一次算完
+  static uint32_t compute_crc(const unsigned char *msg, size_t payload_len) {
+    return crc32_buf(msg + 4, MSG_HEADER_LEN - 4 + payload_len);
+  }
 
-};
\ No newline at end of file
+  // 消息头和负载分开存放时(例如分别读入), 不需要拼接
+  static uint32_t compute_crc(const unsigned char *header, const unsigned char *payload, size_t payload_len) {
+    return Crc32c().update(header + 4, MSG_HEADER_LEN - 4).update(payload, payload_len).finish();
+  }
+
+  static void seal_crc(unsigned char *msg, size_t payload_len) {
+    uint32_t crc = compute_crc(msg, payload_len);
+    std::memcpy(msg, &crc, 4);
+  }
+};
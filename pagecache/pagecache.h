@@ -1,42 +1,824 @@
 #pragma once
 
+/*
+PageCache: 页面的内存状态, 以及它们在日志中的位置
+
+每个页面在页表中是一个不可变的Page: 一个基准页加上按lsn顺序link上去的delta(fragment).
+修改页面时先在日志中预留并写好消息, 再构造新的Page CAS进页表:
+  CAS成功: 把SegmentOp交给SegmentAccountant, 然后complete, 旧的Page交给页表的epoch延迟释放
+  CAS失败: 放弃预留, 调用者重新get之后再试
+先读当前版本再预留, 所以页面上fragment的lsn总是递增的, 和恢复时的应用顺序一致.
+
+fragment链过长时每次读取都要拼接很多块, 缓存不命中时还要很多次随机读.
+link发现链上的delta已经达到PAGE_CONSOLIDATION_THRESHOLD时, 用merge把整个页面物化成一个新的基准页,
+走replace的路径写出, 旧的fragment通过SegmentOp::Replace交给SegmentAccountant, 之后的读取只剩一块连续的数据.
+
+页面内容的解释(以及如何合并delta)由上层决定, 这里只当作字节串.
+*_serialized 接受任何提供 serialized_size/serialize_into 的类型(serialize.h), 直接序列化进预留的日志空间.
+超过单条日志消息上限的数据写进heap, 日志中只记录HeapId.
+use_compression 时写出之前先压缩(compression.h), 读入时按消息头中的flags解压, 内存中总是原始数据.
+
+内存中的页面由PageEvictor记账, 总量超过cache_capacity时把冷页面的数据丢掉, 只保留cache_info中的DiskPtr,
+下一次get时再从磁盘读入. 还没有落盘的页面不能丢, 等下一次被选中时再看.
+
+use_mmap_reads 时已经落盘的inline fragment通过内存映射读取(io_unix.h的SegmentMap), view 可以不经过缓存
+直接拿到指向映射的视图. segment回到Free之后要等所有读者离开epoch才能被日志重用, 视图在guard内一直有效.
+
+不再使用的页面用free释放: 写一条MsgFree, 页表中换成一个只记着这条消息的墓碑, 旧版本交给epoch延迟释放,
+旧的fragment通过SegmentOp::Replace交给SegmentAccountant. 墓碑的pid之后由allocate按释放的顺序重用,
+在那之前cleaner像普通页面一样重写它的MsgFree, 恢复时MsgFree之前的消息不会让页面复活.
+其他线程可能还从旧版本中拿到pid时用free_later, 等它们都离开epoch之后再写MsgFree. 上层的旧版本里可能
+还留着这个pid, 拿着它的线程不能把一个新页面当成原来的页面, 所以这样释放的pid在本次运行中不再重用, 重启之后才重用.
+
+generate_id 发出重启之后也不会重复的id. 每个注册线程从全局计数器一次租IDGEN_BLOCK个, 在自己的槽位里递增;
+COUNTER_PID 中只记录一个高水位, 租出的id越过已经落盘的高水位时才写日志, 大约每 idgen_persist_interval 个id一次.
+写一个高水位时顺便预先写出下一个, 等id用到那里时它通常已经落盘, 不需要等待. 恢复之后从落盘的高水位继续.
+*/
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
-#include <unordered_map>
-#include <unordered_set>
 
 #include "def_types.h"
+#include "constant.h"
+#include "compression.h"
 #include "disk_pointer.h"
+#include "eviction.h"
+#include "heap.h"
+#include "log.h"
+#include "pagetable.h"
+#include "segment.h"
+#include "snapshot.h"
+#include "../config.h"
+#include "../serialize.h"
+#include "../util/common_def.h"
 
+constexpr uint64_t FRAGMENT_COALESCE_GAP = 16 * 1024; // 同一segment中相距不超过这么多的fragment一起读
+constexpr size_t FRAGMENT_MAX_IOVS = 256;             // 一个读区间最多的iovec数, 不超过IOV_MAX
 
+using PageBuf = std::vector<unsigned char>;
+using PageBufPtr = std::shared_ptr<const PageBuf>;
 
-struct CacheInfo {
-  uint64_t ts;  // 时间戳，用于保证日志的线性关系
-  Lsn lsn;
-  DiskPtr pointer; // 指向日志中的位置，是对应
-};
+// chain[0] 是基准页, 之后是按顺序的delta, 返回合并之后的基准页
+using MergeFn = std::function<PageBuf(const std::vector<PageBufPtr> &chain)>;
 
 struct Page {
-  int page_id;
-  
-  std::vector<CacheInfo> cache_info;
-};
+  PageId page_id;
 
-struct Config {
+  std::vector<CacheInfo> cache_info; // [0]是基准页, 之后是link上去的fragment
 
-};
+  std::vector<PageBufPtr> bufs; // 和cache_info一一对应, 为空表示还没有从磁盘读入; 新旧版本之间共享
+
+  bool free = false; // 已经释放的墓碑, cache_info[0] 是MsgFree, bufs 总是空的
 
-struct NOde {
-  OrdMap map;
+  bool is_loaded() const {
+    return bufs.size() == cache_info.size();
+  }
 
-  unsigned char *info;
+  size_t frag_count() const {
+    return cache_info.size() - 1;
+  }
+
+  uint64_t ts() const {
+    return cache_info.back().ts;
+  }
 };
 
 
 class PageCache {
-  Config *conf_;
-  PageCacheInner *inner;
+  NO_COPY_MOVE(PageCache);
+
+public:
+  using Table = PageTable<Page>;
+  using Guard = Table::Guard;
+
+private:
+  Inner config_;
+  Log &log_;
+  std::shared_ptr<SegmentAccountant> accountant_;
+  std::shared_ptr<Heap> heap_;
+  MergeFn merge_;
+  PageCompressor compressor_; // 关闭压缩时也需要它来读之前压缩过的页面
+  std::mutex free_mu_;
+  std::deque<PageId> free_pids_; // 可以重用的墓碑, 先释放的先重用. free_mu_ 保护
+  std::vector<PageId> freeing_; // free_later 的读者已经离开, 等着写MsgFree(不重用pid). free_mu_ 保护, 要比table_后析构
+  std::atomic<size_t> free_count_; // free_pids_.size(), 为0时allocate不加锁
+  std::unique_ptr<SegmentMap> mapper_; // use_mmap_reads 时才有, 必须在table_之前析构之后
+  Table table_;
+  PageEvictor evictor_;
+  std::atomic<PageId> next_pid_;
+  std::atomic<uint64_t> freed_pages_;
+  std::atomic<uint64_t> consolidations_;
+  std::atomic<uint64_t> read_ranges_; // 缺页时发出的读区间数
+  std::atomic<uint64_t> mapped_reads_; // 从内存映射读到的fragment数
+
+  // 一个线程正在发出的一段id [next, end), 只有占用这个槽位的线程访问
+  struct alignas(64) IdBlock {
+    uint64_t next = 0;
+    uint64_t end = 0;
+  };
+  std::atomic<uint64_t> idgen_; // 下一段还没有租出的id
+  std::atomic<uint64_t> idgen_durable_; // 已经落盘的高水位, 小于它的id都可以发出
+  std::mutex idgen_mu_;
+  uint64_t idgen_written_; // 最近写出的高水位, 可能还没有落盘. idgen_mu_ 保护
+  Lsn idgen_lsn_; // idgen_written_ 所在的lsn
+  std::unique_ptr<IdBlock[]> id_blocks_; // 下标是线程的tcs
+
+  // 写一条消息, 装不进一条日志消息的数据写进heap
+  Reservation write_message(MessageKind inline_kind, MessageKind blob_kind, PageId pid, const PageBuf &data) {
+    const unsigned char *bytes = data.data();
+    size_t len = data.size();
+    uint8_t flags = 0;
+    if (config_.use_compression) {
+      if (auto *frame = compressor_.compress(data.data(), data.size())) {
+        bytes = frame->data();
+        len = frame->size();
+        flags = MSG_FLAG_COMPRESSED;
+      }
+    }
+    if (len <= log_.max_payload()) {
+      auto reservation = log_.reserve(inline_kind, pid, len);
+      if (len > 0) {
+        std::memcpy(reservation.payload().data(), bytes, len);
+      }
+      reservation.set_flags(flags);
+      return reservation;
+    }
+    if (!heap_) {
+      throw std::invalid_argument("page does not fit in a segment and there is no heap");
+    }
+    return log_.reserve_blob(blob_kind, pid, *heap_, bytes, len, flags);
+  }
+
+  // 两阶段写入: 不压缩并且装得进一条日志消息时直接序列化进预留的日志空间, 内存中的副本从写好的负载拷贝;
+  // 需要压缩或者写heap时先序列化成一块长度正好的缓冲区, 再走write_message
+  template <class T>
+  Reservation write_serialized(MessageKind inline_kind, MessageKind blob_kind, PageId pid, const T &value,
+                               PageBufPtr &buf) {
+    size_t len = value.serialized_size();
+    if (config_.use_compression || len > log_.max_payload()) {
+      buf = std::make_shared<const PageBuf>(Serialize::to_vec(value));
+      return write_message(inline_kind, blob_kind, pid, *buf);
+    }
+    auto reservation = log_.reserve(inline_kind, pid, len);
+    SliceMut out = reservation.payload();
+    value.serialize_into(out);
+    assert(out.empty());
+    SliceMut payload = reservation.payload();
+    buf = std::make_shared<const PageBuf>(payload.begin(), payload.end());
+    return reservation;
+  }
+
+  PageBufPtr decode_payload(PageBuf &&payload, uint8_t flags) const {
+    if (flags & MSG_FLAG_COMPRESSED) {
+      return std::make_shared<const PageBuf>(compressor_.decompress(payload.data(), payload.size()));
+    }
+    return std::make_shared<const PageBuf>(std::move(payload));
+  }
+
+  // CAS失败时放弃预留返回nullptr, 成功时返回新安装的页面. batch 不为空时这次写入属于它
+  Page *install(PageId pid, Page *expected, std::unique_ptr<Page> fresh, Reservation &reservation, const SegmentOp &op,
+                Batch *batch) {
+    Page *current = expected;
+    if (!table_.cas(pid, current, fresh.get())) {
+      reservation.abort();
+      return nullptr;
+    }
+    if (accountant_) {
+      accountant_->apply(op);
+    }
+    if (batch) {
+      batch->add(reservation.lsn());
+    }
+    reservation.complete();
+    if (expected != nullptr) {
+      table_.retire(expected);
+    }
+    Page *page = fresh.release();
+    if (page->free) {
+      evictor_.erase(pid);
+    } else {
+      track(pid, *page);
+    }
+    return page;
+  }
+
+  static size_t page_size(const Page &page) {
+    size_t size = sizeof(Page) + page.cache_info.size() * sizeof(CacheInfo);
+    for (auto &buf : page.bufs) {
+      size += sizeof(PageBuf) + buf->size();
+    }
+    return size;
+  }
+
+  // 页面进入内存或者变大之后记账, 超出容量时淘汰同一分片中的冷页面
+  // 刚读入或写入的页面自己不淘汰, 否则比分片容量还大的页面get之后马上被丢掉, link永远CAS失败
+  void track(PageId pid, const Page &page) {
+    size_t size = page_size(page);
+    evictor_.insert(pid, size);
+    for (PageId victim : evictor_.evict(pid)) {
+      if (victim == pid) {
+        evictor_.insert(pid, size);
+        continue;
+      }
+      page_out(victim);
+    }
+  }
+
+  // 丢掉页面在内存中的数据. 被并发修改的页面刚刚被写入方重新记账, 不用再管
+  void page_out(PageId pid) {
+    Page *page = table_.get(pid);
+    if (page == nullptr || !page->is_loaded()) {
+      return;
+    }
+    Lsn stable = log_.stable_lsn();
+    for (auto &info : page->cache_info) {
+      if (info.lsn > stable) {
+        evictor_.insert(pid, page_size(*page)); // 还没有落盘, 只能留在内存中
+        return;
+      }
+    }
+    auto fresh = std::make_unique<Page>(*page);
+    fresh->bufs.clear();
+    Page *expected = page;
+    if (table_.cas(pid, expected, fresh.get())) {
+      fresh.release();
+      table_.retire(page);
+    }
+  }
+
+  static bool is_inline_kind(MessageKind kind) {
+    return kind == MsgInlineNode || kind == MsgInlineLink || kind == MsgInlineMeta || kind == MsgCounter;
+  }
+
+  static void check_fragment(PageId pid, const unsigned char *header_bytes, const unsigned char *payload, size_t len) {
+    MessageHeader header = MessageHeader::from_char(header_bytes);
+    if (header.pid != pid || !is_inline_kind(header.kind) || header.len != len) {
+      throw std::runtime_error("fragment header does not belong to page " + std::to_string(pid));
+    }
+    if (MessageHeader::compute_crc(header_bytes, payload, len) != header.crc32) {
+      throw std::runtime_error("fragment crc mismatch for page " + std::to_string(pid));
+    }
+  }
+
+  // 已经落盘的inline fragment在内存映射中的位置(指向消息头), 不能从映射读时返回nullptr.
+  // 落盘的部分在segment被重用之前不会再变, 而重用要等所有读者离开epoch (见构造函数中的free hook)
+  const unsigned char *mapped_message(const CacheInfo &info, Lsn stable) {
+    if (!mapper_ || info.pointer.is_blob() || info.lsn > stable || info.log_size < MSG_HEADER_LEN) {
+      return nullptr;
+    }
+    LogOffset offset = info.pointer.lid();
+    LogOffset segment = offset / config_.segment_size * config_.segment_size;
+    const unsigned char *base = mapper_->segment(segment);
+    return base == nullptr ? nullptr : base + (offset - segment);
+  }
+
+  // 缺页时一次读入页面的全部fragment, 和cache_info一一对应
+  // 打开use_mmap_reads时, 已经落盘的inline fragment直接从内存映射拷贝, 不发起读
+  // inline fragment 按offset排序, 同一个segment中相邻或者相距不超过FRAGMENT_COALESCE_GAP的合并成一个区间,
+  // 中间的空隙读进丢弃缓冲区; 所有区间一起提交, 全部完成之后再逐个校验消息头和crc
+  std::vector<PageBufPtr> read_fragments(PageId pid, const std::vector<CacheInfo> &infos) {
+    std::vector<PageBufPtr> bufs(infos.size());
+    std::vector<size_t> order;
+    for (size_t i = 0; i < infos.size(); ++i) {
+      if (infos[i].pointer.is_blob()) {
+        if (!heap_) {
+          throw std::logic_error("blob fragment without a heap");
+        }
+        uint8_t flags = 0;
+        PageBuf payload = heap_->read(infos[i].pointer.heap_id, &flags);
+        bufs[i] = decode_payload(std::move(payload), flags);
+      } else if (infos[i].log_size < MSG_HEADER_LEN) {
+        throw std::logic_error("inline fragment without its log size");
+      } else {
+        order.push_back(i);
+      }
+    }
+    if (order.empty()) {
+      return bufs;
+    }
+    std::sort(order.begin(), order.end(),
+              [&infos](size_t a, size_t b) { return infos[a].pointer.lid() < infos[b].pointer.lid(); });
+
+    const uint64_t segment_size = config_.segment_size;
+    std::vector<std::array<unsigned char, MSG_HEADER_LEN>> headers(infos.size());
+    std::vector<PageBuf> payloads(infos.size());
+    PageBuf gap(FRAGMENT_COALESCE_GAP);
+    std::vector<SegmentIo::ReadVec> reads;
+    uint64_t end = 0;
+    Lsn stable = mapper_ ? log_.stable_lsn() : -1;
+    for (size_t i : order) {
+      if (const unsigned char *msg = mapped_message(infos[i], stable)) {
+        std::memcpy(headers[i].data(), msg, MSG_HEADER_LEN);
+        payloads[i].assign(msg + MSG_HEADER_LEN, msg + infos[i].log_size);
+        mapped_reads_.fetch_add(1, std::memory_order_relaxed);
+        continue;
+      }
+      LogOffset offset = infos[i].pointer.lid();
+      bool join = !reads.empty() && offset / segment_size == reads.back().offset / segment_size &&
+                  offset >= end && offset - end <= FRAGMENT_COALESCE_GAP &&
+                  reads.back().iovs.size() + 3 <= FRAGMENT_MAX_IOVS;
+      if (join && offset > end) {
+        reads.back().iovs.push_back(iovec {gap.data(), static_cast<size_t>(offset - end)});
+      } else if (!join) {
+        reads.push_back(SegmentIo::ReadVec {offset, {}});
+      }
+      payloads[i].resize(infos[i].log_size - MSG_HEADER_LEN);
+      reads.back().iovs.push_back(iovec {headers[i].data(), MSG_HEADER_LEN});
+      if (!payloads[i].empty()) {
+        reads.back().iovs.push_back(iovec {payloads[i].data(), payloads[i].size()});
+      }
+      end = offset + infos[i].log_size;
+    }
+    if (!reads.empty()) {
+      log_.io().read_vectored(reads);
+      read_ranges_.fetch_add(reads.size(), std::memory_order_relaxed);
+    }
+
+    for (size_t i : order) {
+      check_fragment(pid, headers[i].data(), payloads[i].data(), payloads[i].size());
+      bufs[i] = decode_payload(std::move(payloads[i]), MessageHeader::from_char(headers[i].data()).flags);
+    }
+    return bufs;
+  }
+
+  // 把整个页面物化成一个新的基准页写出, delta 为空时只合并已有的fragment
+  Page *consolidate(PageId pid, Page *expected, const PageBufPtr &delta, Batch *batch) {
+    std::vector<PageBufPtr> chain = expected->bufs;
+    if (delta) {
+      chain.push_back(delta);
+    }
+    Page *page = replace_with(pid, expected, std::make_shared<const PageBuf>(merge_(chain)), batch);
+    if (page != nullptr) {
+      consolidations_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return page;
+  }
+
+  Page *replace_with(PageId pid, Page *expected, PageBufPtr base, Batch *batch) {
+    auto reservation = write_message(MsgInlineNode, MsgBlobNode, pid, *base);
+    return replace_reserved(pid, expected, std::move(base), reservation, batch);
+  }
+
+  // expected 为nullptr(新的pid)或者pid的墓碑. 墓碑可能同时被cleaner重写, 这时返回false
+  bool allocate_reserved(PageId pid, Page *expected, PageBufPtr base, Reservation &reservation, Batch *batch) {
+    CacheInfo info {expected ? expected->ts() + 1 : 0, reservation.lsn(), reservation.pointer(),
+                    reservation.log_size()};
+    auto fresh = std::make_unique<Page>(Page {pid, {info}, {std::move(base)}});
+    SegmentOp op = SegmentOp::replace(pid, expected ? expected->cache_info : std::vector<CacheInfo> {}, info);
+    if (install(pid, expected, std::move(fresh), reservation, op, batch) != nullptr) {
+      return true;
+    }
+    if (expected == nullptr) {
+      throw std::logic_error("freshly allocated page id is already in use");
+    }
+    return false;
+  }
+
+  // 新页面的pid: 先重用最早释放的墓碑
+  PageId take_pid() {
+    if (free_count_.load(std::memory_order_acquire) > 0) {
+      std::lock_guard<std::mutex> lock(free_mu_);
+      if (!free_pids_.empty()) {
+        PageId pid = free_pids_.front();
+        free_pids_.pop_front();
+        free_count_.store(free_pids_.size(), std::memory_order_release);
+        return pid;
+      }
+    }
+    return next_pid_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void push_free_pid(PageId pid) {
+    std::lock_guard<std::mutex> lock(free_mu_);
+    free_pids_.push_back(pid);
+    free_count_.store(free_pids_.size(), std::memory_order_release);
+  }
+
+  // 用墓碑替换expected. expected 是墓碑时只是把MsgFree重写到日志尾部
+  bool free_page(PageId pid, Page *expected, Batch *batch) {
+    auto reservation = log_.reserve(MsgFree, pid, 0);
+    CacheInfo info {expected->ts() + 1, reservation.lsn(), reservation.pointer(), reservation.log_size()};
+    auto fresh = std::make_unique<Page>(Page {pid, {info}, {}, true});
+    return install(pid, expected, std::move(fresh), reservation, SegmentOp::replace(pid, expected->cache_info, info),
+                   batch) != nullptr;
+  }
+
+  // 写出读者已经离开的free_later, pid 留着墓碑不重用. cleaner可能同时在重写页面, CAS失败时读新的版本重试
+  void reclaim_freed() {
+    std::vector<PageId> pids;
+    {
+      std::lock_guard<std::mutex> lock(free_mu_);
+      if (freeing_.empty()) {
+        return;
+      }
+      pids.swap(freeing_);
+    }
+    for (PageId pid : pids) {
+      while (true) {
+        Page *page = table_.get(pid);
+        if (page == nullptr || page->free) {
+          break;
+        }
+        if (free_page(pid, page, nullptr)) {
+          freed_pages_.fetch_add(1, std::memory_order_relaxed);
+          break;
+        }
+      }
+    }
+  }
+
+  Page *link_reserved(PageId pid, Page *expected, PageBufPtr buf, Reservation &reservation, Batch *batch) {
+    CacheInfo info {expected->ts() + 1, reservation.lsn(), reservation.pointer(), reservation.log_size()};
+    auto fresh = std::make_unique<Page>(*expected);
+    fresh->cache_info.push_back(info);
+    fresh->bufs.push_back(std::move(buf));
+    return install(pid, expected, std::move(fresh), reservation, SegmentOp::link(pid, info), batch);
+  }
+
+  Page *replace_reserved(PageId pid, Page *expected, PageBufPtr base, Reservation &reservation, Batch *batch) {
+    CacheInfo info {expected->ts() + 1, reservation.lsn(), reservation.pointer(), reservation.log_size()};
+    auto fresh = std::make_unique<Page>(Page {pid, {info}, {std::move(base)}});
+    return install(pid, expected, std::move(fresh), reservation, SegmentOp::replace(pid, expected->cache_info, info),
+                   batch);
+  }
+
+  // 把高水位写进COUNTER_PID, 返回它的lsn. cleaner可能同时在重写这个页面, CAS失败时重试
+  Lsn write_idgen(uint64_t mark) {
+    while (true) {
+      auto reservation = log_.reserve(MsgCounter, COUNTER_PID, sizeof(mark));
+      std::memcpy(reservation.payload().data(), &mark, sizeof(mark));
+      SliceMut payload = reservation.payload();
+      auto buf = std::make_shared<const PageBuf>(payload.begin(), payload.end());
+      Lsn lsn = reservation.lsn();
+      Page *page = table_.get(COUNTER_PID);
+      if (page == nullptr) {
+        allocate_reserved(COUNTER_PID, nullptr, std::move(buf), reservation, nullptr);
+        return lsn;
+      }
+      if (replace_reserved(COUNTER_PID, page, std::move(buf), reservation, nullptr) != nullptr) {
+        return lsn;
+      }
+    }
+  }
+
+  // 保证 < end 的id都已经被落盘的高水位覆盖
+  void persist_idgen(uint64_t end) {
+    std::lock_guard<std::mutex> lock(idgen_mu_);
+    if (end <= idgen_durable_.load(std::memory_order_relaxed)) {
+      return;
+    }
+    uint64_t interval = std::max<uint64_t>(config_.idgen_persist_interval, 1);
+    if (end > idgen_written_) {
+      idgen_written_ = (end + interval - 1) / interval * interval;
+      idgen_lsn_ = write_idgen(idgen_written_);
+    }
+    log_.make_stable(idgen_lsn_);
+    idgen_durable_.store(idgen_written_, std::memory_order_release);
+    // 预先写出下一个高水位, 用到它时通常已经随其他写入落盘了
+    idgen_written_ += interval;
+    idgen_lsn_ = write_idgen(idgen_written_);
+  }
+
 public:
-  Page allocate_page(const Node &node);
+  // accountant 必须是 log 所使用的那一个, 没有heap时页面不能超过一条日志消息的上限
+  PageCache(const Inner &config, Log &log, std::shared_ptr<SegmentAccountant> accountant,
+            std::shared_ptr<Heap> heap, MergeFn merge)
+      : config_(config), log_(log), accountant_(std::move(accountant)), heap_(std::move(heap)),
+        merge_(std::move(merge)), compressor_(config.compression_factor, config.path.empty() ? "" : config.path + ".dict"),
+        free_count_(0), evictor_(config.cache_capacity), next_pid_(COUNTER_PID + 1), freed_pages_(0),
+        consolidations_(0), read_ranges_(0),
+        mapped_reads_(0), idgen_(0), idgen_durable_(0), idgen_written_(0), idgen_lsn_(-1),
+        id_blocks_(new IdBlock[Table::max_threads]) {
+    if (!config.use_mmap_reads) {
+      return;
+    }
+    mapper_ = std::make_unique<SegmentMap>(log_.fd(), config.segment_size);
+    if (accountant_) {
+      // segment回到Free时先取下映射, 等可能还拿着指向它的视图的读者离开epoch之后才允许日志重用
+      accountant_->set_free_hook([this](LogOffset offset) {
+        SegmentMap::Mapping mapping = mapper_->detach(offset);
+        table_.defer([this, mapping, offset] {
+          SegmentMap::unmap(mapping);
+          accountant_->release(offset);
+        });
+      });
+    }
+  }
+
+  // 此时不能再有线程访问. 还在等待读者离开的free_later在这里写出
+  ~PageCache() {
+    table_.drain();
+    try {
+      reclaim_freed();
+    } catch (const std::exception &e) {
+      tlog_error << "failed to free pages on shutdown: " << e.what();
+    }
+    if (mapper_ && accountant_) {
+      accountant_->set_free_hook(nullptr);
+    }
+    table_.for_each([](PageId, Page *page) { delete page; });
+  }
+
+  // 每个访问PageCache的线程先注册一次, 退出前注销
+  void register_thread(tcs_t &tcs) { table_.register_thread(tcs); }
+  void unregister_thread(tcs_t &tcs) { table_.unregister_thread(tcs); }
+
+  // get 返回的页面在guard析构之前都有效
+  Guard pin(const tcs_t &tcs) { return table_.pin(tcs); }
+
+  // 从恢复的结果建立页表, 页面内容在第一次get时才读入. 只能在开始并发访问之前调用
+  void load_snapshot(const Snapshot &snapshot) {
+    PageId max_pid = COUNTER_PID;
+    for (auto &entry : snapshot.pt) {
+      PageId pid = entry.first;
+      if (pid >> MAX_PID_BITS != 0) {
+        continue; // BATCH_MANIFEST_PID 之类的保留页
+      }
+      max_pid = std::max(max_pid, pid);
+      const PageState &state = entry.second;
+      if (state.type_ == Uninitialized) {
+        continue;
+      }
+      auto page = std::make_unique<Page>();
+      page->page_id = pid;
+      page->cache_info.push_back(CacheInfo {0, state.base_.lsn, state.base_.disk_ptr, state.base_.log_size});
+      if (state.type_ == Free) {
+        page->free = true;
+        push_free_pid(pid);
+      }
+      for (auto &frag : state.frags_) {
+        page->cache_info.push_back(CacheInfo {page->cache_info.size(), frag.lsn, frag.disk_ptr, frag.log_size});
+      }
+      if (Page *old = table_.swap(pid, page.release())) {
+        delete old;
+      }
+    }
+    next_pid_.store(max_pid + 1, std::memory_order_relaxed);
+
+    // 上次运行发出的id都小于落盘的高水位, 从它继续
+    if (Page *counter = table_.get(COUNTER_PID)) {
+      auto bufs = read_fragments(COUNTER_PID, counter->cache_info);
+      if (bufs.size() != 1 || bufs[0]->size() != sizeof(uint64_t)) {
+        throw std::runtime_error("id generator page is corrupted");
+      }
+      uint64_t mark;
+      std::memcpy(&mark, bufs[0]->data(), sizeof(mark));
+      idgen_.store(mark, std::memory_order_relaxed);
+      idgen_durable_.store(mark, std::memory_order_relaxed);
+      idgen_written_ = mark;
+    }
+  }
+
+  // 分配一个新页面, data 是它的基准页.
+  // 所有写入都可以带一个batch (见log.h), 成功的写入和它一起恢复或者一起丢弃; CAS失败的写入不属于它
+  PageId allocate(const Guard &guard, PageBuf data, Batch *batch = nullptr) {
+    (void)guard;
+    reclaim_freed();
+    PageId pid = take_pid();
+    auto base = std::make_shared<const PageBuf>(std::move(data));
+    while (true) {
+      Page *expected = table_.get(pid);
+      auto reservation = write_message(MsgInlineNode, MsgBlobNode, pid, *base);
+      if (allocate_reserved(pid, expected, base, reservation, batch)) {
+        return pid;
+      }
+    }
+  }
+
+  // 同allocate, value 直接序列化进日志
+  template <class T>
+  PageId allocate_serialized(const Guard &guard, const T &value, Batch *batch = nullptr) {
+    (void)guard;
+    reclaim_freed();
+    PageId pid = take_pid();
+    while (true) {
+      Page *expected = table_.get(pid);
+      PageBufPtr base;
+      auto reservation = write_serialized(MsgInlineNode, MsgBlobNode, pid, value, base);
+      if (allocate_reserved(pid, expected, std::move(base), reservation, batch)) {
+        return pid;
+      }
+    }
+  }
+
+  // 释放expected所在的页面, expected 已经不是当前版本时返回false. pid 马上可以被重用,
+  // 调用者要保证其他线程不会再用这个pid找它; 做不到时用free_later
+  bool free(const Guard &guard, PageId pid, Page *expected, Batch *batch = nullptr) {
+    (void)guard;
+    if (expected == nullptr || expected->free) {
+      throw std::invalid_argument("free requires a page returned by get");
+    }
+    reclaim_freed();
+    if (!free_page(pid, expected, batch)) {
+      return false;
+    }
+    freed_pages_.fetch_add(1, std::memory_order_relaxed);
+    push_free_pid(pid);
+    return true;
+  }
+
+  // 等现在所有guard析构之后再释放页面(那时的当前版本): 调用者已经让新的读者找不到它,
+  // 但是之前的读者可能还从旧版本中拿到这个pid. MsgFree在之后的allocate/free中写出, pid 重启之后才重用
+  void free_later(const Guard &guard, PageId pid) {
+    (void)guard;
+    table_.defer([this, pid] {
+      std::lock_guard<std::mutex> lock(free_mu_);
+      freeing_.push_back(pid);
+    });
+  }
+
+  // 给SegmentCleaner用: 把页面的当前版本重写到日志尾部, 墓碑重写它的MsgFree. 返回写入的字节数
+  size_t rewrite(const Guard &guard, PageId pid) {
+    while (true) {
+      Page *page = table_.get(pid);
+      if (page == nullptr) {
+        return 0;
+      }
+      if (page->free) {
+        if (free_page(pid, page, nullptr)) {
+          return MSG_HEADER_LEN;
+        }
+        continue;
+      }
+      page = get(guard, pid);
+      if (page == nullptr) {
+        continue;
+      }
+      PageBufPtr data = materialize(*page);
+      if (replace_with(pid, page, data, nullptr) != nullptr) {
+        return data->size();
+      }
+    }
+  }
+
+  // 返回页面的当前版本, 不存在或者已经释放时返回nullptr. 不在内存中的fragment在这里读入
+  Page *get(const Guard &guard, PageId pid) {
+    (void)guard;
+    while (true) {
+      Page *page = table_.get(pid);
+      if (page == nullptr || page->free) {
+        return nullptr;
+      }
+      if (page->is_loaded()) {
+        evictor_.accessed(pid);
+        return page;
+      }
+      auto fresh = std::make_unique<Page>(*page);
+      fresh->bufs = read_fragments(pid, page->cache_info);
+      Page *expected = page;
+      if (table_.cas(pid, expected, fresh.get())) {
+        table_.retire(page);
+        page = fresh.release();
+        track(pid, *page);
+        return page;
+      }
+    }
+  }
+
+  // 在expected上追加一个delta. expected 已经不是当前版本时返回nullptr, 成功时返回新的版本
+  // 链上的delta达到PAGE_CONSOLIDATION_THRESHOLD时, 连同这个delta一起合并成新的基准页
+  Page *link(const Guard &guard, PageId pid, Page *expected, PageBuf delta, Batch *batch = nullptr) {
+    (void)guard;
+    if (expected == nullptr || !expected->is_loaded()) {
+      throw std::invalid_argument("link requires a page returned by get");
+    }
+    auto buf = std::make_shared<const PageBuf>(std::move(delta));
+    if (expected->frag_count() >= PAGE_CONSOLIDATION_THRESHOLD) {
+      return consolidate(pid, expected, buf, batch);
+    }
+    auto reservation = write_message(MsgInlineLink, MsgBlobLink, pid, *buf);
+    return link_reserved(pid, expected, std::move(buf), reservation, batch);
+  }
+
+  // 同link, delta 直接序列化进日志
+  template <class T>
+  Page *link_serialized(const Guard &guard, PageId pid, Page *expected, const T &delta, Batch *batch = nullptr) {
+    (void)guard;
+    if (expected == nullptr || !expected->is_loaded()) {
+      throw std::invalid_argument("link requires a page returned by get");
+    }
+    if (expected->frag_count() >= PAGE_CONSOLIDATION_THRESHOLD) {
+      return consolidate(pid, expected, std::make_shared<const PageBuf>(Serialize::to_vec(delta)), batch);
+    }
+    PageBufPtr buf;
+    auto reservation = write_serialized(MsgInlineLink, MsgBlobLink, pid, delta, buf);
+    return link_reserved(pid, expected, std::move(buf), reservation, batch);
+  }
+
+  // 用新的基准页整体替换expected, 语义同link
+  Page *replace(const Guard &guard, PageId pid, Page *expected, PageBuf base, Batch *batch = nullptr) {
+    (void)guard;
+    if (expected == nullptr) {
+      throw std::invalid_argument("replace requires a page returned by get");
+    }
+    return replace_with(pid, expected, std::make_shared<const PageBuf>(std::move(base)), batch);
+  }
+
+  // 同replace, base 直接序列化进日志
+  template <class T>
+  Page *replace_serialized(const Guard &guard, PageId pid, Page *expected, const T &base, Batch *batch = nullptr) {
+    (void)guard;
+    if (expected == nullptr) {
+      throw std::invalid_argument("replace requires a page returned by get");
+    }
+    PageBufPtr buf;
+    auto reservation = write_serialized(MsgInlineNode, MsgBlobNode, pid, base, buf);
+    return replace_reserved(pid, expected, std::move(buf), reservation, batch);
+  }
+
+  // 发出一个id: 全局唯一, 同一个线程拿到的严格递增, 重启之后也不会重复.
+  // 偶尔要等高水位落盘, 不要在batch写到一半时调用
+  uint64_t generate_id(const Guard &guard) {
+    IdBlock &block = id_blocks_[guard.thread_id()];
+    if (block.next == block.end) {
+      uint64_t len = std::min<uint64_t>(IDGEN_BLOCK, std::max<uint64_t>(config_.idgen_persist_interval, 1));
+      uint64_t start = idgen_.fetch_add(len, std::memory_order_relaxed);
+      if (start + len > idgen_durable_.load(std::memory_order_acquire)) {
+        persist_idgen(start + len);
+      }
+      block.next = start;
+      block.end = start + len;
+    }
+    return block.next++;
+  }
+
+  // 页面的完整内容. 合并过的页面直接返回基准页, 不需要拷贝
+  PageBufPtr materialize(const Page &page) const {
+    if (!page.is_loaded()) {
+      throw std::invalid_argument("page is not loaded");
+    }
+    if (page.bufs.size() == 1) {
+      return page.bufs.front();
+    }
+    return std::make_shared<const PageBuf>(merge_(page.bufs));
+  }
+
+  // 页面每个fragment的只读视图(和cache_info一一对应), 在guard析构之前有效, 页面不存在时返回false.
+  // 常驻的页面指向内存中的数据. 不在内存中的页面如果所有fragment都是已经落盘且没有压缩的inline消息,
+  // 直接指向内存映射, 既不读入缓存也不拷贝; 否则像get一样先读入
+  bool view(const Guard &guard, PageId pid, std::vector<Slice> &frags) {
+    frags.clear();
+    Page *page = table_.get(pid);
+    if (page == nullptr || page->free) {
+      return false;
+    }
+    if (!page->is_loaded() && mapper_) {
+      Lsn stable = log_.stable_lsn();
+      for (auto &info : page->cache_info) {
+        const unsigned char *msg = mapped_message(info, stable);
+        if (msg == nullptr || (MessageHeader::from_char(msg).flags & MSG_FLAG_COMPRESSED)) {
+          break;
+        }
+        size_t len = info.log_size - MSG_HEADER_LEN;
+        check_fragment(pid, msg, msg + MSG_HEADER_LEN, len);
+        frags.emplace_back(reinterpret_cast<const char *>(msg + MSG_HEADER_LEN), len);
+      }
+      if (frags.size() == page->cache_info.size()) {
+        mapped_reads_.fetch_add(frags.size(), std::memory_order_relaxed);
+        return true;
+      }
+      frags.clear();
+    }
+    page = get(guard, pid);
+    if (page == nullptr) {
+      return false;
+    }
+    for (auto &buf : page->bufs) {
+      frags.emplace_back(reinterpret_cast<const char *>(buf->data()), buf->size());
+    }
+    return true;
+  }
+
+  // 内存中页面数据的总量
+  size_t resident_bytes() const {
+    return evictor_.size_in_bytes();
+  }
+
+  // free 和 free_later 释放的页面数
+  uint64_t freed_pages() const {
+    return freed_pages_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t consolidations() const {
+    return consolidations_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t read_ranges() const {
+    return read_ranges_.load(std::memory_order_relaxed);
+  }
 
-  Page link(int page_id, const Page &page, Node delta);
+  uint64_t mapped_reads() const {
+    return mapped_reads_.load(std::memory_order_relaxed);
+  }
 };
@@ -0,0 +1,387 @@
+#pragma once
+
+/*
+页表: PageId -> 页面在内存中的状态
+
+三层基数树, 直接用PageId的位索引, 查找只有三次原子读, 没有锁也没有哈希:
+
+  PageId (MAX_PID_BITS = 37) = [root 13位][mid 12位][leaf 12位]
+
+root 在构造时分配, mid 和 leaf 第一次写入时才分配, 用CAS安装, 输掉竞争的一方释放自己的数组.
+leaf 中每一项是一个指向页面状态的原子指针, 页表本身不拥有页面状态.
+
+全空的leaf可以被回收 (reclaim_empty_leaves):
+  1. 把leaf的每一项从nullptr CAS成SEALED, 有任何一项非空就撤销, 放弃回收
+  2. 把mid中的指针CAS成nullptr, 之后的写入会安装新的leaf
+  3. 交给Cepoch, 等所有可能还持有旧leaf的线程离开epoch之后再释放
+写入遇到SEALED时等待回收者完成, 然后在新的leaf上重试; 读到SEALED等同于nullptr.
+
+所有访问都必须在pin返回的epoch block中进行.
+从页表中换下来的页面状态可以交给retire, 同样等epoch安全之后delete.
+其它需要等读者离开之后才能做的事(例如解除内存映射)交给defer.
+retire 在写路径上: 每个线程放进自己的分片, 只记下当前epoch, 分片攒够RETIRE_BATCH之后推进一次epoch再清理,
+写者之间不共享锁, 也不会每次写入都推进全局epoch. defer 很少发生, 放在共享的列表里, 分片清理时顺便处理.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "def_types.h"
+#include "constant.h"
+#include "../ebr/epoch.h"
+#include "../util/common_def.h"
+
+constexpr size_t PT_LEAF_BITS = 12;
+constexpr size_t PT_MID_BITS = 12;
+constexpr size_t PT_ROOT_BITS = MAX_PID_BITS - PT_MID_BITS - PT_LEAF_BITS;
+constexpr size_t PT_LEAF_FANOUT = size_t(1) << PT_LEAF_BITS;
+constexpr size_t PT_MID_FANOUT = size_t(1) << PT_MID_BITS;
+constexpr size_t PT_ROOT_FANOUT = size_t(1) << PT_ROOT_BITS;
+
+template <class T, size_t max_epoch_thread_number = 128> class PageTable final {
+  NO_COPY_MOVE(PageTable);
+  static_assert(alignof(T) >= 2, "the lowest pointer bit marks a sealed entry");
+
+public:
+  using PtEpoch = Cepoch<max_epoch_thread_number>;
+  using Guard = typename PtEpoch::CautoEpochBlock;
+  static constexpr size_t max_threads = max_epoch_thread_number; // 注册线程的tcs在 [0, max_threads) 之间
+
+private:
+  struct Leaf {
+    std::atomic<T *> entries[PT_LEAF_FANOUT];
+
+    Leaf() {
+      for (auto &entry : entries) {
+        entry.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  struct Mid {
+    std::atomic<Leaf *> leaves[PT_MID_FANOUT];
+
+    Mid() {
+      for (auto &leaf : leaves) {
+        leaf.store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  struct Retired {
+    typename PtEpoch::epoch_counter_t epoch;
+    Leaf *leaf;
+  };
+
+  struct RetiredValue {
+    typename PtEpoch::epoch_counter_t epoch;
+    T *value;
+  };
+
+  struct Deferred {
+    typename PtEpoch::epoch_counter_t epoch;
+    std::function<void()> fn;
+  };
+
+  static constexpr size_t RETIRE_BATCH = 64; // 攒够这么多再扫描一次epoch
+  static constexpr size_t RETIRE_SHARDS = 16;
+
+  // 一组线程的待回收对象, 线程按第一次retire的顺序轮流分到各个分片
+  struct alignas(CACHE_LINE_FETCH_ALIGN) RetireShard {
+    std::mutex mu;
+    std::vector<RetiredValue> values;
+  };
+
+  static T *sealed() {
+    return reinterpret_cast<T *>(uintptr_t(1));
+  }
+
+  std::unique_ptr<std::atomic<Mid *>[]> root_;
+  PtEpoch epoch_;
+  std::mutex reclaim_mu_; // 保护retired_和deferred_, 读写不需要
+  std::vector<Retired> retired_;
+  std::vector<Deferred> deferred_;
+  std::unique_ptr<RetireShard[]> shards_;
+  std::atomic<size_t> leaf_count_;
+
+  static size_t shard_index() {
+    static std::atomic<size_t> next {0};
+    static thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % RETIRE_SHARDS;
+    return index;
+  }
+
+  // 释放items中已经安全的对象, 其余的留下. 用partition一次整理, 不在中间erase
+  template <class Item, class Reclaim>
+  static size_t reclaim_safe(std::vector<Item> &items, typename PtEpoch::epoch_counter_t safe, Reclaim &&reclaim) {
+    auto done = std::partition(items.begin(), items.end(),
+                               [safe](const Item &item) { return !PtEpoch::safe_to_reclaim(item.epoch, safe); });
+    size_t n = static_cast<size_t>(items.end() - done);
+    for (auto it = done; it != items.end(); ++it) {
+      reclaim(*it);
+    }
+    items.erase(done, items.end());
+    return n;
+  }
+
+  // 推进一次epoch, 之前记下当前epoch的对象在读者离开之后就可以回收. 持有shard.mu时调用
+  void free_shard_locked(RetireShard &shard) {
+    epoch_.bump_epoch_for_reclaim();
+    auto safe = epoch_.get_safe_reclaim_epoch(true);
+    reclaim_safe(shard.values, safe, [](RetiredValue &retired) { delete retired.value; });
+    // 别的线程正在处理时跳过, 下一次清理再说
+    std::unique_lock<std::mutex> lock(reclaim_mu_, std::try_to_lock);
+    if (lock.owns_lock()) {
+      free_retired_locked();
+    }
+  }
+
+  void free_shards() {
+    for (size_t i = 0; i < RETIRE_SHARDS; ++i) {
+      std::scoped_lock<std::mutex> lock(shards_[i].mu);
+      free_shard_locked(shards_[i]);
+    }
+  }
+
+  static void check_pid(PageId pid) {
+    if (UNLIKELY(pid >> MAX_PID_BITS != 0)) {
+      throw std::out_of_range("page id exceeds MAX_PID_BITS");
+    }
+  }
+
+  static size_t root_index(PageId pid) { return static_cast<size_t>(pid >> (PT_MID_BITS + PT_LEAF_BITS)); }
+  static size_t mid_index(PageId pid) { return static_cast<size_t>(pid >> PT_LEAF_BITS) & (PT_MID_FANOUT - 1); }
+  static size_t leaf_index(PageId pid) { return static_cast<size_t>(pid) & (PT_LEAF_FANOUT - 1); }
+
+  Leaf *find_leaf(PageId pid) const {
+    Mid *mid = root_[root_index(pid)].load(std::memory_order_acquire);
+    if (mid == nullptr) {
+      return nullptr;
+    }
+    return mid->leaves[mid_index(pid)].load(std::memory_order_acquire);
+  }
+
+  // 找到pid所在的leaf, 不存在时分配并安装
+  Leaf *ensure_leaf(PageId pid) {
+    auto &mid_slot = root_[root_index(pid)];
+    Mid *mid = mid_slot.load(std::memory_order_acquire);
+    if (UNLIKELY(mid == nullptr)) {
+      Mid *fresh = new Mid();
+      if (mid_slot.compare_exchange_strong(mid, fresh, std::memory_order_acq_rel)) {
+        mid = fresh;
+      } else {
+        delete fresh;
+      }
+    }
+    auto &leaf_slot = mid->leaves[mid_index(pid)];
+    Leaf *leaf = leaf_slot.load(std::memory_order_acquire);
+    if (UNLIKELY(leaf == nullptr)) {
+      Leaf *fresh = new Leaf();
+      if (leaf_slot.compare_exchange_strong(leaf, fresh, std::memory_order_acq_rel)) {
+        leaf = fresh;
+        leaf_count_.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        delete fresh;
+      }
+    }
+    return leaf;
+  }
+
+  // 把leaf中全部为空的项封住, 失败时恢复原样
+  static bool seal(Leaf &leaf) {
+    for (size_t i = 0; i < PT_LEAF_FANOUT; ++i) {
+      T *expected = nullptr;
+      if (!leaf.entries[i].compare_exchange_strong(expected, sealed(), std::memory_order_acq_rel)) {
+        for (size_t j = 0; j < i; ++j) {
+          leaf.entries[j].store(nullptr, std::memory_order_release);
+        }
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static bool maybe_empty(const Leaf &leaf) {
+    for (auto &entry : leaf.entries) {
+      if (entry.load(std::memory_order_relaxed) != nullptr) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // 持有 reclaim_mu_ 时调用
+  size_t free_retired_locked() {
+    auto safe = epoch_.get_safe_reclaim_epoch(true);
+    reclaim_safe(deferred_, safe, [](Deferred &deferred) { deferred.fn(); });
+    return reclaim_safe(retired_, safe, [](Retired &retired) { delete retired.leaf; });
+  }
+
+public:
+  PageTable() : root_(new std::atomic<Mid *>[PT_ROOT_FANOUT]), shards_(new RetireShard[RETIRE_SHARDS]), leaf_count_(0) {
+    for (size_t i = 0; i < PT_ROOT_FANOUT; ++i) {
+      root_[i].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  // 析构时不能再有线程访问页表
+  ~PageTable() {
+    for (size_t i = 0; i < PT_ROOT_FANOUT; ++i) {
+      Mid *mid = root_[i].load(std::memory_order_relaxed);
+      if (mid == nullptr) {
+        continue;
+      }
+      for (auto &leaf : mid->leaves) {
+        delete leaf.load(std::memory_order_relaxed);
+      }
+      delete mid;
+    }
+    for (auto &retired : retired_) {
+      delete retired.leaf;
+    }
+    for (size_t i = 0; i < RETIRE_SHARDS; ++i) {
+      for (auto &retired : shards_[i].values) {
+        delete retired.value;
+      }
+    }
+    for (auto &deferred : deferred_) {
+      deferred.fn();
+    }
+  }
+
+  // 每个访问页表的线程先注册一次, 退出前注销
+  void register_thread(tcs_t &tcs) { epoch_.register_epoch_thread(tcs); }
+  void unregister_thread(tcs_t &tcs) { epoch_.unregister_epoch_thread(tcs); }
+
+  // 进入epoch, 返回的guard析构之前拿到的leaf和页面状态都不会被释放
+  Guard pin(const tcs_t &tcs) { return epoch_.enter_block(tcs, false, nullptr); }
+
+  T *get(PageId pid) const {
+    check_pid(pid);
+    Leaf *leaf = find_leaf(pid);
+    if (leaf == nullptr) {
+      return nullptr;
+    }
+    T *value = leaf->entries[leaf_index(pid)].load(std::memory_order_acquire);
+    return value == sealed() ? nullptr : value;
+  }
+
+  // 当前值等于expected时换成desired; 失败时expected被更新为当前值
+  bool cas(PageId pid, T *&expected, T *desired) {
+    check_pid(pid);
+    while (true) {
+      auto &entry = ensure_leaf(pid)->entries[leaf_index(pid)];
+      T *current = entry.load(std::memory_order_acquire);
+      if (UNLIKELY(current == sealed())) {
+        std::this_thread::yield(); // 回收者马上会把leaf摘掉或者解封
+        continue;
+      }
+      if (current != expected) {
+        expected = current;
+        return false;
+      }
+      if (entry.compare_exchange_strong(current, desired, std::memory_order_acq_rel)) {
+        return true;
+      }
+      if (current != sealed()) {
+        expected = current;
+        return false;
+      }
+    }
+  }
+
+  // 无条件替换, 返回旧值
+  T *swap(PageId pid, T *desired) {
+    T *expected = get(pid);
+    while (!cas(pid, expected, desired)) {
+    }
+    return expected;
+  }
+
+  // value 已经被cas/swap从页表中换下, 等所有可能还持有它的线程离开epoch之后释放
+  void retire(T *value) {
+    auto epoch = epoch_.current_epoch();
+    RetireShard &shard = shards_[shard_index()];
+    std::scoped_lock<std::mutex> lock(shard.mu);
+    shard.values.push_back(RetiredValue {epoch, value});
+    if (shard.values.size() % RETIRE_BATCH == 0) {
+      free_shard_locked(shard);
+    }
+  }
+
+  // 等所有现在可能在epoch中的线程离开之后调用fn, fn 在回收者的锁中执行, 不能再调用页表的回收接口
+  void defer(std::function<void()> fn) {
+    auto epoch = epoch_.bump_epoch_for_reclaim();
+    std::scoped_lock<std::mutex> lock(reclaim_mu_);
+    deferred_.push_back(Deferred {epoch, std::move(fn)});
+    if (deferred_.size() % RETIRE_BATCH == 0) {
+      free_retired_locked();
+    }
+  }
+
+  // 按pid顺序访问所有非空的项, 调用者需要在epoch block中, 或者保证没有并发的回收
+  template <class F> void for_each(F &&f) const {
+    for (size_t r = 0; r < PT_ROOT_FANOUT; ++r) {
+      Mid *mid = root_[r].load(std::memory_order_acquire);
+      if (mid == nullptr) {
+        continue;
+      }
+      for (size_t m = 0; m < PT_MID_FANOUT; ++m) {
+        Leaf *leaf = mid->leaves[m].load(std::memory_order_acquire);
+        if (leaf == nullptr) {
+          continue;
+        }
+        for (size_t l = 0; l < PT_LEAF_FANOUT; ++l) {
+          T *value = leaf->entries[l].load(std::memory_order_acquire);
+          if (value != nullptr && value != sealed()) {
+            f((PageId(r) << (PT_MID_BITS + PT_LEAF_BITS)) | (PageId(m) << PT_LEAF_BITS) | PageId(l), value);
+          }
+        }
+      }
+    }
+  }
+
+  // 回收全空的leaf, 返回摘下的leaf数量. 可以和读写并发执行
+  size_t reclaim_empty_leaves() {
+    std::scoped_lock<std::mutex> lock(reclaim_mu_);
+    size_t unlinked = 0;
+    for (size_t r = 0; r < PT_ROOT_FANOUT; ++r) {
+      Mid *mid = root_[r].load(std::memory_order_acquire);
+      if (mid == nullptr) {
+        continue;
+      }
+      for (auto &slot : mid->leaves) {
+        Leaf *leaf = slot.load(std::memory_order_acquire);
+        if (leaf == nullptr || !maybe_empty(*leaf) || !seal(*leaf)) {
+          continue;
+        }
+        // 只有回收者会把非空的slot改掉
+        slot.store(nullptr, std::memory_order_release);
+        retired_.push_back(Retired {epoch_.bump_epoch_for_reclaim(), leaf});
+        leaf_count_.fetch_sub(1, std::memory_order_relaxed);
+        ++unlinked;
+      }
+    }
+    free_retired_locked();
+    return unlinked;
+  }
+
+  // 释放已经没有线程能看到的leaf和页面状态, 执行可以执行的defer, 返回还在等待的leaf数量
+  size_t drain() {
+    free_shards();
+    std::scoped_lock<std::mutex> lock(reclaim_mu_);
+    free_retired_locked();
+    return retired_.size();
+  }
+
+  size_t leaf_count() const {
+    return leaf_count_.load(std::memory_order_relaxed);
+  }
+};
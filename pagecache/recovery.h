@@ -0,0 +1,470 @@
+#pragma once
+
+/*
+崩溃恢复
+
+1. 并行读取所有segment的头部, 丢弃crc不正确的(未写入或者写了一半)
+2. 按lsn排序, 根据头部中最大的 max_stable_lsn 划分出"不稳定尾部" (见segment.h顶部的说明),
+   尾部的segment必须从 max_stable_lsn + 1 所在的segment开始并且lsn连续, 在第一个空洞处截断
+3. 多个线程并行扫描segment, 校验每条消息的crc和segment_lsn, 记录segment是否完整
+4. 尾部中第一个不完整的segment之后的segment全部丢弃, 否则会破坏日志的线性化
+5. 把segment按lsn切成连续的几段, 每个线程为自己的一段构建部分PageState, 再按lsn顺序合并
+
+6. 批次清单 (见log.h中的Batch) 没有对应的结束消息, 或者结束消息记录的最后一个lsn超出恢复出来的日志时,
+   从这个清单开始截断, 批次中的写入一条都不保留. 清单的消息头在磁盘上被清零, 之后的segment和普通的尾部一样被丢弃
+
+被丢弃的segment的头部会被清零, 防止之后写入的相同lsn的segment和它们混淆
+
+多个lane (见iobuf.h) 写出的segment共享同一个lsn空间, 按lsn排序之后就是合并好的日志, 不需要区分lane
+
+有快照时以快照为起点, 完全包含在快照里的segment只读头部, 不再扫描 (见snapshot_file.h)
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <iterator>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <unistd.h>
+
+#include "def_types.h"
+#include "constant.h"
+#include "disk_pointer.h"
+#include "io_unix.h"
+#include "iobuf.h"
+#include "logger.h"
+#include "snapshot.h"
+#include "../config.h"
+#include "../3rd/log/tlog.h"
+
+class Recovery {
+  // 扫描出来的一条有效消息
+  struct RecoveredMessage {
+    MessageKind kind;
+    PageId pid;
+    Lsn lsn;
+    LogOffset offset;
+    uint64_t log_size; // 消息头 + 负载
+    HeapId heap_id; // 只有blob消息有
+  };
+
+  // 批次清单: 清单的lsn, 批次最后一条消息的lsn. 结束消息也记成一条, lsn是它所属的清单
+  struct Manifest {
+    Lsn lsn;
+    Lsn last;
+  };
+
+  struct SegmentScan {
+    LogOffset offset;
+    SegmentHeader header;
+    std::vector<RecoveredMessage> messages;
+    std::vector<Manifest> manifests;
+    std::vector<Manifest> commits;
+    size_t end = 0; // 第一个无效字节在segment中的位置
+    bool complete = false; // 以MsgCap结束, 或者剩余空间已经放不下一条消息
+  };
+
+  // 用threads个线程处理[0, n), fn(worker, i)
+  static void parallel_for(size_t threads, size_t n, const std::function<void(size_t, size_t)> &fn) {
+    threads = std::max<size_t>(1, std::min(threads, n));
+    std::atomic<size_t> next{0};
+    std::exception_ptr error;
+    std::mutex error_mu;
+    auto run = [&](size_t worker) {
+      try {
+        for (size_t i = next.fetch_add(1); i < n; i = next.fetch_add(1)) {
+          fn(worker, i);
+        }
+      } catch (...) {
+        std::scoped_lock<std::mutex> lock(error_mu);
+        error = std::current_exception();
+        next.store(n);
+      }
+    };
+    std::vector<std::thread> workers;
+    for (size_t worker = 1; worker < threads; ++worker) {
+      workers.emplace_back(run, worker);
+    }
+    run(0);
+    for (auto &t : workers) {
+      t.join();
+    }
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+  // 并行读取offsets处的segment头部, 返回其中有效的, 按lsn排序
+  static std::vector<SegmentScan> read_headers(int fd, size_t segment_size, const std::vector<LogOffset> &offsets,
+                                               size_t threads) {
+    size_t n = offsets.size();
+    // O_DIRECT 下至少读一个对齐的块
+    size_t block = std::min(segment_size, DIRECT_IO_ALIGNMENT);
+    std::vector<std::unique_ptr<AlignedBuf>> bufs(std::max<size_t>(1, std::min(threads, n)));
+    std::vector<SegmentScan> segments(n);
+    parallel_for(threads, n, [&](size_t worker, size_t i) {
+      if (!bufs[worker]) {
+        bufs[worker] = std::make_unique<AlignedBuf>(block);
+      }
+      SegmentScan &seg = segments[i];
+      seg.offset = offsets[i];
+      seg.header = SegmentHeader {0, 0, false};
+      if (pread_exact(fd, bufs[worker]->ptr, block, seg.offset) >= SEG_HEADER_LEN) {
+        seg.header = SegmentHeader::from_char(bufs[worker]->ptr);
+      }
+    });
+    segments.erase(std::remove_if(segments.begin(), segments.end(),
+                                  [](const SegmentScan &seg) { return !seg.header.ok; }),
+                   segments.end());
+    std::sort(segments.begin(), segments.end(),
+              [](const SegmentScan &a, const SegmentScan &b) { return a.header.lsn < b.header.lsn; });
+    return segments;
+  }
+
+  static void scan_segment(int fd, size_t segment_size, SegmentScan &seg, AlignedBuf &buf, Lsn after, Lsn upto) {
+    size_t n = pread_exact(fd, buf.ptr, segment_size, seg.offset);
+    size_t at = SEG_HEADER_LEN;
+    while (at + MSG_HEADER_LEN <= n && seg.header.lsn + static_cast<Lsn>(at) <= upto) {
+      const unsigned char *msg = buf.ptr + at;
+      MessageHeader header = MessageHeader::from_char(msg);
+      if (header.kind == MsgCorrupted || header.kind > MsgBatchCommit || header.segment_lsn != seg.header.lsn ||
+          header.len > n - at - MSG_HEADER_LEN || MessageHeader::compute_crc(msg, header.len) != header.crc32 ||
+          (is_blob(header.kind) && header.len != HEAP_ID_LEN) ||
+          (header.kind == MsgBatchManifest && header.len != sizeof(Lsn)) ||
+          (header.kind == MsgBatchCommit && header.len != 2 * sizeof(Lsn))) {
+        break;
+      }
+      if (header.kind == MsgCap) {
+        seg.complete = true;
+        at = segment_size;
+        break;
+      }
+      if (header.kind == MsgBatchManifest) {
+        Manifest manifest {seg.header.lsn + static_cast<Lsn>(at), 0};
+        std::memcpy(&manifest.last, msg + MSG_HEADER_LEN, sizeof(Lsn));
+        if (manifest.lsn > after) {
+          seg.manifests.push_back(manifest);
+        }
+      } else if (header.kind == MsgBatchCommit) {
+        // 批次的结尾取结束消息本身和它记下的最后一条消息中较大的那个
+        Manifest commit {0, seg.header.lsn + static_cast<Lsn>(at)};
+        Lsn last;
+        std::memcpy(&commit.lsn, msg + MSG_HEADER_LEN, sizeof(Lsn));
+        std::memcpy(&last, msg + MSG_HEADER_LEN + sizeof(Lsn), sizeof(Lsn));
+        commit.last = std::max(commit.last, last);
+        if (commit.lsn > after) {
+          seg.commits.push_back(commit);
+        }
+      } else if (header.kind != MsgCanceled && seg.header.lsn + static_cast<Lsn>(at) > after) {
+        HeapId heap_id {0, 0};
+        if (is_blob(header.kind)) {
+          heap_id = decode_heap_id(msg + MSG_HEADER_LEN);
+        }
+        seg.messages.push_back(RecoveredMessage {header.kind, header.pid, seg.header.lsn + static_cast<Lsn>(at),
+                                                 seg.offset + at, MSG_HEADER_LEN + header.len, heap_id});
+      }
+      at += MSG_HEADER_LEN + header.len;
+    }
+    seg.end = at;
+    seg.complete = seg.complete || segment_size - at <= MSG_HEADER_LEN;
+  }
+
+  // 返回尾部空洞之前的segment数量
+  static size_t contiguous_prefix(const std::vector<SegmentScan> &segments, size_t segment_size, Lsn max_stable) {
+    for (size_t i = 0; i < segments.size(); ++i) {
+      Lsn lsn = segments[i].header.lsn;
+      if (lsn + static_cast<Lsn>(segment_size) - 1 <= max_stable) {
+        continue; // 稳定的segment之间的空洞是被清理掉的segment
+      }
+      bool first_in_tail = i == 0 || segments[i - 1].header.lsn + static_cast<Lsn>(segment_size) - 1 <= max_stable;
+      bool contiguous = first_in_tail ? lsn <= max_stable + 1
+                                      : lsn == segments[i - 1].header.lsn + static_cast<Lsn>(segment_size);
+      if (!contiguous) {
+        return i;
+      }
+    }
+    return segments.size();
+  }
+
+  static bool is_blob(MessageKind kind) {
+    return kind == MsgBlobNode || kind == MsgBlobLink || kind == MsgBlobMeta;
+  }
+
+  static void apply(PageState &state, const RecoveredMessage &msg) {
+    DiskPtr ptr = is_blob(msg.kind) ? DiskPtr::new_blob(msg.offset, msg.heap_id) : DiskPtr::new_inline(msg.offset);
+    CacheInfoWithoutTs info {msg.lsn, ptr, msg.log_size};
+    switch (msg.kind) {
+    case MsgInlineNode:
+    case MsgBlobNode:
+    case MsgInlineMeta:
+    case MsgBlobMeta:
+    case MsgCounter:
+      state.set_base(info);
+      break;
+    case MsgInlineLink:
+    case MsgBlobLink:
+      state.push_frag(info);
+      break;
+    case MsgFree:
+      state.set_free(info);
+      break;
+    default:
+      break;
+    }
+  }
+
+  // 清零被丢弃的segment的头部
+  static void invalidate(int fd, size_t segment_size, const std::vector<SegmentScan> &discarded) {
+    if (discarded.empty()) {
+      return;
+    }
+    AlignedBuf zeros(std::min(segment_size, DIRECT_IO_ALIGNMENT));
+    for (auto &seg : discarded) {
+      tlog_warn << "discarding segment at " << seg.offset << " with lsn " << seg.header.lsn;
+      pwrite_all(fd, zeros.ptr, zeros.len, seg.offset);
+    }
+    if (::fdatasync(fd) != 0) {
+      throw std::system_error(errno, std::generic_category(), "fdatasync");
+    }
+  }
+
+  // 找出 segments[0, keep) 中没有完整落盘的批次, 把日志截断到其中最早的清单之前.
+  // 没有找到结束消息的批次不完整. 截断点之前的批次如果跨过截断点也不完整, 所以反复检查直到截断点不再移动.
+  // 返回新的日志末尾
+  static Lsn drop_partial_batches(int fd, std::vector<SegmentScan> &segments, size_t &keep, Lsn tip) {
+    std::map<Lsn, Lsn> ends;
+    for (size_t i = 0; i < keep; ++i) {
+      for (auto &commit : segments[i].commits) {
+        ends[commit.lsn] = commit.last;
+      }
+    }
+    std::vector<std::pair<Manifest, size_t>> manifests;
+    for (size_t i = 0; i < keep; ++i) {
+      for (auto manifest : segments[i].manifests) {
+        auto end = ends.find(manifest.lsn);
+        manifest.last = end != ends.end() ? end->second : std::numeric_limits<Lsn>::max();
+        manifests.emplace_back(manifest, i);
+      }
+    }
+    Lsn cut = tip + 1;
+    size_t cut_segment = keep;
+    for (bool moved = true; moved;) {
+      moved = false;
+      for (auto &entry : manifests) {
+        if (entry.first.lsn < cut && entry.first.last >= cut) {
+          cut = entry.first.lsn;
+          cut_segment = entry.second;
+          moved = true;
+        }
+      }
+    }
+    if (cut > tip) {
+      return tip;
+    }
+
+    SegmentScan &seg = segments[cut_segment];
+    tlog_warn << "batch at lsn " << cut << " is incomplete, truncating the log from there";
+    seg.messages.erase(std::remove_if(seg.messages.begin(), seg.messages.end(),
+                                      [&](const RecoveredMessage &msg) { return msg.lsn >= cut; }),
+                       seg.messages.end());
+    seg.end = static_cast<size_t>(cut - seg.header.lsn);
+    keep = cut_segment + 1;
+
+    // 清零清单的消息头, 下次恢复在这里停下. O_DIRECT 下按对齐的块读改写
+    LogOffset at = seg.offset + seg.end;
+    size_t skip = static_cast<size_t>(at % DIRECT_IO_ALIGNMENT);
+    AlignedBuf buf(align_up(skip + MSG_HEADER_LEN, DIRECT_IO_ALIGNMENT));
+    size_t n = pread_exact(fd, buf.ptr, buf.len, at - skip);
+    std::memset(buf.ptr + skip, 0, MSG_HEADER_LEN);
+    pwrite_all(fd, buf.ptr, n, at - skip);
+    if (::fdatasync(fd) != 0) {
+      throw std::system_error(errno, std::generic_category(), "fdatasync");
+    }
+    return cut - 1;
+  }
+
+  // 并行扫描 segments[0, n), 已经完全包含在快照里的segment(最后一个lsn <= after)跳过
+  static void scan_all(int fd, size_t segment_size, std::vector<SegmentScan> &segments, size_t n, Lsn after,
+                       Lsn upto, size_t threads) {
+    std::vector<std::unique_ptr<AlignedBuf>> bufs(std::max<size_t>(1, std::min(threads, n)));
+    parallel_for(threads, n, [&](size_t worker, size_t i) {
+      SegmentScan &seg = segments[i];
+      if (seg.header.lsn + static_cast<Lsn>(segment_size) - 1 <= after) {
+        seg.end = segment_size;
+        seg.complete = true;
+        return;
+      }
+      if (!bufs[worker]) {
+        bufs[worker] = std::make_unique<AlignedBuf>(segment_size);
+      }
+      scan_segment(fd, segment_size, seg, *bufs[worker], after, upto);
+    });
+  }
+
+  // 每个线程为一段连续的segment构建部分PageState, 再按lsn顺序合并到pt上
+  static void rebuild(std::unordered_map<PageId, PageState> &pt, const std::vector<SegmentScan> &segments, size_t n,
+                      size_t threads) {
+    size_t chunks = std::max<size_t>(1, std::min(threads, n));
+    std::vector<std::unordered_map<PageId, PageState>> partial(chunks);
+    parallel_for(threads, chunks, [&](size_t, size_t chunk) {
+      size_t begin = n * chunk / chunks;
+      size_t end = n * (chunk + 1) / chunks;
+      auto &chunk_pt = partial[chunk];
+      for (size_t i = begin; i < end; ++i) {
+        for (auto &msg : segments[i].messages) {
+          apply(chunk_pt[msg.pid], msg);
+        }
+      }
+    });
+
+    for (auto &chunk_pt : partial) {
+      if (pt.empty()) {
+        pt = std::move(chunk_pt);
+        continue;
+      }
+      for (auto &entry : chunk_pt) {
+        auto it = pt.find(entry.first);
+        if (it == pt.end()) {
+          pt.emplace(entry.first, std::move(entry.second));
+        } else {
+          it->second.merge(std::move(entry.second));
+        }
+      }
+      chunk_pt.clear();
+    }
+    for (auto it = pt.begin(); it != pt.end();) {
+      if (it->second.type_ == Uninitialized) {
+        tlog_warn << "page " << it->first << " has fragments but no base, dropping it";
+        it = pt.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  static LogOffset file_length(int fd) {
+    off_t file_len = ::lseek(fd, 0, SEEK_END);
+    if (file_len < 0) {
+      throw std::system_error(errno, std::generic_category(), "lseek");
+    }
+    return static_cast<LogOffset>(file_len);
+  }
+
+public:
+  // 从fd恢复, base是最近一次持久化的快照, 只重放比 base.stable_lsn 新的消息
+  // 返回的 next_offset/next_lsn 交给 Log(config, fd, next_offset, next_lsn) 继续写入
+  static Snapshot recover(const Inner &config, int fd, size_t threads = std::thread::hardware_concurrency(),
+                          Snapshot base = Snapshot()) {
+    size_t segment_size = config.segment_size;
+    threads = std::max<size_t>(1, threads);
+    LogOffset file_len = file_length(fd);
+
+    Snapshot snapshot;
+    snapshot.pt = std::move(base.pt);
+    snapshot.next_offset = (file_len + segment_size - 1) / segment_size * segment_size;
+    std::vector<LogOffset> offsets;
+    for (LogOffset offset = 0; offset < file_len; offset += segment_size) {
+      offsets.push_back(offset);
+    }
+    std::vector<SegmentScan> segments = read_headers(fd, segment_size, offsets, threads);
+    if (segments.empty()) {
+      if (base.stable_lsn >= 0) {
+        throw std::runtime_error("log is missing data below snapshot lsn " + std::to_string(base.stable_lsn));
+      }
+      return snapshot;
+    }
+
+    Lsn max_stable = base.stable_lsn;
+    for (auto &seg : segments) {
+      max_stable = std::max(max_stable, seg.header.max_stable_lsn);
+    }
+    size_t keep = contiguous_prefix(segments, segment_size, max_stable);
+    if (keep == 0) {
+      if (max_stable >= 0) {
+        throw std::runtime_error("log is missing data below max_stable_lsn " + std::to_string(max_stable));
+      }
+      invalidate(fd, segment_size, segments);
+      return snapshot;
+    }
+
+    scan_all(fd, segment_size, segments, keep, base.stable_lsn, std::numeric_limits<Lsn>::max(), threads);
+    // 尾部中第一个不完整的segment之后的数据都不可信
+    // 稳定的segment不完整是因为上次恢复放弃了它的尾部, 之后的日志从新的segment开始
+    for (size_t i = 0; i < keep; ++i) {
+      Lsn seg_last = segments[i].header.lsn + static_cast<Lsn>(segment_size) - 1;
+      if (!segments[i].complete && seg_last > max_stable) {
+        keep = i + 1;
+        break;
+      }
+    }
+
+    const SegmentScan &last = segments[keep - 1];
+    snapshot.stable_lsn = last.header.lsn + static_cast<Lsn>(last.end) - 1;
+    // 批次完整之前stable_lsn不会越过它的清单, 截断之后仍然不会低于max_stable
+    snapshot.stable_lsn = drop_partial_batches(fd, segments, keep, snapshot.stable_lsn);
+    if (snapshot.stable_lsn < max_stable) {
+      throw std::runtime_error("log is missing data below max_stable_lsn " + std::to_string(max_stable));
+    }
+    snapshot.next_lsn = segments[keep - 1].header.lsn + static_cast<Lsn>(segment_size);
+    invalidate(fd, segment_size, std::vector<SegmentScan>(segments.begin() + keep, segments.end()));
+    for (size_t i = 0; i < keep; ++i) {
+      snapshot.segments.emplace(segments[i].header.lsn, segments[i].offset);
+    }
+
+    rebuild(snapshot.pt, segments, keep, threads);
+    tlog_info << "recovered " << keep << " segments, " << snapshot.pt.size() << " pages, stable lsn "
+              << snapshot.stable_lsn;
+    return snapshot;
+  }
+
+  // 把 (snapshot.stable_lsn, upto] 之间的消息应用到snapshot上, 用于增量生成快照
+  // written 是日志在快照之后开始写入的segment (lsn -> offset), 日志可以同时在写入, upto 不能超过日志的 stable_lsn
+  static void advance(const Inner &config, int fd, Snapshot &snapshot, Lsn upto,
+                      const std::map<Lsn, LogOffset> &written, size_t threads = std::thread::hardware_concurrency()) {
+    size_t segment_size = config.segment_size;
+    threads = std::max<size_t>(1, threads);
+    if (upto <= snapshot.stable_lsn) {
+      return;
+    }
+    std::vector<LogOffset> offsets;
+    for (auto &entry : written) {
+      if (entry.first <= upto && entry.first + static_cast<Lsn>(segment_size) - 1 > snapshot.stable_lsn) {
+        offsets.push_back(entry.second);
+      }
+    }
+    std::vector<SegmentScan> segments = read_headers(fd, segment_size, offsets, threads);
+    // 已经被清理并重用的segment, 其中的页面都已经在更新的segment中重写过
+    segments.erase(std::remove_if(segments.begin(), segments.end(),
+                                  [&](const SegmentScan &seg) {
+                                    auto it = written.find(seg.header.lsn);
+                                    return it == written.end() || it->second != seg.offset;
+                                  }),
+                   segments.end());
+
+    scan_all(fd, segment_size, segments, segments.size(), snapshot.stable_lsn, upto, threads);
+    rebuild(snapshot.pt, segments, segments.size(), threads);
+    // 同一个offset上更早的segment已经被重用
+    std::unordered_set<LogOffset> reused;
+    for (auto &seg : segments) {
+      reused.insert(seg.offset);
+    }
+    for (auto it = snapshot.segments.begin(); !reused.empty() && it != snapshot.segments.end();) {
+      it = reused.count(it->second) ? snapshot.segments.erase(it) : std::next(it);
+    }
+    for (auto &seg : segments) {
+      snapshot.segments.emplace(seg.header.lsn, seg.offset);
+    }
+    snapshot.stable_lsn = upto;
+  }
+};
@@ -4,8 +4,71 @@
 #include "iobuf.h"
 #include <memory>
 
+class Log;
+
+// 一次在IoBuf中的空间预留
+// 调用者通过payload()直接在日志缓冲区中写入数据, 然后调用complete()提交
+// 或abort()放弃. 析构时如果还未提交则自动abort
 class Reservation {
-  Log log;
-  std::shared_ptr<IoBuf> buf;
-  DiskPtr disk_ptr;
-};
\ No newline at end of file
+  Log *log_;
+  IoBuf *buf_;
+  SliceMut data_; // 消息头 + 负载
+  MessageHeader header_;
+  DiskPtr disk_ptr_;
+  Lsn lsn_;
+  bool flushed_;
+
+  void flush(bool valid);
+
+public:
+  Reservation(Log *log, IoBuf *buf, SliceMut data, MessageHeader header,
+              DiskPtr disk_ptr, Lsn lsn)
+      : log_(log), buf_(buf), data_(data), header_(header), disk_ptr_(disk_ptr),
+        lsn_(lsn), flushed_(false) {}
+
+  Reservation(const Reservation &) = delete;
+  Reservation &operator=(const Reservation &) = delete;
+  Reservation(Reservation &&other) noexcept
+      : log_(other.log_), buf_(other.buf_), data_(other.data_), header_(other.header_),
+        disk_ptr_(other.disk_ptr_), lsn_(other.lsn_), flushed_(other.flushed_) {
+    other.flushed_ = true;
+  }
+
+  ~Reservation() {
+    if (!flushed_) {
+      abort();
+    }
+  }
+
+  // 负载区域, 不包含消息头
+  SliceMut payload() {
+    return SliceMut(data_.data() + MSG_HEADER_LEN, data_.size() - MSG_HEADER_LEN);
+  }
+
+  Lsn lsn() const { return lsn_; }
+
+  DiskPtr pointer() const { return disk_ptr_; }
+
+  // 消息头中的flags, complete之前设置
+  void set_flags(uint8_t flags) { header_.flags = flags; }
+
+  // 整条消息在日志中的长度
+  uint64_t log_size() const { return data_.size(); }
+
+  // blob消息: 负载是HeapId, 页面的位置指向heap中的数据
+  void set_heap_id(HeapId heap_id) {
+    encode_heap_id(heap_id, payload().data());
+    disk_ptr_ = DiskPtr::new_blob(disk_ptr_.offset, heap_id);
+  }
+
+  // 写入消息头和crc, 然后离开预留
+  std::pair<Lsn, DiskPtr> complete() {
+    flush(true);
+    return {lsn_, disk_ptr_};
+  }
+
+  // 把这段空间标记为MsgCanceled, 恢复时会被跳过
+  void abort() {
+    flush(false);
+  }
+};
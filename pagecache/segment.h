@@ -24,21 +24,40 @@ B. 当活跃线程可能持有指向这些 segment 的 LogOffset 时，绝不能
 这个问题的解决方法是引入“不稳定尾部”的概念：在恢复时，这些 segment 必须作为恢复出来的、LSN（日志序号）最高、且连续的 segment 出现。只要 segment 还属于这个“不稳定尾部”，就禁止重用。只有当后续更高的 segment 在自己的头部写下比我们更高的“稳定连续 lsn”时，我们才允许重用这些 segment
 */
 
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iterator>
 #include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
 #include <set>
-#include <cassert>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "def_types.h"
+#include "constant.h"
+#include "disk_pointer.h"
+#include "heap.h"
 #include "snapshot.h"
-#include "pagecache.h"
 #include "../config.h"
+#include "../util/common_def.h"
+#include "../3rd/log/tlog.h"
 
 enum SegmentOpType {
   Link,
   Replace,
 };
 
+// PageCache 每次成功安装一个新版本后交给 SegmentAccountant 的记录
+// Link:    页面多了一个fragment
+// Replace: 页面被一个新的基准页整体替换, old_caches_ 是旧版本的全部fragment (基准页在内)
 class SegmentOp {
 public:
   SegmentOpType type_;
@@ -53,8 +72,22 @@ public:
   CacheInfo new_cache_; // 替换后的新缓存信息
 
 public:
-  
-
+  static SegmentOp link(PageId pid, CacheInfo cache) {
+    SegmentOp op;
+    op.type_ = Link;
+    op.page_id_ = pid;
+    op.cache_ = cache;
+    return op;
+  }
+
+  static SegmentOp replace(PageId pid, std::vector<CacheInfo> old_caches, CacheInfo new_cache) {
+    SegmentOp op;
+    op.type_ = Replace;
+    op.page_id_ = pid;
+    op.old_caches_ = std::move(old_caches);
+    op.new_cache_ = new_cache;
+    return op;
+  }
 };
 
 enum SegmentState {
@@ -64,249 +97,805 @@ enum SegmentState {
   SegDraining, // 正在清理的状态
 };
 
-// segmeng and its inheritance
-
-// 基类
-// 基类
-class Segment {
-public:
-    virtual ~Segment() = default;
-
-    // 状态判别
-    virtual bool is_free()    const { return false; }
-    virtual bool is_active()  const { return false; }
-    virtual bool is_inactive()const { return false; }
-    virtual bool is_draining()const { return false; }
-    
-    virtual SegmentState seg_state() const = 0;
-
-    // 状态转换接口（返回新状态！）
-    virtual std::unique_ptr<Segment> free_to_active(Lsn)                        { throw std::logic_error("Not implemented"); }
-    virtual std::pair<std::unique_ptr<Segment>, std::unordered_set<Lsn>> active_to_inactive(Lsn, const RunningConfig&) { throw std::logic_error("Not implemented"); }
-    virtual std::pair<std::unique_ptr<Segment>, std::unordered_set<PageId>> inactive_to_draining(Lsn)      { throw std::logic_error("Not implemented"); }
-    virtual std::pair<std::unique_ptr<Segment>, Lsn> draining_to_free(Lsn)      { throw std::logic_error("Not implemented"); }
-
-    virtual void defer_free_lsn(Lsn) { throw std::logic_error("Not implemented"); }
-    virtual void recovery_ensure_initialized(Lsn) { throw std::logic_error("Not implemented"); }
-    virtual Lsn lsn() const { throw std::logic_error("Not implemented"); }
-    virtual void insert_pid(PageId, Lsn) { throw std::logic_error("Not implemented"); }
-    virtual void remove_pid(PageId, Lsn) { throw std::logic_error("Not implemented"); }
-    virtual void remove_heap_item(HeapId, const RunningConfig&) { throw std::logic_error("Not implemented"); }
-    virtual bool can_free() const { return false; }
-};
-
+// 一组PageId, 排好序存放在连续内存中
+// 一个segment里的页面通常只有几十到几千个, 二分查找加memmove比哈希表省内存, 也不需要追指针;
+// 新写入的pid大多比已有的大, 这时直接追加
+class PidSet {
+  std::vector<PageId> pids_;
 
-// 声明
-class ActiveSegment;
-
-// ---- Free 状态 ----
-class FreeSegment : public Segment {
 public:
-    std::optional<Lsn> previous_lsn;
-
-    FreeSegment(std::optional<Lsn> prev = std::nullopt) : previous_lsn(prev) {}
-
-    bool is_free() const override { return true; }
+  using const_iterator = std::vector<PageId>::const_iterator;
 
-
-    SegmentState seg_state() const override { return SegFree; }
-
-    std::unique_ptr<Segment> free_to_active(Lsn new_lsn) override;
-
-    void recovery_ensure_initialized(Lsn lsn) override {
-        // 在外部调用 free_to_active/replace即可
-        throw std::logic_error("recovery_ensure_initialized should be handled externally for Free");
+  bool insert(PageId pid) {
+    if (pids_.empty() || pids_.back() < pid) {
+      pids_.push_back(pid);
+      return true;
     }
+    auto it = std::lower_bound(pids_.begin(), pids_.end(), pid);
+    if (*it == pid) {
+      return false;
+    }
+    pids_.insert(it, pid);
+    return true;
+  }
+
+  bool erase(PageId pid) {
+    auto it = std::lower_bound(pids_.begin(), pids_.end(), pid);
+    if (it == pids_.end() || *it != pid) {
+      return false;
+    }
+    pids_.erase(it);
+    return true;
+  }
+
+  bool contains(PageId pid) const {
+    return std::binary_search(pids_.begin(), pids_.end(), pid);
+  }
+
+  // 一次性装入, 不要求有序和去重
+  void assign(std::vector<PageId> &&pids) {
+    pids_ = std::move(pids);
+    std::sort(pids_.begin(), pids_.end());
+    pids_.erase(std::unique(pids_.begin(), pids_.end()), pids_.end());
+  }
+
+  // 取出全部pid并释放内存
+  std::vector<PageId> take() {
+    std::vector<PageId> pids;
+    pids.swap(pids_);
+    return pids;
+  }
+
+  void release() {
+    std::vector<PageId>().swap(pids_);
+  }
+
+  size_t size() const { return pids_.size(); }
+  bool empty() const { return pids_.empty(); }
+  const_iterator begin() const { return pids_.begin(); }
+  const_iterator end() const { return pids_.end(); }
 };
 
 
-// Active 状态
-// ---- Active 状态 ----
-class ActiveSegment : public Segment {
-public:
-    Lsn lsn_;
-    std::unordered_set<PageId> deferred_replaced_pids;
-    std::unordered_set<PageId> pids;
-    Lsn latest_replacement_lsn = 0;
-    std::unordered_set<Lsn> can_free_upon_deactivation;
-    // std::unordered_set<HeapId> deferred_heap_removals;
-
-    ActiveSegment(Lsn lsnv)
-        : lsn_(lsnv) {}
-
-    bool is_active() const override { return true; }
-
-
-    Lsn lsn() const override { return lsn_; }
-
-
-    SegmentState seg_state() const override { return SegActive; }
-
-
-    void insert_pid(PageId pid, Lsn lsn) override {
-        assert(lsn == lsn_);
-        pids.insert(pid);
+// segment表中的一条记录, 状态是一个tag, 所有状态转换都在原地完成
+//
+//   Free -> Active:      日志开始写入这个segment
+//   Active -> Inactive:  日志轮换到下一个segment, 期间被替换的页面此时才移除
+//   Inactive -> Draining: 被选中清理, 剩余的活页面交给cleaner重写
+//   Draining -> Free:    所有页面的替换都已经稳定
+struct SegmentRecord {
+  SegmentState state = SegFree;
+  uint32_t max_pids = 0;      // Inactive/Draining: 失活时的页面数
+  Lsn lsn = -1;               // Free 时是上一次使用的lsn, 从未使用过为-1
+  Lsn latest_replacement_lsn = 0;
+  uint64_t replaced_pids = 0; // Inactive/Draining: 已经被替换的页面数
+  PidSet pids;                // Active/Inactive: 活页面
+  PidSet deferred_replaced;   // Active: 已经被替换, 失活时再移除
+  Lsn scheduled_lsn = -1;     // 在 SegmentAccountant::pending_free_ 中登记的lsn, 没有登记时为-1
+
+  bool is_free() const { return state == SegFree; }
+  bool is_active() const { return state == SegActive; }
+  bool is_inactive() const { return state == SegInactive; }
+  bool is_draining() const { return state == SegDraining; }
+
+  void free_to_active(Lsn new_lsn) {
+    expect(SegFree, "free_to_active");
+    assert(lsn < 0 || new_lsn > lsn);
+    state = SegActive;
+    lsn = new_lsn;
+    latest_replacement_lsn = 0;
+    max_pids = 0;
+    replaced_pids = 0;
+  }
+
+  void active_to_inactive() {
+    expect(SegActive, "active_to_inactive");
+    max_pids = static_cast<uint32_t>(pids.size());
+    for (auto pid : deferred_replaced) {
+      pids.erase(pid);
     }
-
-    void defer_free_lsn(Lsn lsn) override {
-        can_free_upon_deactivation.insert(lsn);
+    replaced_pids = deferred_replaced.size();
+    deferred_replaced.release();
+    state = SegInactive;
+  }
+
+  // 返回还需要重写的页面
+  std::vector<PageId> inactive_to_draining() {
+    expect(SegInactive, "inactive_to_draining");
+    state = SegDraining;
+    return pids.take();
+  }
+
+  // 返回最后一次替换的lsn
+  Lsn draining_to_free() {
+    expect(SegDraining, "draining_to_free");
+    Lsn replacement_lsn = latest_replacement_lsn;
+    state = SegFree;
+    max_pids = 0;
+    replaced_pids = 0;
+    latest_replacement_lsn = 0;
+    pids.release();
+    return replacement_lsn;
+  }
+
+  // 轮换到下一个segment时, 还持有这个segment中预留空间的writer仍会写入, 所以Inactive也接受新页面
+  void insert_pid(PageId pid) {
+    if (is_active()) {
+      pids.insert(pid);
+      // 被替换之后又在同一个segment中写入, 仍然是活的
+      deferred_replaced.erase(pid);
+    } else if (is_inactive()) {
+      if (pids.insert(pid)) {
+        max_pids += 1;
+      }
+    } else {
+      throw std::logic_error("insert_pid on a free or draining segment");
     }
-
-    void remove_pid(PageId pid, Lsn replacement_lsn) override {
-        assert(lsn_ <= replacement_lsn);
-        if (replacement_lsn != lsn_) {
-            deferred_replaced_pids.insert(pid);
-        }
-        if (replacement_lsn > latest_replacement_lsn) {
-            latest_replacement_lsn = replacement_lsn;
+  }
+
+  void remove_pid(PageId pid, Lsn replacement_lsn) {
+    assert(lsn <= replacement_lsn);
+    if (replacement_lsn != lsn) {
+      if (is_active()) {
+        deferred_replaced.insert(pid);
+      } else if (is_inactive()) {
+        if (pids.erase(pid)) {
+          replaced_pids += 1;
         }
+      } else if (is_draining()) {
+        replaced_pids += 1;
+      }
     }
+    if (replacement_lsn > latest_replacement_lsn) {
+      latest_replacement_lsn = replacement_lsn;
+    }
+  }
 
-    // void remove_heap_item(HeapId heap_id, const RunningConfig&) override {
-    //     deferred_heap_removals.insert(heap_id);
-    // }
-
-    std::pair<std::unique_ptr<Segment>, std::unordered_set<Lsn>>
-    active_to_inactive(Lsn to_lsn, const RunningConfig& config) override {
-        assert(to_lsn >= lsn_);
-        // 处理延迟heap移除
-        // for (auto heap_id : deferred_heap_removals)
-        //     config.heap.free(heap_id);
-
-        size_t max_pids = pids.size();
+  bool can_free() const {
+    return is_draining() && replaced_pids >= max_pids;
+  }
 
-        // 复制并移除deferred_replaced_pids
-        std::unordered_set<PageId> pids_copy = pids;
-        for (auto pid : deferred_replaced_pids) {
-            pids_copy.erase(pid);
-        }
+  // 剩余的活页面比例, 清理时需要重写的部分
+  double live_ratio() const {
+    return max_pids == 0 ? 0.0 : static_cast<double>(pids.size()) / static_cast<double>(max_pids);
+  }
 
-        auto inact = std::make_unique<InactiveSegment>(
-            lsn_,
-            std::move(pids_copy),
-            max_pids,
-            deferred_replaced_pids.size(),
-            latest_replacement_lsn
-        );
-        std::unordered_set<Lsn> can_free = std::move(can_free_upon_deactivation);
-        // 返回新状态和can_free集合
-        return {std::move(inact), std::move(can_free)};
+private:
+  void expect(SegmentState expected, const char *transition) const {
+    if (state != expected) {
+      throw std::logic_error(std::string("invalid segment transition ") + transition);
     }
+  }
 };
 
-// ---- Inactive 状态 ----
-class InactiveSegment : public Segment {
-public:
-    Lsn lsn_;
-    std::unordered_set<PageId> pids;
-    size_t max_pids;
-    size_t replaced_pids;
-    Lsn latest_replacement_lsn;
-
-    InactiveSegment(Lsn lsnv, std::unordered_set<PageId>&& p, size_t maxp, size_t rep, Lsn latest)
-        : lsn_(lsnv), pids(std::move(p)), max_pids(maxp), replaced_pids(rep), latest_replacement_lsn(latest) {}
-
-    bool is_inactive() const override { return true; }
-    Lsn lsn() const override { return lsn_; }
-    SegmentState seg_state() const override { return SegInactive; }
-
-
-    void remove_pid(PageId pid, Lsn replacement_lsn) override {
-        assert(lsn_ <= replacement_lsn);
-        if (replacement_lsn != lsn_) {
-            auto it = pids.find(pid);
-            if (it != pids.end()) {
-                pids.erase(it);
-                replaced_pids += 1;
-            }
-        }
-        if (replacement_lsn > latest_replacement_lsn) {
-            latest_replacement_lsn = replacement_lsn;
-        }
-    }
 
-    void remove_heap_item(HeapId heap_id, const RunningConfig& config) override {
-        config.heap.free(heap_id);
+// SegmentAccountant 跟踪每个segment中还活着的页面, 分配和回收segment
+//
+// 调用约定: mark_link/mark_replace 必须在对应的 Reservation::complete 之前调用,
+// 这样在页面被记录下来之前, 所在的segment不可能已经稳定, 也就不会被清理
+//
+// 一个segment只有在满足以下条件后才会回到Free:
+//   1. 它自己的全部数据已经稳定 (不属于不稳定尾部)
+//   2. 其中所有页面都已经被更新的版本替换, 并且这些替换已经稳定
+//
+// 被替换的blob在heap中的槽位也在这里延迟释放, 直到替换它的写入稳定.
+// stable_lsn 总是以整个IoBuf为单位前进, stable_lsn >= lsn 时整条消息都已经落盘
+//
+// mark_link/mark_replace 在写路径上, 不获取 mu_: 每个线程把记录放进自己的分片,
+// 之后任何需要读segment状态的操作(stabilize, next, clean 等)先在 mu_ 下把分片中的记录全部应用.
+// 记录在complete之前放进分片, stable_lsn 覆盖它之前的stabilize一定会先应用它, 所以上面的约定仍然成立.
+// 同一个页面的link和replace可能落在不同的分片, 所以每条记录带一个全局序号, 应用时按序号合并,
+// 和放进分片的顺序一致: 先放进去的旧link不会在替换它的replace之后才应用, 把已经死掉的pid又记成活的
+// 清理候选和空间放大率都随状态转换增量维护, 持有 mu_ 时不扫描整个segment表
+class SegmentAccountant {
+  static constexpr size_t MARK_SHARDS = 16;
+  static constexpr size_t MARK_BATCH = 1024; // 分片攒到这么多时由写者顺便应用, 不等下一次stabilize
+
+  // 写路径记下的 mark_link/mark_replace
+  struct PendingMark {
+    uint64_t seq;                     // 放进分片时从 next_seq_ 取得
+    PageId pid;
+    Lsn lsn;                          // Replace: 新版本的lsn
+    size_t idx;                       // 新版本所在的segment
+    std::vector<size_t> old_segments; // Replace: 旧版本所在的其它segment
+    std::vector<HeapId> old_blobs;    // Replace: 旧版本在heap中的槽位
+    bool replace;
+  };
+
+  // 一组线程的待应用记录, 线程按第一次写入的顺序轮流分到各个分片
+  struct alignas(CACHE_LINE_FETCH_ALIGN) MarkShard {
+    std::mutex mu;
+    std::vector<PendingMark> marks;
+  };
+
+  size_t segment_size_;
+  size_t cleanup_threshold_;
+  std::shared_ptr<Heap> heap_;
+  mutable std::mutex mu_;
+  std::vector<SegmentRecord> segments_; // 下标 = offset / segment_size
+  std::set<LogOffset> free_; // 优先重用低offset的segment
+  std::map<Lsn, LogOffset> ordering_; // 正在使用的segment, lsn -> offset
+  std::map<size_t, size_t> active_; // 每个lane正在写入的segment, lane -> 下标
+  // 等待 stable_lsn 达到key之后就可以释放(或者转为Draining)的segment, 每个segment最多登记一次
+  std::set<std::pair<Lsn, size_t>> pending_free_;
+  std::multimap<Lsn, HeapId> pending_heap_free_;
+  // 已经失活, 等待自己稳定之后成为清理候选的segment
+  std::multimap<Lsn, size_t> pending_cleanable_;
+  std::set<size_t> cleanable_; // 已经稳定的Inactive segment, clean() 只在其中挑选
+  size_t used_ = 0;            // 不是Free的segment数
+  double live_ = 0;            // 这些segment的活页面折算成的segment数, 见 weight()
+  Lsn stable_lsn_ = -1;
+  // 设置了free_hook_时, 回到Free的segment先放在这里, 交给hook之后由它调用release
+  bool gated_ = false;
+  std::vector<LogOffset> quarantined_;
+  std::mutex hook_mu_; // 先于 mu_ 获取
+  std::function<void(LogOffset)> free_hook_;
+  std::unique_ptr<MarkShard[]> shards_; // 在 mu_ 之后获取
+  std::atomic<uint64_t> next_seq_;
+  std::vector<PendingMark> applying_; // 持有 mu_ 时从分片中取出, 序号还不能应用的留到下一次
+
+  static size_t shard_index() {
+    static std::atomic<size_t> next {0};
+    static thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % MARK_SHARDS;
+    return index;
+  }
+
+  size_t index(LogOffset lid) const {
+    return static_cast<size_t>(lid / segment_size_);
+  }
+
+  Lsn segment_end(const SegmentRecord &seg) const {
+    return seg.lsn + static_cast<Lsn>(segment_size_) - 1;
+  }
+
+  // Inactive 按活页面比例折算, Active 和 Draining 按整个segment算
+  static double weight(const SegmentRecord &seg) {
+    return seg.is_inactive() ? seg.live_ratio() : 1.0;
+  }
+
+  // 改变segment的状态或页面数之前调用untally, 之后调用tally, 保持 used_ 和 live_
+  void untally(const SegmentRecord &seg) {
+    if (!seg.is_free()) {
+      used_ -= 1;
+      live_ -= weight(seg);
     }
+  }
 
-    std::pair<std::unique_ptr<Segment>, std::unordered_set<PageId>>
-    inactive_to_draining(Lsn to_lsn) override {
-        assert(to_lsn >= lsn_);
-        std::unordered_set<PageId> pids_moved = std::move(pids);
-        auto draining = std::make_unique<DrainingSegment>(
-            lsn_,
-            max_pids,
-            replaced_pids,
-            latest_replacement_lsn
-        );
-        return {std::move(draining), std::move(pids_moved)};
+  void tally(const SegmentRecord &seg) {
+    if (!seg.is_free()) {
+      used_ += 1;
+      live_ += weight(seg);
     }
-};
+    if (used_ == 0) {
+      live_ = 0; // 清掉浮点误差
+    }
+  }
 
+  void ensure_size(size_t idx) {
+    while (segments_.size() <= idx) {
+      free_.insert(static_cast<LogOffset>(segments_.size()) * segment_size_);
+      segments_.emplace_back();
+    }
+  }
+
+  void deactivate(size_t idx) {
+    auto &seg = segments_[idx];
+    untally(seg);
+    seg.active_to_inactive();
+    tally(seg);
+    if (segment_end(seg) > stable_lsn_) {
+      pending_cleanable_.emplace(segment_end(seg), idx);
+    } else {
+      cleanable_.insert(idx);
+    }
+    maybe_schedule_free(idx);
+  }
+
+  std::vector<PageId> start_draining(size_t idx) {
+    auto &seg = segments_[idx];
+    untally(seg);
+    std::vector<PageId> pids = seg.inactive_to_draining();
+    tally(seg);
+    cleanable_.erase(idx);
+    return pids;
+  }
+
+  // 同一个segment只保留最晚的一次登记
+  void schedule_free(Lsn required, size_t idx) {
+    auto &seg = segments_[idx];
+    if (seg.scheduled_lsn >= required) {
+      return;
+    }
+    if (seg.scheduled_lsn >= 0) {
+      pending_free_.erase({seg.scheduled_lsn, idx});
+    }
+    seg.scheduled_lsn = required;
+    pending_free_.emplace(required, idx);
+  }
+
+  // 已经没有活页面的inactive segment直接进入Draining, 不需要重写.
+  // 还没有稳定时, 持有其中预留空间的writer可能还会把页面记到它上面, 等它稳定之后再转换
+  void maybe_schedule_free(size_t idx) {
+    auto &seg = segments_[idx];
+    if (seg.is_inactive() && seg.pids.empty()) {
+      if (segment_end(seg) > stable_lsn_) {
+        schedule_free(segment_end(seg), idx);
+        return;
+      }
+      start_draining(idx);
+    }
+    if (seg.can_free()) {
+      schedule_free(std::max(segment_end(seg), seg.latest_replacement_lsn), idx);
+    }
+  }
+
+  void free_ready() {
+    while (!pending_cleanable_.empty() && pending_cleanable_.begin()->first <= stable_lsn_) {
+      size_t idx = pending_cleanable_.begin()->second;
+      pending_cleanable_.erase(pending_cleanable_.begin());
+      if (segments_[idx].is_inactive()) {
+        cleanable_.insert(idx);
+      }
+    }
+    while (!pending_free_.empty() && pending_free_.begin()->first <= stable_lsn_) {
+      size_t idx = pending_free_.begin()->second;
+      pending_free_.erase(pending_free_.begin());
+      auto &seg = segments_[idx];
+      seg.scheduled_lsn = -1;
+      if (seg.is_inactive()) {
+        maybe_schedule_free(idx); // 等待稳定的空segment
+        continue;
+      }
+      if (!seg.can_free()) {
+        continue;
+      }
+      Lsn lsn = seg.lsn;
+      untally(seg);
+      seg.draining_to_free();
+      tally(seg);
+      ordering_.erase(lsn);
+      if (gated_) {
+        quarantined_.push_back(static_cast<LogOffset>(idx) * segment_size_);
+      } else {
+        free_.insert(static_cast<LogOffset>(idx) * segment_size_);
+      }
+      tlog_debug << "segment " << idx << " with lsn " << lsn << " is free";
+    }
+    while (!pending_heap_free_.empty() && pending_heap_free_.begin()->first <= stable_lsn_) {
+      heap_->free(pending_heap_free_.begin()->second);
+      pending_heap_free_.erase(pending_heap_free_.begin());
+    }
+  }
 
+  // 不持有 mu_ 时调用
+  void hand_over(const std::vector<LogOffset> &freed) {
+    if (freed.empty()) {
+      return;
+    }
+    std::scoped_lock<std::mutex> lock(hook_mu_);
+    for (LogOffset offset : freed) {
+      if (free_hook_) {
+        free_hook_(offset);
+      } else {
+        release(offset);
+      }
+    }
+  }
+
+  void insert_locked(PageId pid, size_t idx) {
+    assert(idx < segments_.size());
+    auto &seg = segments_[idx];
+    untally(seg);
+    seg.insert_pid(pid);
+    tally(seg);
+  }
+
+  void remove_locked(PageId pid, Lsn replacement_lsn, size_t idx) {
+    if (idx >= segments_.size() || segments_[idx].is_free()) {
+      return;
+    }
+    auto &seg = segments_[idx];
+    untally(seg);
+    seg.remove_pid(pid, std::max(replacement_lsn, seg.lsn));
+    tally(seg);
+    maybe_schedule_free(idx);
+  }
+
+  // 按序号把分片中的记录应用到segment表, 持有 mu_ 时调用.
+  // 序号在分片的锁内取得, 所以小于开始时 next_seq_ 的记录都已经在分片中了; 更大的序号前面可能还有
+  // 没放进来的记录, 留到下一次, 这样不同批次之间也保持序号的顺序
+  void apply_marks_locked() {
+    uint64_t limit = next_seq_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < MARK_SHARDS; ++i) {
+      std::scoped_lock<std::mutex> lock(shards_[i].mu);
+      auto &marks = shards_[i].marks;
+      applying_.insert(applying_.end(), std::make_move_iterator(marks.begin()), std::make_move_iterator(marks.end()));
+      marks.clear();
+    }
+    std::sort(applying_.begin(), applying_.end(),
+              [](const PendingMark &a, const PendingMark &b) { return a.seq < b.seq; });
+    auto end = std::partition_point(applying_.begin(), applying_.end(),
+                                    [limit](const PendingMark &mark) { return mark.seq < limit; });
+    for (auto it = applying_.begin(); it != end; ++it) {
+      insert_locked(it->pid, it->idx);
+      if (!it->replace) {
+        continue;
+      }
+      for (HeapId heap_id : it->old_blobs) {
+        pending_heap_free_.emplace(it->lsn, heap_id);
+      }
+      for (size_t idx : it->old_segments) {
+        remove_locked(it->pid, it->lsn, idx);
+      }
+    }
+    applying_.erase(applying_.begin(), end);
+  }
+
+  void push_mark(PendingMark &&mark) {
+    MarkShard &shard = shards_[shard_index()];
+    size_t pending;
+    {
+      std::scoped_lock<std::mutex> lock(shard.mu);
+      mark.seq = next_seq_.fetch_add(1, std::memory_order_acq_rel);
+      shard.marks.push_back(std::move(mark));
+      pending = shard.marks.size();
+    }
+    // 长时间没有stabilize时不让分片无限增长; 别的线程持有 mu_ 时它会顺便应用
+    if (pending >= MARK_BATCH) {
+      std::unique_lock<std::mutex> lock(mu_, std::try_to_lock);
+      if (lock.owns_lock()) {
+        apply_marks_locked();
+      }
+    }
+  }
 
-// ---- Draining 状态 ----
-class DrainingSegment : public Segment {
 public:
-    Lsn lsn_;
-    size_t max_pids;
-    size_t replaced_pids;
-    Lsn latest_replacement_lsn;
-
-    DrainingSegment(Lsn lsnv, size_t maxp, size_t rep, Lsn latest)
-        : lsn_(lsnv), max_pids(maxp), replaced_pids(rep), latest_replacement_lsn(latest) {}
-
-    bool is_draining() const override { return true; }
-    Lsn lsn() const override { return lsn_; }
-    SegmentState seg_state() const override { return SegDraining; }
-
-
-    void remove_pid(PageId /*pid*/, Lsn replacement_lsn) override {
-        assert(lsn_ <= replacement_lsn);
-        if (replacement_lsn != lsn_) {
-            replaced_pids += 1;
-        }
-        if (replacement_lsn > latest_replacement_lsn) {
-            latest_replacement_lsn = replacement_lsn;
-        }
+  // cleanup_threshold: 活页面比例(百分比)低于它的segment才值得清理
+  explicit SegmentAccountant(size_t segment_size, std::shared_ptr<Heap> heap = nullptr,
+                             size_t cleanup_threshold = SEGMENT_CLEANUP_THRESHOLD)
+      : segment_size_(segment_size), cleanup_threshold_(cleanup_threshold), heap_(std::move(heap)),
+        shards_(new MarkShard[MARK_SHARDS]), next_seq_(0) {}
+
+  NO_COPY_MOVE(SegmentAccountant);
+
+  size_t segment_size() const {
+    return segment_size_;
+  }
+
+  // 根据恢复的结果重建: 有活页面的segment为Inactive, 其余的为Free
+  void initialize_from_snapshot(const Snapshot &snapshot, LogOffset file_len) {
+    std::scoped_lock<std::mutex> lock(mu_);
+    for (size_t i = 0; i < MARK_SHARDS; ++i) {
+      std::scoped_lock<std::mutex> shard_lock(shards_[i].mu);
+      shards_[i].marks.clear();
     }
-
-    void remove_heap_item(HeapId heap_id, const RunningConfig& config) override {
-        config.heap.free(heap_id);
+    applying_.clear();
+    segments_.clear();
+    free_.clear();
+    ordering_.clear();
+    pending_free_.clear();
+    pending_heap_free_.clear();
+    pending_cleanable_.clear();
+    cleanable_.clear();
+    used_ = 0;
+    live_ = 0;
+    active_.clear();
+    stable_lsn_ = snapshot.stable_lsn;
+    size_t n = static_cast<size_t>((file_len + segment_size_ - 1) / segment_size_);
+    if (n > 0) {
+      ensure_size(n - 1);
     }
 
-    std::pair<std::unique_ptr<Segment>, Lsn>
-    draining_to_free(Lsn to_lsn) override {
-        assert(to_lsn >= lsn_);
-        Lsn replacement_lsn = latest_replacement_lsn;
-        auto free = std::make_unique<FreeSegment>(lsn_);
-        return {std::move(free), replacement_lsn};
+    // 同一个offset可能被重用过, 只有最新的lsn有效
+    std::map<size_t, Lsn> latest;
+    for (auto &entry : snapshot.segments) {
+      Lsn &lsn = latest[index(entry.second)];
+      lsn = std::max(lsn, entry.first);
     }
-
-    bool can_free() const override {
-        return replaced_pids == max_pids;
+    if (!latest.empty()) {
+      ensure_size(latest.rbegin()->first);
+    }
+    std::vector<std::vector<PageId>> live(segments_.size());
+    std::vector<HeapId> live_heap;
+    auto add_live = [&](PageId pid, const DiskPtr &ptr) {
+      if (index(ptr.lid()) < live.size()) {
+        live[index(ptr.lid())].push_back(pid);
+      }
+      if (ptr.is_blob()) {
+        live_heap.push_back(ptr.heap_id);
+      }
+    };
+    for (auto &entry : snapshot.pt) {
+      add_live(entry.first, entry.second.base_.disk_ptr);
+      for (auto &frag : entry.second.frags_) {
+        add_live(entry.first, frag.disk_ptr);
+      }
+    }
+    for (auto &entry : latest) {
+      size_t idx = entry.first;
+      SegmentRecord &seg = segments_[idx];
+      seg.free_to_active(entry.second);
+      seg.pids.assign(std::move(live[idx]));
+      seg.latest_replacement_lsn = entry.second;
+      tally(seg);
+      deactivate(idx);
+      free_.erase(static_cast<LogOffset>(idx) * segment_size_);
+      ordering_[entry.second] = static_cast<LogOffset>(idx) * segment_size_;
+    }
+    if (heap_) {
+      heap_->initialize(std::move(live_heap));
+    }
+    free_ready();
+    // 启动时还没有读者
+    free_.insert(quarantined_.begin(), quarantined_.end());
+    quarantined_.clear();
+  }
+
+  // 为从lsn开始的新segment分配位置, 之前的active segment变为inactive
+  // 为lane分配从lsn开始的新segment, 这个lane之前的segment不再写入
+  LogOffset next(Lsn lsn, size_t lane = 0) {
+    std::scoped_lock<std::mutex> lock(mu_);
+    apply_marks_locked();
+    auto active = active_.find(lane);
+    if (active != active_.end()) {
+      deactivate(active->second);
+      active_.erase(active);
+    }
+    if (free_.empty()) {
+      ensure_size(segments_.size());
+    }
+    LogOffset offset = *free_.begin();
+    free_.erase(free_.begin());
+    size_t idx = index(offset);
+    segments_[idx].free_to_active(lsn);
+    tally(segments_[idx]);
+    ordering_[lsn] = offset;
+    active_[lane] = idx;
+    return offset;
+  }
+
+  // pid 的一个新fragment写在了lid
+  void mark_link(PageId pid, DiskPtr ptr) {
+    push_mark(PendingMark {0, pid, 0, index(ptr.lid()), {}, {}, false});
+  }
+
+  // pid 被lsn处的新版本整体替换, old_ptrs 是旧版本的所有fragment
+  void mark_replace(PageId pid, Lsn lsn, const std::vector<DiskPtr> &old_ptrs, DiskPtr new_ptr) {
+    PendingMark mark {0, pid, lsn, index(new_ptr.lid()), {}, {}, true};
+    for (auto &ptr : old_ptrs) {
+      size_t idx = index(ptr.lid());
+      // 仍然活在新版本所在的segment中
+      if (idx != mark.idx &&
+          std::find(mark.old_segments.begin(), mark.old_segments.end(), idx) == mark.old_segments.end()) {
+        mark.old_segments.push_back(idx);
+      }
+      if (ptr.is_blob()) {
+        assert(heap_ != nullptr);
+        mark.old_blobs.push_back(ptr.heap_id);
+      }
+    }
+    push_mark(std::move(mark));
+  }
+
+  // 同样必须在对应的 Reservation::complete 之前调用
+  void apply(const SegmentOp &op) {
+    if (op.type_ == Link) {
+      mark_link(op.page_id_, op.cache_.pointer);
+      return;
+    }
+    std::vector<DiskPtr> old_ptrs;
+    old_ptrs.reserve(op.old_caches_.size());
+    for (auto &cache : op.old_caches_) {
+      old_ptrs.push_back(cache.pointer);
+    }
+    mark_replace(op.page_id_, op.new_cache_.lsn, old_ptrs, op.new_cache_.pointer);
+  }
+
+  // 日志的stable lsn前进之后调用, 释放可以释放的segment
+  void stabilize(Lsn stable_lsn) {
+    std::vector<LogOffset> freed;
+    {
+      std::scoped_lock<std::mutex> lock(mu_);
+      if (stable_lsn <= stable_lsn_) {
+        return;
+      }
+      apply_marks_locked();
+      stable_lsn_ = stable_lsn;
+      free_ready();
+      freed.swap(quarantined_);
     }
+    hand_over(freed);
+  }
+
+  // hook 不为空时, 回到Free的segment先交给hook, hook 调用release之后才能被重用.
+  // 读者可能还直接引用着segment的内容时使用(例如内存映射读). hook 不持有 mu_, 可以在其中调用release
+  void set_free_hook(std::function<void(LogOffset)> hook) {
+    std::scoped_lock<std::mutex> hook_lock(hook_mu_);
+    std::scoped_lock<std::mutex> lock(mu_);
+    gated_ = static_cast<bool>(hook);
+    free_hook_ = std::move(hook);
+  }
+
+  // 交给hook的segment可以重用了
+  void release(LogOffset offset) {
+    std::scoped_lock<std::mutex> lock(mu_);
+    free_.insert(offset);
+  }
+
+  // 按 cost-benefit 选出最值得清理的segment, 转为Draining并返回需要重写的页面
+  // benefit/cost = (1 - u) * age / (1 + u), u是活页面比例, age是距离最后一次替换的lsn距离
+  std::optional<std::pair<LogOffset, std::vector<PageId>>> clean() {
+    std::scoped_lock<std::mutex> lock(mu_);
+    apply_marks_locked();
+    bool over_amplified = space_amplification_locked() > MAX_SPACE_AMPLIFICATION;
+    std::optional<size_t> best;
+    double best_score = 0;
+    for (size_t idx : cleanable_) {
+      auto &seg = segments_[idx];
+      double u = seg.live_ratio();
+      if (u * 100 >= cleanup_threshold_ && !over_amplified) {
+        continue;
+      }
+      double age = static_cast<double>(stable_lsn_ - std::max(seg.latest_replacement_lsn, seg.lsn)) + 1;
+      double score = (1 - u) * age / (1 + u);
+      if (!best || score > best_score) {
+        best = idx;
+        best_score = score;
+      }
+    }
+    if (!best) {
+      return std::nullopt;
+    }
+    std::vector<PageId> pids = start_draining(*best);
+    maybe_schedule_free(*best);
+    return std::make_pair(static_cast<LogOffset>(*best) * segment_size_, std::move(pids));
+  }
+
+  // 正在使用的segment数除以活页面折算成的segment数
+  double space_amplification() {
+    std::scoped_lock<std::mutex> lock(mu_);
+    apply_marks_locked();
+    return space_amplification_locked();
+  }
+
+  size_t segment_count() const {
+    std::scoped_lock<std::mutex> lock(mu_);
+    return segments_.size();
+  }
+
+  size_t free_count() const {
+    std::scoped_lock<std::mutex> lock(mu_);
+    return free_.size();
+  }
+
+private:
+  double space_amplification_locked() const {
+    return used_ == 0 ? 1.0 : static_cast<double>(used_) / std::max(live_, 1.0);
+  }
 };
 
-// ---- 工厂函数 ----
-inline std::unique_ptr<Segment> make_free_segment() {
-    return std::make_unique<FreeSegment>();
-}
-
-
-// 状态转换函数
-std::unique_ptr<Segment> FreeSegment::free_to_active(Lsn new_lsn) {
-    assert(!previous_lsn.has_value() || new_lsn > previous_lsn.value());
-    return std::make_unique<ActiveSegment>(new_lsn);
-}
-
-
 
+// 等待重写的页面, 按所在的segment分组
 struct SegmentCleanerInner {
   std::mutex mutex_;
   std::map<LogOffset, std::set<PageId>> inner_;
 };
 
-using SegmentCleaner = std::shared_ptr<SegmentCleanerInner>;
+// 后台清理线程
+// 每隔 cleaner_interval_ms 从accountant取一个值得清理的segment, 把其中的活页面通过rewrite重写到日志尾部,
+// 重写产生的 mark_replace 让segment最终回到Free. 写入速度被限制在 cleaner_bytes_per_sec 以内
+class SegmentCleaner {
+public:
+  // 把页面的当前版本重新写入日志并调用 mark_replace, 返回写入的字节数
+  using RewriteFn = std::function<size_t(PageId)>;
+
+private:
+  std::shared_ptr<SegmentAccountant> accountant_;
+  RewriteFn rewrite_;
+  uint64_t interval_ms_;
+  uint64_t bytes_per_sec_;
+  SegmentCleanerInner pending_;
+  std::atomic<uint64_t> rewritten_pages_;
+
+  std::mutex mu_;
+  std::condition_variable cv_;
+  bool shutdown_;
+  std::thread worker_;
+
+  // 超过速率时睡眠, 返回false表示需要退出
+  bool throttle(size_t bytes, std::chrono::steady_clock::time_point &window_start, uint64_t &window_bytes) {
+    if (bytes_per_sec_ == 0) {
+      return true;
+    }
+    window_bytes += bytes;
+    auto budget_time = std::chrono::microseconds(window_bytes * 1000000 / bytes_per_sec_);
+    auto wake = window_start + budget_time;
+    if (wake > std::chrono::steady_clock::now()) {
+      std::unique_lock<std::mutex> lock(mu_);
+      if (cv_.wait_until(lock, wake, [this] { return shutdown_; })) {
+        return false;
+      }
+    }
+    // 每秒重新开始计算, 空闲时积攒的额度不会变成突发
+    if (std::chrono::steady_clock::now() - window_start > std::chrono::seconds(1)) {
+      window_start = std::chrono::steady_clock::now();
+      window_bytes = 0;
+    }
+    return true;
+  }
+
+  bool pop(PageId &pid) {
+    std::scoped_lock<std::mutex> lock(pending_.mutex_);
+    while (!pending_.inner_.empty()) {
+      auto it = pending_.inner_.begin();
+      if (it->second.empty()) {
+        pending_.inner_.erase(it);
+        continue;
+      }
+      pid = *it->second.begin();
+      it->second.erase(it->second.begin());
+      return true;
+    }
+    return false;
+  }
+
+  void run() {
+    auto window_start = std::chrono::steady_clock::now();
+    uint64_t window_bytes = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        if (cv_.wait_for(lock, std::chrono::milliseconds(interval_ms_), [this] { return shutdown_; })) {
+          return;
+        }
+      }
+      try {
+        auto work = accountant_->clean();
+        if (!work) {
+          continue;
+        }
+        tlog_debug << "cleaning segment at " << work->first << " with " << work->second.size() << " live pages";
+        {
+          std::scoped_lock<std::mutex> lock(pending_.mutex_);
+          pending_.inner_[work->first].insert(work->second.begin(), work->second.end());
+        }
+        PageId pid;
+        while (pop(pid)) {
+          size_t bytes = rewrite_(pid);
+          rewritten_pages_.fetch_add(1, std::memory_order_relaxed);
+          if (!throttle(bytes, window_start, window_bytes)) {
+            return;
+          }
+        }
+      } catch (const std::exception &e) {
+        tlog_error << "segment cleaner failed: " << e.what();
+      }
+    }
+  }
 
+public:
+  SegmentCleaner(const Inner &config, std::shared_ptr<SegmentAccountant> accountant, RewriteFn rewrite)
+      : accountant_(std::move(accountant)), rewrite_(std::move(rewrite)), interval_ms_(config.cleaner_interval_ms),
+        bytes_per_sec_(config.cleaner_bytes_per_sec), rewritten_pages_(0), shutdown_(false) {
+    if (interval_ms_ > 0) {
+      worker_ = std::thread([this] { run(); });
+    }
+  }
 
+  NO_COPY_MOVE(SegmentCleaner);
+
+  ~SegmentCleaner() {
+    {
+      std::scoped_lock<std::mutex> lock(mu_);
+      shutdown_ = true;
+    }
+    cv_.notify_all();
+    if (worker_.joinable()) {
+      worker_.join();
+    }
+  }
+
+  uint64_t rewritten_pages() const {
+    return rewritten_pages_.load(std::memory_order_relaxed);
+  }
+};
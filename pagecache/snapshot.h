@@ -1,13 +1,23 @@
 #pragma once
+#include <map>
+#include <unordered_map>
 #include <vector>
 
 #include "disk_pointer.h"
 #include "def_types.h"
 
 
+struct CacheInfo {
+  uint64_t ts;  // 时间戳，用于保证日志的线性关系
+  Lsn lsn;
+  DiskPtr pointer; // 指向日志中的位置，是对应
+  uint64_t log_size; // 日志消息的总长度(消息头 + 负载), 读取时不需要先读消息头
+};
+
 struct CacheInfoWithoutTs {
   Lsn lsn;
   DiskPtr disk_ptr;
+  uint64_t log_size;
 };
 
 enum PageStateType {
@@ -16,11 +26,51 @@ enum PageStateType {
   Uninitialized, // 页面未初始化
 };
 
+// 恢复时按lsn顺序把日志消息应用到PageState上
+// 并行恢复时每个线程只看到一段lsn范围, 范围内没有见到基准页的PageState为Uninitialized, 只记录frags_
 class PageState {
 public:
-  PageStateType type_;
+  PageStateType type_ = Uninitialized;
   CacheInfoWithoutTs base_; // 基准页信息
   std::vector<CacheInfoWithoutTs> frags_; // 同一page的多个fragment 信息, 如果是页面状态是free的，那么只有base_是有效的,frags_是空的
 public:
+  // 新的基准页, 之前的fragment全部作废
+  void set_base(CacheInfoWithoutTs info) {
+    type_ = Present;
+    base_ = info;
+    frags_.clear();
+  }
+
+  void set_free(CacheInfoWithoutTs info) {
+    type_ = Free;
+    base_ = info;
+    frags_.clear();
+  }
+
+  // 页面被释放之后的link没有意义, 直接丢弃
+  void push_frag(CacheInfoWithoutTs info) {
+    if (type_ != Free) {
+      frags_.push_back(info);
+    }
+  }
+
+  // later 覆盖的lsn范围紧接在this之后
+  void merge(PageState &&later) {
+    if (later.type_ != Uninitialized) {
+      *this = std::move(later);
+      return;
+    }
+    for (auto &frag : later.frags_) {
+      push_frag(frag);
+    }
+  }
+};
 
+// 恢复的结果
+struct Snapshot {
+  Lsn stable_lsn = -1; // 最后一条有效消息的最后一个字节的lsn
+  Lsn next_lsn = 0; // 新日志从这个lsn开始, 总是一个新的segment
+  LogOffset next_offset = 0;
+  std::map<Lsn, LogOffset> segments; // 恢复出来的segment, lsn -> offset
+  std::unordered_map<PageId, PageState> pt;
 };
\ No newline at end of file
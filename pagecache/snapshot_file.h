@@ -0,0 +1,344 @@
+#pragma once
+
+/*
+快照文件
+
+page table 以平铺的二进制格式保存, 所有字段都是8字节对齐的定长记录, 可以直接mmap之后使用:
+
+  [SnapshotFileHeader]
+  [SnapshotSegmentEntry * segment_count]  按lsn排序
+  [SnapshotPageEntry * page_count]        按pid排序, 可以二分查找
+  [SnapshotFragEntry * frag_count]        每个页面的fragment连续存放, 由 frag_begin/frag_count 引用
+
+crc32 覆盖header之后的全部内容. 写入时先写临时文件, fsync之后rename, 崩溃时旧的快照仍然完整.
+
+启动时 mmap 快照, 只重放 stable_lsn 之后的日志 (Recovery::recover).
+运行时每 snapshot_after_ops 次操作, 在后台把上一份快照加上之后的增量 (Recovery::advance) 写成新的快照.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "def_types.h"
+#include "disk_pointer.h"
+#include "io_unix.h"
+#include "recovery.h"
+#include "snapshot.h"
+#include "../config.h"
+#include "../threadpool.h"
+#include "../util/common_def.h"
+#include "../util/pcrc.h"
+#include "../3rd/log/tlog.h"
+
+constexpr uint64_t SNAPSHOT_MAGIC = 0x50414e53534c4544; // "DELSSNAP"
+constexpr uint32_t SNAPSHOT_VERSION = 3;
+
+struct SnapshotFileHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t crc32;
+  Lsn stable_lsn;
+  uint64_t segment_count;
+  uint64_t page_count;
+  uint64_t frag_count;
+};
+
+struct SnapshotSegmentEntry {
+  Lsn lsn;
+  LogOffset offset;
+};
+
+struct SnapshotDiskPtr {
+  LogOffset offset;       // 日志中的offset
+  uint64_t heap_location; // blob 时的 HeapId
+  Lsn original_lsn;
+  uint64_t inline_flag;
+
+  static SnapshotDiskPtr from(const DiskPtr &ptr) {
+    if (ptr.is_inline()) {
+      return SnapshotDiskPtr {ptr.offset, 0, 0, 1};
+    }
+    return SnapshotDiskPtr {ptr.offset, ptr.heap_id.location, ptr.heap_id.original_lsn, 0};
+  }
+
+  DiskPtr to_disk_ptr() const {
+    if (inline_flag) {
+      return DiskPtr::new_inline(offset);
+    }
+    return DiskPtr::new_blob(offset, HeapId {heap_location, original_lsn});
+  }
+};
+
+struct SnapshotPageEntry {
+  PageId pid;
+  uint64_t type;
+  Lsn base_lsn;
+  SnapshotDiskPtr base_ptr;
+  uint64_t base_log_size;
+  uint64_t frag_begin;
+  uint64_t frag_count;
+};
+
+struct SnapshotFragEntry {
+  Lsn lsn;
+  SnapshotDiskPtr ptr;
+  uint64_t log_size;
+};
+
+static_assert(std::is_trivially_copyable<SnapshotPageEntry>::value, "snapshot entries are mmapped");
+static_assert(sizeof(SnapshotFileHeader) % 8 == 0 && sizeof(SnapshotPageEntry) % 8 == 0 &&
+                  sizeof(SnapshotFragEntry) % 8 == 0 && sizeof(SnapshotSegmentEntry) % 8 == 0,
+              "snapshot entries must keep 8 byte alignment");
+
+// 原子地替换path处的快照
+inline void write_snapshot(const Snapshot &snapshot, const std::string &path) {
+  std::vector<std::pair<PageId, const PageState *>> pages;
+  pages.reserve(snapshot.pt.size());
+  size_t frag_count = 0;
+  for (auto &entry : snapshot.pt) {
+    pages.emplace_back(entry.first, &entry.second);
+    frag_count += entry.second.frags_.size();
+  }
+  std::sort(pages.begin(), pages.end(),
+            [](const std::pair<PageId, const PageState *> &a, const std::pair<PageId, const PageState *> &b) {
+              return a.first < b.first;
+            });
+
+  size_t len = sizeof(SnapshotFileHeader) + snapshot.segments.size() * sizeof(SnapshotSegmentEntry) +
+               pages.size() * sizeof(SnapshotPageEntry) + frag_count * sizeof(SnapshotFragEntry);
+  std::vector<unsigned char> buf(len);
+  SnapshotFileHeader header {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 0, snapshot.stable_lsn,
+                             snapshot.segments.size(), pages.size(), frag_count};
+  size_t at = sizeof(SnapshotFileHeader);
+  for (auto &entry : snapshot.segments) {
+    SnapshotSegmentEntry seg {entry.first, entry.second};
+    std::memcpy(buf.data() + at, &seg, sizeof(seg));
+    at += sizeof(seg);
+  }
+  size_t frag_at = at + pages.size() * sizeof(SnapshotPageEntry);
+  uint64_t frag_index = 0;
+  for (auto &entry : pages) {
+    const PageState &state = *entry.second;
+    SnapshotPageEntry page {entry.first, static_cast<uint64_t>(state.type_), state.base_.lsn,
+                            SnapshotDiskPtr::from(state.base_.disk_ptr), state.base_.log_size, frag_index,
+                            state.frags_.size()};
+    std::memcpy(buf.data() + at, &page, sizeof(page));
+    at += sizeof(page);
+    for (auto &frag : state.frags_) {
+      SnapshotFragEntry f {frag.lsn, SnapshotDiskPtr::from(frag.disk_ptr), frag.log_size};
+      std::memcpy(buf.data() + frag_at, &f, sizeof(f));
+      frag_at += sizeof(f);
+    }
+    frag_index += state.frags_.size();
+  }
+  header.crc32 = crc32_buf(buf.data() + sizeof(SnapshotFileHeader), len - sizeof(SnapshotFileHeader));
+  std::memcpy(buf.data(), &header, sizeof(header));
+
+  std::string tmp_path = path + ".tmp";
+  int fd = ::open(tmp_path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+  if (fd < 0) {
+    throw std::system_error(errno, std::generic_category(), "open " + tmp_path);
+  }
+  try {
+    pwrite_all(fd, buf.data(), buf.size(), 0);
+    fsync_fd(fd);
+  } catch (...) {
+    ::close(fd);
+    ::unlink(tmp_path.c_str());
+    throw;
+  }
+  ::close(fd);
+  if (::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    throw std::system_error(errno, std::generic_category(), "rename " + tmp_path);
+  }
+  // rename 本身也要落盘
+  fsync_parent_dir(path);
+}
+
+// mmap 到内存中的只读快照
+class SnapshotView {
+  void *addr_;
+  size_t len_;
+
+  SnapshotView(void *addr, size_t len) : addr_(addr), len_(len) {}
+
+  const unsigned char *base() const {
+    return static_cast<const unsigned char *>(addr_);
+  }
+
+public:
+  NO_COPY_MOVE(SnapshotView);
+
+  ~SnapshotView() {
+    ::munmap(addr_, len_);
+  }
+
+  // 文件不存在或者损坏时返回nullptr
+  static std::unique_ptr<SnapshotView> open(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotFileHeader)) {
+      ::close(fd);
+      tlog_warn << "ignoring truncated snapshot " << path;
+      return nullptr;
+    }
+    size_t len = static_cast<size_t>(st.st_size);
+    void *addr = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category(), "mmap " + path);
+    }
+    std::unique_ptr<SnapshotView> view(new SnapshotView(addr, len));
+    const SnapshotFileHeader &h = view->header();
+    size_t expected = sizeof(SnapshotFileHeader) + h.segment_count * sizeof(SnapshotSegmentEntry) +
+                      h.page_count * sizeof(SnapshotPageEntry) + h.frag_count * sizeof(SnapshotFragEntry);
+    if (h.magic != SNAPSHOT_MAGIC || h.version != SNAPSHOT_VERSION || expected != len ||
+        crc32_buf(view->base() + sizeof(SnapshotFileHeader), len - sizeof(SnapshotFileHeader)) != h.crc32) {
+      tlog_warn << "ignoring corrupted snapshot " << path;
+      return nullptr;
+    }
+    return view;
+  }
+
+  const SnapshotFileHeader &header() const {
+    return *reinterpret_cast<const SnapshotFileHeader *>(base());
+  }
+
+  const SnapshotSegmentEntry *segments() const {
+    return reinterpret_cast<const SnapshotSegmentEntry *>(base() + sizeof(SnapshotFileHeader));
+  }
+
+  const SnapshotPageEntry *pages() const {
+    return reinterpret_cast<const SnapshotPageEntry *>(segments() + header().segment_count);
+  }
+
+  const SnapshotFragEntry *frags() const {
+    return reinterpret_cast<const SnapshotFragEntry *>(pages() + header().page_count);
+  }
+
+  const SnapshotPageEntry *find(PageId pid) const {
+    const SnapshotPageEntry *begin = pages();
+    const SnapshotPageEntry *end = begin + header().page_count;
+    auto it = std::lower_bound(begin, end, pid,
+                               [](const SnapshotPageEntry &page, PageId p) { return page.pid < p; });
+    return it != end && it->pid == pid ? it : nullptr;
+  }
+
+  PageState page_state(const SnapshotPageEntry &page) const {
+    PageState state;
+    state.type_ = static_cast<PageStateType>(page.type);
+    state.base_ = CacheInfoWithoutTs {page.base_lsn, page.base_ptr.to_disk_ptr(), page.base_log_size};
+    state.frags_.reserve(page.frag_count);
+    const SnapshotFragEntry *frag = frags() + page.frag_begin;
+    for (uint64_t i = 0; i < page.frag_count; ++i, ++frag) {
+      state.frags_.push_back(CacheInfoWithoutTs {frag->lsn, frag->ptr.to_disk_ptr(), frag->log_size});
+    }
+    return state;
+  }
+
+  Snapshot to_snapshot() const {
+    Snapshot snapshot;
+    snapshot.stable_lsn = header().stable_lsn;
+    for (uint64_t i = 0; i < header().segment_count; ++i) {
+      snapshot.segments.emplace(segments()[i].lsn, segments()[i].offset);
+    }
+    snapshot.pt.reserve(header().page_count);
+    for (uint64_t i = 0; i < header().page_count; ++i) {
+      snapshot.pt.emplace(pages()[i].pid, page_state(pages()[i]));
+    }
+    return snapshot;
+  }
+};
+
+// 没有可用的快照时返回空快照
+inline Snapshot read_snapshot(const std::string &path) {
+  auto view = SnapshotView::open(path);
+  return view ? view->to_snapshot() : Snapshot();
+}
+
+// 启动时先加载快照, 再重放之后的日志
+inline Snapshot recover_with_snapshot(const Inner &config, int fd, const std::string &snapshot_path,
+                                      size_t threads = std::thread::hardware_concurrency()) {
+  return Recovery::recover(config, fd, threads, read_snapshot(snapshot_path));
+}
+
+// 每 snapshot_after_ops 次操作在后台增量生成一次快照
+class Snapshotter {
+  Inner config_;
+  int fd_;
+  std::string path_;
+  std::function<Lsn()> stable_lsn_;
+  std::function<std::map<Lsn, LogOffset>(Lsn)> segments_after_; // 日志在某个lsn之后写入的segment
+  std::mutex mu_;
+  Snapshot last_; // 上一份快照, 由mu_保护
+  std::atomic<uint64_t> ops_;
+  std::atomic<bool> scheduled_;
+  ThreadPool worker_; // 最后析构, 先等待进行中的快照完成
+
+public:
+  // base 通常是启动时恢复出来的结果
+  Snapshotter(const Inner &config, int fd, std::string path, Snapshot base, std::function<Lsn()> stable_lsn,
+              std::function<std::map<Lsn, LogOffset>(Lsn)> segments_after)
+      : config_(config), fd_(fd), path_(std::move(path)), stable_lsn_(std::move(stable_lsn)),
+        segments_after_(std::move(segments_after)), last_(std::move(base)), ops_(0), scheduled_(false),
+        worker_(1) {}
+
+  NO_COPY_MOVE(Snapshotter);
+
+  ~Snapshotter() {
+    worker_.shutdown();
+  }
+
+  const std::string &path() const {
+    return path_;
+  }
+
+  void count_op() {
+    if (config_.snapshot_after_ops == 0) {
+      return;
+    }
+    uint64_t ops = ops_.fetch_add(1, std::memory_order_relaxed) + 1;
+    if (ops % config_.snapshot_after_ops != 0 || scheduled_.exchange(true, std::memory_order_acq_rel)) {
+      return;
+    }
+    worker_.enqueue([this] {
+      try {
+        take_snapshot();
+      } catch (const std::exception &e) {
+        tlog_error << "failed to write snapshot " << path_ << ": " << e.what();
+      }
+      scheduled_.store(false, std::memory_order_release);
+    });
+  }
+
+  // 把上一份快照推进到当前的stable lsn并写出, 返回快照的lsn
+  Lsn take_snapshot() {
+    std::scoped_lock<std::mutex> lock(mu_);
+    Lsn upto = stable_lsn_();
+    if (upto <= last_.stable_lsn) {
+      return last_.stable_lsn;
+    }
+    Recovery::advance(config_, fd_, last_, upto, segments_after_(last_.stable_lsn));
+    write_snapshot(last_, path_);
+    tlog_info << "wrote snapshot " << path_ << " at lsn " << upto << " with " << last_.pt.size() << " pages";
+    return upto;
+  }
+};
@@ -1,5 +1,4 @@
 #pragma once
-#include <coroutine>
 enum Error {
   CollectionNotFound,
   /// The system has been used in an unsupported way.
@@ -1,5 +1,495 @@
 #pragma once
+
+/*
+页面的序列化格式
+
+两阶段写入: 先用 serialized_size() 算出长度, 在日志中预留这么大的空间, 再用 serialize_into()
+直接写进预留到的 SliceMut, 中间不经过临时的 std::vector. 可序列化的类型只需要提供这两个函数.
+
+长度和页面id都用varint编码(每字节7位, 最高位表示后面还有).
+
+Node (基准页):
+  [flags u8] bit0 = index节点, bit1 = 有hi
+  [count varint]
+  [lo_len varint][lo] [hi_len varint][hi]
+  [next varint]                    右兄弟, 0 表示没有
+  [level varint]                   leaf 是0, 父节点比孩子高一层
+  [merged_into varint]             正在并入的左兄弟, 0 表示没有(见tree.h)
+  [prefix_len varint][prefix]      所有key共同的前缀, 只存一次
+  [heads: count × u64]             去掉前缀之后key的前8个字节, 按大端解释, 不足补0
+  [offsets: count × u32]           每个条目相对条目区起点的偏移
+  [条目: suffix_len varint, suffix, value_len varint, value] × count
+index节点的value是子页面id的varint编码.
+NodeView 直接在这段字节上查找, 只解析用到的条目: 先在连续的heads中定位(psearch.h, 大节点先二分缩小范围),
+头部相同的几个再比较完整的suffix. key有序时head也有序, 所以头部不同就能直接决定顺序.
+
+Delta (增量):
+  [kind u8][key_len varint][key] (Set 时再跟 [value_len varint][value])
+*/
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "slice.h"
 #include "u_type.h"
+#include "util/psearch.h"
+
 struct Serialize {
+  static constexpr size_t MAX_VARINT_LEN = 10;
+
+  static size_t varint_size(u64 v) {
+    size_t n = 1;
+    while (v >= 0x80) {
+      v >>= 7;
+      ++n;
+    }
+    return n;
+  }
+
+  // 带varint长度前缀的一段字节
+  static size_t prefixed_size(size_t len) {
+    return varint_size(len) + len;
+  }
+
+  // 写函数从out的开头写入, 然后把写过的部分从out中去掉
+  static void put_u8(SliceMut &out, u8 v) {
+    out[0] = v;
+    out.remove_prefix(1);
+  }
+
+  static void put_u32(SliceMut &out, u32 v) {
+    assert(out.size() >= 4);
+    std::memcpy(out.data(), &v, 4);
+    out.remove_prefix(4);
+  }
+
+  static void put_varint(SliceMut &out, u64 v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+      out[n++] = static_cast<unsigned char>(v | 0x80);
+      v >>= 7;
+    }
+    out[n++] = static_cast<unsigned char>(v);
+    out.remove_prefix(n);
+  }
+
+  static void put_bytes(SliceMut &out, const void *data, size_t len) {
+    assert(out.size() >= len);
+    if (len > 0) {
+      std::memcpy(out.data(), data, len);
+    }
+    out.remove_prefix(len);
+  }
+
+  static void put_u64(SliceMut &out, u64 v) {
+    assert(out.size() >= 8);
+    std::memcpy(out.data(), &v, 8);
+    out.remove_prefix(8);
+  }
+
+  static void put_prefixed(SliceMut &out, const char *data, size_t len) {
+    put_varint(out, len);
+    put_bytes(out, data, len);
+  }
+
+  static void put_prefixed(SliceMut &out, const std::string &s) {
+    put_prefixed(out, s.data(), s.size());
+  }
+
+  // key的前8个字节按大端解释, 不足8个字节补0; key的字节序和head的大小顺序一致
+  static u64 key_head(const char *data, size_t len) {
+    u64 head = 0;
+    for (size_t i = 0; i < 8; ++i) {
+      head = (head << 8) | (i < len ? static_cast<unsigned char>(data[i]) : 0);
+    }
+    return head;
+  }
+
+  // 读函数从p读取并前进, 越过end说明数据损坏
+  static u8 get_u8(const unsigned char *&p, const unsigned char *end) {
+    if (p >= end) {
+      throw std::runtime_error("serialized data is truncated");
+    }
+    return *p++;
+  }
+
+  static u32 get_u32(const unsigned char *&p, const unsigned char *end) {
+    if (end - p < 4) {
+      throw std::runtime_error("serialized data is truncated");
+    }
+    u32 v;
+    std::memcpy(&v, p, 4);
+    p += 4;
+    return v;
+  }
+
+  static u64 get_varint(const unsigned char *&p, const unsigned char *end) {
+    u64 v = 0;
+    for (size_t shift = 0; shift < 7 * MAX_VARINT_LEN; shift += 7) {
+      u8 byte = get_u8(p, end);
+      v |= static_cast<u64>(byte & 0x7F) << shift;
+      if ((byte & 0x80) == 0) {
+        return v;
+      }
+    }
+    throw std::runtime_error("varint is too long");
+  }
+
+  static Slice get_prefixed(const unsigned char *&p, const unsigned char *end) {
+    u64 len = get_varint(p, end);
+    if (static_cast<u64>(end - p) < len) {
+      throw std::runtime_error("serialized data is truncated");
+    }
+    Slice s(reinterpret_cast<const char *>(p), static_cast<size_t>(len));
+    p += len;
+    return s;
+  }
+
+  // 需要一份独立的字节时使用(例如压缩或者写heap), 长度一次算好, 不会反复扩容
+  template <class T>
+  static std::vector<unsigned char> to_vec(const T &value) {
+    std::vector<unsigned char> buf(value.serialized_size());
+    SliceMut out(buf.data(), buf.size());
+    value.serialize_into(out);
+    assert(out.empty());
+    return buf;
+  }
+};
+
+enum class DeltaKind : u8 {
+  Set = 1,
+  Del = 2,
+};
+
+// 对基准页的一次修改
+struct Delta {
+  DeltaKind kind;
+  std::string key;
+  std::string value; // 只有Set使用
+
+  static Delta set(std::string key, std::string value) {
+    return Delta {DeltaKind::Set, std::move(key), std::move(value)};
+  }
+
+  static Delta del(std::string key) {
+    return Delta {DeltaKind::Del, std::move(key), {}};
+  }
+
+  size_t serialized_size() const {
+    size_t size = 1 + Serialize::prefixed_size(key.size());
+    if (kind == DeltaKind::Set) {
+      size += Serialize::prefixed_size(value.size());
+    }
+    return size;
+  }
+
+  void serialize_into(SliceMut &out) const {
+    Serialize::put_u8(out, static_cast<u8>(kind));
+    Serialize::put_prefixed(out, key);
+    if (kind == DeltaKind::Set) {
+      Serialize::put_prefixed(out, value);
+    }
+  }
+
+  static Delta deserialize(const unsigned char *data, size_t len) {
+    const unsigned char *p = data;
+    const unsigned char *end = data + len;
+    Delta delta;
+    delta.kind = static_cast<DeltaKind>(Serialize::get_u8(p, end));
+    if (delta.kind != DeltaKind::Set && delta.kind != DeltaKind::Del) {
+      throw std::runtime_error("unknown delta kind");
+    }
+    delta.key = Serialize::get_prefixed(p, end).ToString();
+    if (delta.kind == DeltaKind::Set) {
+      delta.value = Serialize::get_prefixed(p, end).ToString();
+    }
+    return delta;
+  }
+};
+
+constexpr u8 NODE_FLAG_INDEX = 1;
+constexpr u8 NODE_FLAG_HAS_HI = 2;
+
+// 树节点的完整内容, 条目按key的字节序排列
+struct Node {
+  bool is_index = false;
+  std::string lo;
+  std::optional<std::string> hi; // 没有上界时为空
+  PageId next = 0;
+  u32 level = 0;
+  PageId merged_into = 0;
+  std::vector<std::pair<std::string, std::string>> items;
+
+  static std::string encode_child(PageId pid) {
+    std::string buf(Serialize::varint_size(pid), '\0');
+    SliceMut out(buf);
+    Serialize::put_varint(out, pid);
+    return buf;
+  }
+
+  static PageId decode_child(const Slice &value) {
+    auto *p = reinterpret_cast<const unsigned char *>(value.data());
+    return Serialize::get_varint(p, p + value.size());
+  }
+
+  // 所有key共同前缀的长度. 条目有序, 只需要比较第一个和最后一个
+  size_t prefix_len() const {
+    if (items.empty()) {
+      return 0;
+    }
+    const std::string &first = items.front().first;
+    const std::string &last = items.back().first;
+    size_t len = std::min(first.size(), last.size());
+    size_t i = 0;
+    while (i < len && first[i] == last[i]) {
+      ++i;
+    }
+    return i;
+  }
+
+  size_t serialized_size() const {
+    size_t plen = prefix_len();
+    size_t size = 1 + Serialize::varint_size(items.size()) + Serialize::prefixed_size(lo.size()) +
+                  Serialize::prefixed_size(hi ? hi->size() : 0) + Serialize::varint_size(next) +
+                  Serialize::varint_size(level) + Serialize::varint_size(merged_into) + Serialize::prefixed_size(plen) +
+                  12 * items.size();
+    for (auto &item : items) {
+      size += Serialize::prefixed_size(item.first.size() - plen) + Serialize::prefixed_size(item.second.size());
+    }
+    return size;
+  }
+
+  void serialize_into(SliceMut &out) const {
+    size_t plen = prefix_len();
+    Serialize::put_u8(out, (is_index ? NODE_FLAG_INDEX : 0) | (hi ? NODE_FLAG_HAS_HI : 0));
+    Serialize::put_varint(out, items.size());
+    Serialize::put_prefixed(out, lo);
+    Serialize::put_prefixed(out, hi ? *hi : std::string());
+    Serialize::put_varint(out, next);
+    Serialize::put_varint(out, level);
+    Serialize::put_varint(out, merged_into);
+    Serialize::put_prefixed(out, items.empty() ? "" : items.front().first.data(), plen);
+    for (auto &item : items) {
+      Serialize::put_u64(out, Serialize::key_head(item.first.data() + plen, item.first.size() - plen));
+    }
+    u32 offset = 0;
+    for (auto &item : items) {
+      Serialize::put_u32(out, offset);
+      offset += static_cast<u32>(Serialize::prefixed_size(item.first.size() - plen) +
+                                 Serialize::prefixed_size(item.second.size()));
+    }
+    for (auto &item : items) {
+      Serialize::put_prefixed(out, item.first.data() + plen, item.first.size() - plen);
+      Serialize::put_prefixed(out, item.second);
+    }
+  }
+
+  // 应用一个增量, 保持条目有序
+  void apply(const Delta &delta) {
+    auto it = std::lower_bound(items.begin(), items.end(), delta.key,
+                               [](const std::pair<std::string, std::string> &item, const std::string &key) {
+                                 return item.first < key;
+                               });
+    bool found = it != items.end() && it->first == delta.key;
+    if (delta.kind == DeltaKind::Set) {
+      if (found) {
+        it->second = delta.value;
+      } else {
+        items.emplace(it, delta.key, delta.value);
+      }
+    } else if (found) {
+      items.erase(it);
+    }
+  }
+};
+
+// 直接在序列化后的字节上读节点, 不拷贝也不解析全部条目. 字节的生命周期由调用者保证
+class NodeView {
+  // 大节点先在heads上二分, 剩下不超过这么多个时再一起比较
+  static constexpr size_t HEAD_SCAN = 32;
+
+  const unsigned char *heads_ = nullptr;
+  const unsigned char *offsets_ = nullptr;
+  const unsigned char *entries_ = nullptr;
+  const unsigned char *end_ = nullptr;
+  u8 flags_ = 0;
+  size_t count_ = 0;
+  Slice lo_;
+  Slice hi_;
+  PageId next_ = 0;
+  u32 level_ = 0;
+  PageId merged_into_ = 0;
+  Slice prefix_;
+
+  u64 head(size_t i) const {
+    return psearch::load_u64(heads_ + 8 * i);
+  }
+
+  std::pair<Slice, Slice> entry(size_t i) const {
+    assert(i < count_);
+    u32 offset;
+    std::memcpy(&offset, offsets_ + 4 * i, 4);
+    if (offset >= static_cast<size_t>(end_ - entries_)) {
+      throw std::runtime_error("node entry offset is out of range");
+    }
+    const unsigned char *p = entries_ + offset;
+    Slice suffix = Serialize::get_prefixed(p, end_);
+    Slice value = Serialize::get_prefixed(p, end_);
+    return {suffix, value};
+  }
+
+  // key 是否等于第i个条目的key
+  bool key_equals(size_t i, const Slice &key) const {
+    Slice suffix = entry(i).first;
+    return key.size() == prefix_.size() + suffix.size() && key.starts_with(prefix_) &&
+           std::memcmp(key.data() + prefix_.size(), suffix.data(), suffix.size()) == 0;
+  }
+
+public:
+  NodeView() = default;
+
+  NodeView(const unsigned char *data, size_t len) : end_(data + len) {
+    const unsigned char *p = data;
+    flags_ = Serialize::get_u8(p, end_);
+    u64 count = Serialize::get_varint(p, end_);
+    lo_ = Serialize::get_prefixed(p, end_);
+    hi_ = Serialize::get_prefixed(p, end_);
+    next_ = Serialize::get_varint(p, end_);
+    level_ = static_cast<u32>(Serialize::get_varint(p, end_));
+    merged_into_ = Serialize::get_varint(p, end_);
+    prefix_ = Serialize::get_prefixed(p, end_);
+    if (count > static_cast<u64>(end_ - p) / 12) {
+      throw std::runtime_error("node item count is out of range");
+    }
+    count_ = static_cast<size_t>(count);
+    heads_ = p;
+    offsets_ = heads_ + 8 * count_;
+    entries_ = offsets_ + 4 * count_;
+  }
+
+  bool is_index() const { return flags_ & NODE_FLAG_INDEX; }
+  size_t size() const { return count_; }
+  const Slice &lo() const { return lo_; }
+  bool has_hi() const { return flags_ & NODE_FLAG_HAS_HI; }
+  const Slice &hi() const { return hi_; }
+  PageId next() const { return next_; }
+  u32 level() const { return level_; }
+  PageId merged_into() const { return merged_into_; }
+
+  // 所有key共同的前缀, key(i) 是它加上 suffix(i)
+  const Slice &prefix() const { return prefix_; }
+  Slice suffix(size_t i) const { return entry(i).first; }
+
+  std::string key(size_t i) const {
+    Slice suffix = entry(i).first;
+    std::string key;
+    key.reserve(prefix_.size() + suffix.size());
+    key.append(prefix_.data(), prefix_.size());
+    key.append(suffix.data(), suffix.size());
+    return key;
+  }
+
+  Slice value(size_t i) const { return entry(i).second; }
+  PageId child(size_t i) const { return Node::decode_child(value(i)); }
+
+  // key 是否落在 [lo, hi) 之外, 在B-link树中需要转向右兄弟
+  bool beyond_hi(const Slice &key) const {
+    return has_hi() && key.compare(hi_) >= 0;
+  }
+
+  // 第一个 >= key 的条目
+  size_t lower_bound(const Slice &key) const {
+    // 先和前缀比较, 不以它开头的key在所有条目的同一侧
+    size_t plen = std::min(key.size(), prefix_.size());
+    int cmp = std::memcmp(key.data(), prefix_.data(), plen);
+    if (cmp < 0 || (cmp == 0 && key.size() < prefix_.size())) {
+      return 0;
+    }
+    if (cmp > 0) {
+      return count_;
+    }
+    Slice rest(key.data() + prefix_.size(), key.size() - prefix_.size());
+    u64 probe = Serialize::key_head(rest.data(), rest.size());
+
+    // heads 中 [0, lo) 都小于probe, [hi, count) 都不小于probe
+    size_t lo = 0;
+    size_t hi = count_;
+    while (hi - lo > HEAD_SCAN) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (head(mid) < probe) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    lo += psearch::count_less(heads_ + 8 * lo, hi - lo, probe);
+
+    // 头部相同的条目再比较完整的suffix. 大多数key的头部互不相同, 通常一次都不用比较
+    if (lo == count_ || head(lo) != probe) {
+      return lo;
+    }
+    size_t run = lo + 1;
+    hi = count_;
+    while (run < hi) {
+      size_t mid = run + (hi - run) / 2;
+      if (head(mid) == probe) {
+        run = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (entry(mid).first.compare(rest) < 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  std::optional<Slice> get(const Slice &key) const {
+    size_t i = lower_bound(key);
+    if (i < count_ && key_equals(i, key)) {
+      return value(i);
+    }
+    return std::nullopt;
+  }
+
+  // index节点中负责key的子页面: 最后一个 <= key 的分隔键
+  PageId child_for(const Slice &key) const {
+    if (count_ == 0) {
+      throw std::runtime_error("index node has no children");
+    }
+    size_t i = lower_bound(key);
+    if (i == count_ || !key_equals(i, key)) {
+      i = i == 0 ? 0 : i - 1;
+    }
+    return child(i);
+  }
 
-};
\ No newline at end of file
+  Node to_node() const {
+    Node node;
+    node.is_index = is_index();
+    node.lo = lo_.ToString();
+    if (has_hi()) {
+      node.hi = hi_.ToString();
+    }
+    node.next = next_;
+    node.level = level_;
+    node.merged_into = merged_into_;
+    node.items.reserve(count_);
+    for (size_t i = 0; i < count_; ++i) {
+      node.items.emplace_back(key(i), value(i).ToString());
+    }
+    return node;
+  }
+};
@@ -1,5 +1,14 @@
 // #include "test_epoch.h"
 // #include "test_skiplist.h"
+// #include "test_iobuf.h"
+// #include "test_recovery.h"
+// #include "test_crc.h"
+// #include "test_segment.h"
+// #include "test_heap.h"
+// #include "test_pagetable.h"
+// #include "test_pagecache.h"
+// #include "test_serialize.h"
+// #include "test_tree.h"
 #include "../util/cache_padded.h"
 #include <atomic>
 #include <cstddef>
@@ -9,6 +18,35 @@
 
 int main() {
     // CconcurrentSkipListTest::concurrent_exchange_test();
+    // CioBufTest::concurrent_reserve_test();
+    // CioBufTest::group_commit_test();
+    // CrecoveryTest::parallel_recover_test();
+    // CrecoveryTest::snapshot_test();
+    // CrecoveryTest::lanes_test();
+    // CcrcTest::crc32c_test();
+    // CcrcTest::crc32c_benchmark();
+    // CsegmentTest::accountant_test();
+    // CsegmentTest::mark_order_test();
+    // CsegmentTest::cleaner_test();
+    // CheapTest::slab_test();
+    // CheapTest::reclaim_test();
+    // CheapTest::blob_log_test();
+    // CpageTableTest::concurrent_test();
+    // CpageCacheTest::consolidation_test();
+    // CpageCacheTest::scan_test();
+    // CpageCacheTest::eviction_test();
+    // CpageCacheTest::vectored_read_test();
+    // CpageCacheTest::compression_test();
+    // CpageCacheTest::mode_benchmark();
+    // CpageCacheTest::mmap_test();
+    // CpageCacheTest::batch_test();
+    // CpageCacheTest::idgen_test();
+    // CpageCacheTest::free_test();
+    // CserializeTest::format_test();
+    // CserializeTest::search_test();
+    // CserializeTest::pagecache_test();
+    // CtreeTest::concurrent_test();
+    // CtreeTest::recovery_test();
     std::unique_ptr<int> ptr = std::make_unique<int>(42);
     ptr = std::make_unique<int>(100); // 原先的指针将被释放
     std::cout << "Value: " << *ptr << std::endl; // 输出
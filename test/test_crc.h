@@ -0,0 +1,98 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#include <zlib.h>
+
+#include "../util/pcrc.h"
+
+class CcrcTest final {
+
+private:
+  static double gb_per_sec(size_t bytes, std::chrono::steady_clock::duration elapsed) {
+    double secs = std::chrono::duration<double>(elapsed).count();
+    return static_cast<double>(bytes) / secs / 1e9;
+  }
+
+  template <typename F>
+  static void bench(const char *name, const std::vector<unsigned char> &data, size_t len, F f) {
+    size_t rounds = std::max<size_t>(1, (size_t(1) << 30) / len); // 每项约1GB
+    uint32_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < rounds; ++i) {
+      sink += f(data.data(), len);
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  " << name << " len=" << len << ": " << gb_per_sec(rounds * len, elapsed) << " GB/s"
+              << " (" << sink << ")" << std::endl;
+  }
+
+public:
+  // 所有实现在各种长度和对齐下结果一致, 流式计算与一次性计算一致
+  static void crc32c_test() {
+    const unsigned char check[] = "123456789";
+    if (crc32c(check, 9) != 0xE3069283) {
+      throw std::runtime_error("crc32c check value mismatch");
+    }
+
+    std::mt19937_64 rnd(42);
+    std::vector<unsigned char> data(4 * pcrc::CRC_LONG * 3 + 64);
+    for (auto &b : data) {
+      b = static_cast<unsigned char>(rnd());
+    }
+    const pcrc::CrcImpl impls[] = {pcrc::CrcSoftware, pcrc::CrcSse42, pcrc::CrcSse42Clmul};
+    pcrc::CrcImpl best = pcrc::best_impl();
+    for (int i = 0; i < 2000; ++i) {
+      size_t offset = rnd() % 8;
+      size_t len = i < 1000 ? rnd() % 1024 : rnd() % (data.size() - offset);
+      uint32_t expected = pcrc::update_sw(0xFFFFFFFF, data.data() + offset, len);
+      for (auto impl : impls) {
+        if (impl > best) {
+          continue; // CPU不支持
+        }
+        if (pcrc::update_fn(impl)(0xFFFFFFFF, data.data() + offset, len) != expected) {
+          throw std::runtime_error("crc32c implementations disagree at len " + std::to_string(len));
+        }
+      }
+      size_t split = len == 0 ? 0 : rnd() % len;
+      Crc32c stream;
+      stream.update(data.data() + offset, split).update(data.data() + offset + split, len - split);
+      if (stream.finish() != ~expected) {
+        throw std::runtime_error("streaming crc32c mismatch");
+      }
+    }
+    std::cout << "crc32c ok, impl " << best << std::endl;
+  }
+
+  // 与原来的zlib crc32对比
+  static void crc32c_benchmark() {
+    std::vector<unsigned char> data(1 << 20);
+    std::mt19937_64 rnd(7);
+    for (auto &b : data) {
+      b = static_cast<unsigned char>(rnd());
+    }
+    for (size_t len : {size_t(24), size_t(256), size_t(4096), size_t(64 * 1024), size_t(1 << 20)}) {
+      bench("zlib crc32    ", data, len, [](const unsigned char *p, size_t n) {
+        return static_cast<uint32_t>(::crc32(0, p, static_cast<uInt>(n)));
+      });
+      bench("crc32c sw     ", data, len, [](const unsigned char *p, size_t n) {
+        return pcrc::update_fn(pcrc::CrcSoftware)(0xFFFFFFFF, p, n);
+      });
+      if (pcrc::best_impl() >= pcrc::CrcSse42) {
+        bench("crc32c sse4.2 ", data, len, [](const unsigned char *p, size_t n) {
+          return pcrc::update_fn(pcrc::CrcSse42)(0xFFFFFFFF, p, n);
+        });
+      }
+      if (pcrc::best_impl() >= pcrc::CrcSse42Clmul) {
+        bench("crc32c pclmul ", data, len, [](const unsigned char *p, size_t n) {
+          return pcrc::update_fn(pcrc::CrcSse42Clmul)(0xFFFFFFFF, p, n);
+        });
+      }
+    }
+  }
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../pagecache/heap.h"
+#include "../pagecache/log.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/segment.h"
+#include "test_util.h"
+
+class CheapTest final {
+
+private:
+  static constexpr int thread_number = 4;
+  static constexpr size_t segment_size = 64 * 1024;
+
+  static std::vector<unsigned char> value(PageId pid, Lsn version, size_t len) {
+    std::vector<unsigned char> data(len);
+    for (size_t i = 0; i < len; ++i) {
+      data[i] = static_cast<unsigned char>(pid * 31 + version * 7 + i);
+    }
+    return data;
+  }
+
+  static uint64_t file_size(const std::string &path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+  }
+
+public:
+  // 并发写入和释放, 读回的数据一致, 被重用的槽位不能用旧的HeapId读到
+  static void slab_test() {
+    TestLogFile file("heap");
+    {
+      Heap heap(file.path());
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+        threads.emplace_back([&heap, thread_id]() {
+          std::mt19937_64 rnd(thread_id);
+          std::vector<std::pair<HeapId, std::vector<unsigned char>>> live;
+          for (Lsn i = 0; i < 500; ++i) {
+            Lsn lsn = thread_id * 1000000 + i;
+            auto data = value(thread_id, i, 1000 + rnd() % (200 * 1024));
+            live.emplace_back(heap.write(data.data(), data.size(), lsn), std::move(data));
+            if (live.size() > 8) {
+              size_t victim = rnd() % live.size();
+              if (heap.read(live[victim].first) != live[victim].second) {
+                throw std::runtime_error("heap item mismatch");
+              }
+              heap.free(live[victim].first);
+              live.erase(live.begin() + static_cast<long>(victim));
+            }
+          }
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+
+      auto data = value(0, 0, 100);
+      HeapId first = heap.write(data.data(), data.size(), 1);
+      heap.free(first);
+      HeapId second = heap.write(data.data(), data.size(), 2);
+      if (second.location != first.location) {
+        throw std::runtime_error("freed slot was not reused");
+      }
+      bool stale_rejected = false;
+      try {
+        heap.read(first);
+      } catch (const std::runtime_error &) {
+        stale_rejected = true;
+      }
+      if (!stale_rejected) {
+        throw std::runtime_error("read through a stale heap id");
+      }
+    }
+    // 2000个对象, 同时活着的最多 thread_number * 9 个, 每个最多256KB
+    uint64_t total = 0;
+    for (size_t id = 0; id < HEAP_SLAB_COUNT; ++id) {
+      total += file_size(file.path() + ".heap." + std::to_string(id));
+    }
+    if (total > 64 * 1024 * 1024) {
+      throw std::runtime_error("heap slots were not reused, heap is " + std::to_string(total) + " bytes");
+    }
+    std::cout << "Heap slabs ok, " << total / 1024 << " KB on disk" << std::endl;
+  }
+
+  // 释放的槽位打洞还给文件系统, 尾部的空闲槽位被截断, 重新分配时先用低offset的槽位
+  static void reclaim_test() {
+    TestLogFile file("reclaim");
+    const size_t len = 40000; // 64KB的槽位
+    const SlabId id = size_to_slab_id(len + HEAP_ITEM_HEADER_LEN);
+    const uint64_t slot = slab_id_to_size(id);
+    std::string slab_file = file.path() + ".heap." + std::to_string(id);
+    {
+      Heap heap(file.path());
+      auto data = value(1, 1, len);
+      std::vector<HeapId> ids;
+      for (Lsn i = 0; i < 64; ++i) {
+        ids.push_back(heap.write(data.data(), data.size(), i));
+      }
+      for (size_t i = 1; i < 48; i += 2) {
+        heap.free(ids[i]);
+      }
+      struct stat st;
+      ::stat(slab_file.c_str(), &st);
+      SlabStats stats = heap.stats().at(0);
+      if (stats.used != 40 || stats.slots != 64 || static_cast<uint64_t>(st.st_size) <= 63 * slot) {
+        throw std::runtime_error("unexpected slab occupancy");
+      }
+      if (static_cast<uint64_t>(st.st_blocks) * 512 > 44 * slot) {
+        throw std::runtime_error("freed slots still occupy disk space");
+      }
+
+      // 46之后全部空闲, 文件截断到47个槽位之前
+      for (size_t i = 48; i < 64; ++i) {
+        heap.free(ids[i]);
+      }
+      if (file_size(slab_file) != 47 * slot || heap.stats().at(0).slots != 47) {
+        throw std::runtime_error("trailing free slots were not truncated");
+      }
+      HeapId reused = heap.write(data.data(), data.size(), 100);
+      if (std::get<1>(reused.decompose()) != 1 || heap.read(reused) != data) {
+        throw std::runtime_error("lowest free slot was not reused first");
+      }
+    }
+    std::cout << "Heap reclaim ok." << std::endl;
+  }
+
+  // 大页面写进heap, 日志中只有HeapId; 替换稳定之后槽位才被释放; 恢复之后可以读回最新版本
+  static void blob_log_test() {
+    TestLogFile file("blob");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    const PageId pages = 32;
+    const size_t len = 100 * 1024; // 比segment还大
+    std::vector<Lsn> versions(pages, -1);
+    {
+      auto heap = std::make_shared<Heap>(file.path());
+      auto accountant = std::make_shared<SegmentAccountant>(segment_size, heap);
+      Log log(config, file.fd(), 0, 0, accountant);
+      std::vector<std::optional<DiskPtr>> current(pages);
+      std::vector<std::mutex> locks(pages);
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+          std::mt19937_64 rnd(thread_id);
+          for (auto i = 0; i < 200; ++i) {
+            PageId pid = rnd() % pages;
+            std::scoped_lock<std::mutex> lock(locks[pid]);
+            auto data = value(pid, versions[pid] + 1, len);
+            auto reservation = log.reserve_blob(MsgBlobNode, pid, *heap, data.data(), data.size());
+            std::vector<DiskPtr> old;
+            if (current[pid]) {
+              old.push_back(*current[pid]);
+            }
+            accountant->mark_replace(pid, reservation.lsn(), old, reservation.pointer());
+            current[pid] = reservation.pointer();
+            versions[pid] += 1;
+            reservation.complete();
+          }
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+      log.flush();
+    }
+
+    // 800次写入, 活着的只有32个
+    uint64_t heap_size = file_size(file.path() + ".heap." + std::to_string(size_to_slab_id(len + HEAP_ITEM_HEADER_LEN)));
+    if (heap_size > 4 * pages * slab_size(len + HEAP_ITEM_HEADER_LEN)) {
+      throw std::runtime_error("replaced blobs were not freed");
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    auto heap = std::make_shared<Heap>(file.path());
+    SegmentAccountant accountant(segment_size, heap);
+    accountant.initialize_from_snapshot(snapshot, file.size());
+    for (PageId pid = 0; pid < pages; ++pid) {
+      auto it = snapshot.pt.find(pid);
+      if (versions[pid] < 0) {
+        continue;
+      }
+      if (it == snapshot.pt.end() || !it->second.base_.disk_ptr.is_blob()) {
+        throw std::runtime_error("blob page was not recovered");
+      }
+      if (heap->read(it->second.base_.disk_ptr.heap_id) != value(pid, versions[pid], len)) {
+        throw std::runtime_error("recovered blob has stale contents");
+      }
+    }
+    // 重建之后新的写入不能覆盖活着的blob
+    auto data = value(0, 0, len);
+    HeapId fresh = heap->write(data.data(), data.size(), snapshot.next_lsn);
+    for (auto &entry : snapshot.pt) {
+      if (entry.second.base_.disk_ptr.heap_id.location == fresh.location) {
+        throw std::runtime_error("heap free list handed out a live slot");
+      }
+    }
+    uint64_t after = file_size(file.path() + ".heap." + std::to_string(size_to_slab_id(len + HEAP_ITEM_HEADER_LEN)));
+
+    std::cout << "Recovered " << pages << " blob pages, heap is " << after / 1024 << " KB" << std::endl;
+  }
+};
@@ -0,0 +1,166 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../pagecache/log.h"
+#include "test_util.h"
+
+class CioBufTest final {
+
+private:
+  static constexpr int thread_number = 16;
+  static constexpr int writes_per_thread = 4000;
+  static constexpr size_t segment_size = 64 * 1024;
+
+  // 顺序扫描所有segment, 校验每条消息的crc和内容
+  static size_t scan(int fd, LogOffset end) {
+    size_t messages = 0;
+    AlignedBuf seg(segment_size);
+    for (LogOffset base = 0; base < end; base += segment_size) {
+      size_t n = pread_exact(fd, seg.ptr, segment_size, base);
+      if (n < SEG_HEADER_LEN) {
+        break;
+      }
+      uint32_t stored = 0;
+      std::memcpy(&stored, seg.ptr, 4);
+      if (stored != crc32_buf(seg.ptr + 4, SEG_HEADER_LEN - 4)) {
+        throw std::runtime_error("bad segment header crc");
+      }
+      size_t at = SEG_HEADER_LEN;
+      while (at + MSG_HEADER_LEN <= n) {
+        auto header = MessageHeader::from_char(seg.ptr + at);
+        if (header.kind == MsgCorrupted && header.crc32 == 0) {
+          break;
+        }
+        if (at + MSG_HEADER_LEN + header.len > n) {
+          throw std::runtime_error("message crosses segment end");
+        }
+        if (header.crc32 != MessageHeader::compute_crc(seg.ptr + at, header.len)) {
+          throw std::runtime_error("bad message crc");
+        }
+        if (header.kind == MsgCap) {
+          break;
+        }
+        if (header.kind == MsgInlineLink) {
+          const unsigned char *payload = seg.ptr + at + MSG_HEADER_LEN;
+          for (uint32_t i = 0; i < header.len; ++i) {
+            if (payload[i] != static_cast<unsigned char>(header.pid)) {
+              throw std::runtime_error("bad message payload");
+            }
+          }
+          ++messages;
+        }
+        at += MSG_HEADER_LEN + header.len;
+      }
+    }
+    return messages;
+  }
+
+  static void concurrent_reserve_test(bool use_io_uring, bool direct) {
+    TestLogFile file("iobuf");
+    if (direct) {
+      file.reopen_direct();
+    }
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1; // 频繁地冻结未写满的IoBuf
+    config.use_io_uring = use_io_uring;
+    std::atomic<size_t> written{0};
+    {
+    Log log(config, file.fd());
+    std::vector<std::thread> threads;
+    for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+      threads.emplace_back([&log, &written, thread_id]() {
+        std::mt19937_64 rnd(thread_id);
+        unsigned char payload[512];
+        for (auto i = 0; i < writes_per_thread; ++i) {
+          PageId pid = rnd();
+          size_t len = rnd() % sizeof(payload);
+          std::memset(payload, static_cast<unsigned char>(pid), len);
+          if (rnd() % 8 == 0) {
+            // 预留后放弃
+            auto reservation = log.reserve(MsgInlineLink, pid, len);
+            reservation.abort();
+            continue;
+          }
+          log.write(MsgInlineLink, pid, payload, len);
+          written.fetch_add(1, std::memory_order_relaxed);
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+    // 析构时等待所有IoBuf写出
+    }
+
+    size_t found = scan(file.fd(), static_cast<LogOffset>(file.size()));
+
+    // 被放弃的消息被标记为MsgCanceled, 不计入
+    std::cout << "Found " << found << " messages." << std::endl;
+    if (found != written.load()) {
+      throw std::runtime_error("unexpected message count");
+    }
+  }
+
+public:
+  // 多个提交者同时等待落盘, 共享同一次fsync
+  static void group_commit_test() {
+    TestLogFile file("iobuf");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 0; // 只由提交者触发冻结
+    std::atomic<size_t> registered{0};
+    std::atomic<size_t> fired{0};
+    {
+    Log log(config, file.fd());
+    std::vector<std::thread> threads;
+    for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+      threads.emplace_back([&, thread_id]() {
+        std::mt19937_64 rnd(thread_id);
+        unsigned char payload[256];
+        for (auto i = 0; i < writes_per_thread / 10; ++i) {
+          size_t len = rnd() % sizeof(payload);
+          std::memset(payload, 0, len);
+          Lsn lsn = log.write(MsgInlineLink, thread_id, payload, len).first;
+          if (i % 4 == 0) {
+            log.make_stable(lsn);
+            if (log.stable_lsn() < lsn) {
+              throw std::runtime_error("make_stable returned before lsn is stable");
+            }
+          } else {
+            registered.fetch_add(1, std::memory_order_relaxed);
+            log.on_stable(lsn, [&fired] { fired.fetch_add(1, std::memory_order_relaxed); });
+          }
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+    Lsn stable = log.flush();
+    std::cout << "Stable lsn after flush: " << stable << std::endl;
+    }
+
+    if (fired.load() != registered.load()) {
+      throw std::runtime_error("stable callbacks lost");
+    }
+  }
+
+  static void concurrent_reserve_test() {
+    concurrent_reserve_test(true, false);
+    concurrent_reserve_test(false, false);
+    concurrent_reserve_test(true, true);
+    concurrent_reserve_test(false, true);
+  }
+};
@@ -0,0 +1,885 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../pagecache/eviction.h"
+#include "../pagecache/heap.h"
+#include "../pagecache/log.h"
+#include "../pagecache/pagecache.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/segment.h"
+#include "test_util.h"
+
+class CpageCacheTest final {
+
+private:
+  static constexpr int thread_number = 4;
+  static constexpr int links_per_thread = 5000;
+  static constexpr PageId pages = 16;
+  static constexpr size_t segment_size = 64 * 1024;
+
+  static tcs_t &tls() {
+    static thread_local tcs_t tid = DEFAULT_TCS_VAL;
+    return tid;
+  }
+
+  // 页面是一串uint64, delta是追加的一个uint64, 合并就是拼接
+  static PageBuf concat(const std::vector<PageBufPtr> &chain) {
+    PageBuf merged;
+    for (auto &buf : chain) {
+      merged.insert(merged.end(), buf->begin(), buf->end());
+    }
+    return merged;
+  }
+
+  static PageBuf encode(uint64_t v) {
+    PageBuf buf(sizeof(v));
+    std::memcpy(buf.data(), &v, sizeof(v));
+    return buf;
+  }
+
+  static std::vector<uint64_t> decode(const PageBuf &buf) {
+    std::vector<uint64_t> values(buf.size() / sizeof(uint64_t));
+    std::memcpy(values.data(), buf.data(), values.size() * sizeof(uint64_t));
+    return values;
+  }
+
+  // 实际占用的磁盘空间, 打过洞的部分不算
+  static uint64_t disk_usage(const std::string &path) {
+    struct stat st;
+    return ::stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_blocks) * 512 : 0;
+  }
+
+  // 一条JSON风格的记录, version 让每次覆盖写入的内容都不同
+  static PageBuf record(PageId pid, uint64_t version) {
+    std::string s = "{\"id\": " + std::to_string(pid) + ", \"version\": " + std::to_string(version) +
+                    ", \"name\": \"user_" + std::to_string(pid * 7919 % 1000) + "\", \"email\": \"user" +
+                    std::to_string(pid) + "@example.com\", \"tags\": [\"alpha\", \"beta\"], \"address\": " +
+                    "{\"city\": \"Hangzhou\", \"street\": \"Wensan Road " + std::to_string(version % 97) +
+                    "\", \"zip\": \"310000\"}, \"score\": " + std::to_string(version * 31 % 1000) + "}";
+    return PageBuf(s.begin(), s.end());
+  }
+
+  // 一种模式下的覆盖写入负载: 返回 {每秒写入的页面数, 稳定之后日志和heap占用的磁盘空间}
+  static std::pair<double, uint64_t> run_mode(Mode mode) {
+    const PageId count = 20000;
+    const int writers = 4;
+    const int writes_per_writer = 50000;
+    const int blob_every = 4000;
+    const size_t blob_len = 300 * 1024;
+
+    TestLogFile file("mode");
+    Inner config;
+    config.apply_mode(mode);
+    config.path = file.path();
+    double ops_per_sec = 0;
+    uint64_t usage = 0;
+    {
+      TestPageCache db(config, file, concat, TestParts::Heap);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      // cleaner线程每次重写时注册, 不需要在线程退出时注销
+      SegmentCleaner cleaner(config, db.accountant, [&cache](PageId pid) -> size_t {
+        cache.register_thread(tls());
+        size_t written = 0;
+        {
+          auto guard = cache.pin(tls());
+          written = cache.rewrite(guard, pid);
+        }
+        cache.unregister_thread(tls());
+        return written;
+      });
+
+      std::vector<PageId> pids;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < count; ++i) {
+          pids.push_back(cache.allocate(guard, record(i, 0)));
+        }
+      }
+      cache.unregister_thread(tls());
+      log.flush();
+
+      auto start = std::chrono::steady_clock::now();
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < writers; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+          cache.register_thread(tls());
+          std::mt19937_64 rnd(thread_id);
+          for (auto i = 1; i <= writes_per_writer; ++i) {
+            PageId pid = pids[rnd() % count];
+            PageBuf data = record(pid, i);
+            if (i % blob_every == 0) {
+              data.resize(blob_len);
+              for (size_t at = 0; at < blob_len; at += 8) {
+                uint64_t r = rnd();
+                std::memcpy(data.data() + at, &r, 8);
+              }
+            }
+            auto guard = cache.pin(tls());
+            while (true) {
+              Page *page = cache.get(guard, pid);
+              if (cache.replace(guard, pid, page, data) != nullptr) {
+                break;
+              }
+            }
+          }
+          cache.unregister_thread(tls());
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+      log.flush();
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      ops_per_sec = writers * writes_per_writer / seconds;
+
+      // 给cleaner同样的时间回收空间
+      std::this_thread::sleep_for(std::chrono::seconds(2));
+      log.flush();
+      usage = disk_usage(file.path());
+      for (SlabId id = 0; id < HEAP_SLAB_COUNT; ++id) {
+        usage += disk_usage(file.path() + ".heap." + std::to_string(id));
+      }
+    }
+    return {ops_per_sec, usage};
+  }
+
+public:
+  // 并发link, fragment链不超过阈值; 合并后的页面只有一块数据; 恢复之后读回同样的内容
+  static void consolidation_test() {
+    TestLogFile file("pagecache");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    std::vector<PageId> pids;
+    std::map<PageId, std::vector<uint64_t>> expected;
+    uint64_t consolidations = 0;
+    {
+      TestPageCache db(config, file, concat, TestParts::Heap);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < pages; ++i) {
+          // 第一个页面比一个segment还大, 基准页在heap中
+          size_t n = i == 0 ? segment_size / sizeof(uint64_t) + 1 : 1;
+          PageBuf base;
+          for (size_t k = 0; k < n; ++k) {
+            auto v = encode(~uint64_t(0) - k);
+            base.insert(base.end(), v.begin(), v.end());
+          }
+          pids.push_back(cache.allocate(guard, base));
+        }
+      }
+
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+        threads.emplace_back([&cache, &pids, thread_id]() {
+          cache.register_thread(tls());
+          std::mt19937_64 rnd(thread_id);
+          for (uint64_t i = 0; i < links_per_thread; ++i) {
+            PageId pid = pids[rnd() % pids.size()];
+            uint64_t value = (uint64_t(thread_id) << 32) | i;
+            while (true) {
+              auto guard = cache.pin(tls());
+              Page *page = cache.get(guard, pid);
+              if (page->frag_count() > PAGE_CONSOLIDATION_THRESHOLD) {
+                throw std::runtime_error("fragment chain exceeded the consolidation threshold");
+              }
+              if (cache.link(guard, pid, page, encode(value)) != nullptr) {
+                break;
+              }
+            }
+          }
+          cache.unregister_thread(tls());
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+
+      auto guard = cache.pin(tls());
+      size_t total = 0;
+      for (PageId pid : pids) {
+        Page *page = cache.get(guard, pid);
+        auto values = decode(*cache.materialize(*page));
+        // 每个线程写进同一个页面的值保持写入顺序
+        std::vector<uint64_t> last(thread_number, 0);
+        for (auto v : values) {
+          if (v >> 32 >= thread_number) {
+            continue; // 基准页的内容
+          }
+          auto &prev = last[v >> 32];
+          if ((v & 0xffffffff) + 1 <= prev) {
+            throw std::runtime_error("links applied out of order");
+          }
+          prev = (v & 0xffffffff) + 1;
+          ++total;
+        }
+        expected[pid] = std::move(values);
+      }
+      if (total != thread_number * links_per_thread) {
+        throw std::runtime_error("lost " + std::to_string(thread_number * links_per_thread - total) + " links");
+      }
+      consolidations = cache.consolidations();
+      // 每个页面每 PAGE_CONSOLIDATION_THRESHOLD + 1 次link合并一次
+      if (consolidations + pages < total / (PAGE_CONSOLIDATION_THRESHOLD + 1)) {
+        throw std::runtime_error("delta chains were not consolidated");
+      }
+      guard.leave();
+      cache.unregister_thread(tls());
+      log.flush();
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    {
+      TestPageCache db(config, file, snapshot, concat, TestParts::Heap);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (auto &entry : expected) {
+          Page *page = cache.get(guard, entry.first);
+          if (page == nullptr || page->frag_count() > PAGE_CONSOLIDATION_THRESHOLD) {
+            throw std::runtime_error("page was not recovered with a short chain");
+          }
+          if (decode(*cache.materialize(*page)) != entry.second) {
+            throw std::runtime_error("recovered page differs from the written one");
+          }
+        }
+      }
+      cache.unregister_thread(tls());
+    }
+
+    std::cout << "Page cache ok, " << consolidations << " consolidations" << std::endl;
+  }
+
+  // 恢复之后的长fragment链: 同一segment中相近的fragment合并成一个读区间, 读回的内容和crc都正确
+  static void vectored_read_test() {
+    TestLogFile file("vectored");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    const PageId count = 64;
+    const uint64_t links = PAGE_CONSOLIDATION_THRESHOLD;
+    std::map<PageId, std::vector<uint64_t>> expected;
+    {
+      TestPageCache db(config, file, concat);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        std::vector<PageId> pids;
+        for (PageId i = 0; i < count; ++i) {
+          pids.push_back(cache.allocate(guard, encode(i)));
+          expected[pids.back()].push_back(i);
+        }
+        // 交错地link, 同一个页面的fragment分散在日志中
+        for (uint64_t k = 0; k < links; ++k) {
+          for (PageId pid : pids) {
+            uint64_t value = pid * 1000 + k;
+            if (cache.link(guard, pid, cache.get(guard, pid), encode(value)) == nullptr) {
+              throw std::runtime_error("uncontended link failed");
+            }
+            expected[pid].push_back(value);
+          }
+        }
+      }
+      cache.unregister_thread(tls());
+      log.flush();
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    uint64_t ranges = 0;
+    {
+      TestPageCache db(config, file, snapshot, concat);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (auto &entry : expected) {
+          Page *page = cache.get(guard, entry.first);
+          if (page == nullptr || page->frag_count() != links) {
+            throw std::runtime_error("recovered page lost its fragments");
+          }
+          if (decode(*cache.materialize(*page)) != entry.second) {
+            throw std::runtime_error("vectored read returned wrong fragments");
+          }
+        }
+      }
+      ranges = cache.read_ranges();
+      cache.unregister_thread(tls());
+    }
+    // 每个页面的fragment最多跨两个segment
+    if (ranges > 2 * count) {
+      throw std::runtime_error("fragments were not coalesced, " + std::to_string(ranges) + " reads");
+    }
+
+    std::cout << "Read " << count * (links + 1) << " fragments in " << ranges << " ranges" << std::endl;
+  }
+
+  // JSON风格的小页面压缩之后日志明显变小, 重启之后用持久化的字典读回; 随机数据原样写入
+  static void compression_test() {
+    const PageId count = 4000;
+    auto json = [](PageId i) {
+      std::string s = "{\"id\": " + std::to_string(i) + ", \"name\": \"user_" + std::to_string(i * 7919 % 1000) +
+                      "\", \"email\": \"user" + std::to_string(i) + "@example.com\", \"active\": " +
+                      (i % 3 ? "true" : "false") + ", \"tags\": [\"alpha\", \"beta\", \"gamma\"], " +
+                      "\"address\": {\"city\": \"Hangzhou\", \"street\": \"Wensan Road " + std::to_string(i % 97) +
+                      "\", \"zip\": \"310000\"}, \"score\": " + std::to_string(i * 31 % 1000) + "}";
+      return PageBuf(s.begin(), s.end());
+    };
+    auto noise = [](PageId i) {
+      std::mt19937_64 rnd(i);
+      PageBuf buf(512);
+      for (auto &b : buf) {
+        b = static_cast<unsigned char>(rnd());
+      }
+      return buf;
+    };
+
+    Lsn log_bytes[2] = {0, 0};
+    uint8_t dict_id = 0;
+    for (int compressed = 0; compressed < 2; ++compressed) {
+      TestLogFile file("compress");
+      Inner config;
+      config.path = file.path();
+      config.segment_size = segment_size;
+      config.flush_every_ms = 1;
+      config.use_compression = compressed == 1;
+      std::vector<PageId> pids;
+      {
+        TestPageCache db(config, file, concat);
+        auto &log = db.log;
+        auto &cache = db.cache;
+        cache.register_thread(tls());
+        {
+          auto guard = cache.pin(tls());
+          for (PageId i = 0; i < count; ++i) {
+            pids.push_back(cache.allocate(guard, i % 10 == 0 ? noise(i) : json(i)));
+          }
+        }
+        cache.unregister_thread(tls());
+        log_bytes[compressed] = log.flush();
+      }
+
+      // 重启之后从磁盘读回, 字典从文件中加载
+      Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+      {
+        TestPageCache db(config, file, snapshot, concat);
+        auto &cache = db.cache;
+        cache.register_thread(tls());
+        {
+          auto guard = cache.pin(tls());
+          for (PageId i = 0; i < count; ++i) {
+            Page *page = cache.get(guard, pids[i]);
+            if (*cache.materialize(*page) != (i % 10 == 0 ? noise(i) : json(i))) {
+              throw std::runtime_error("compressed page was read back wrong");
+            }
+          }
+        }
+        cache.unregister_thread(tls());
+      }
+      if (compressed) {
+        PageCompressor reloaded(config.compression_factor, config.path + ".dict");
+        dict_id = reloaded.dict_id();
+      }
+    }
+    if (dict_id == 0) {
+      throw std::runtime_error("no dictionary was trained");
+    }
+    if (log_bytes[1] * 2 > log_bytes[0]) {
+      throw std::runtime_error("compression saved too little: " + std::to_string(log_bytes[1]) + " of " +
+                               std::to_string(log_bytes[0]) + " bytes");
+    }
+    std::cout << "Compressed log " << log_bytes[0] / 1024 << " KB -> " << log_bytes[1] / 1024 << " KB" << std::endl;
+  }
+
+  // 同一个覆盖写入负载分别在两种模式下运行: LowSpace占用的磁盘更少, HighThroughput写得更快
+  static void mode_benchmark() {
+    auto low_space = run_mode(LowSpace);
+    auto high_throughput = run_mode(HighThroughput);
+    std::cout << "LowSpace       " << static_cast<uint64_t>(low_space.first) << " writes/s, "
+              << low_space.second / (1024 * 1024) << " MB on disk" << std::endl;
+    std::cout << "HighThroughput " << static_cast<uint64_t>(high_throughput.first) << " writes/s, "
+              << high_throughput.second / (1024 * 1024) << " MB on disk" << std::endl;
+  }
+
+  // 内存映射读: 缓存很小, 读者拿到的大多是指向映射的视图; 写入不断覆盖页面让segment被释放和重用,
+  // 视图在guard内必须保持不变
+  static void mmap_test() {
+    TestLogFile file("mmap");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    config.cache_capacity = 256 * 1024;
+    config.use_mmap_reads = true;
+    const PageId count = 2000;
+    const int writers = 2;
+    const int readers = 2;
+    const int writes_per_writer = 20000;
+
+    // [pid 8][version 8][填充], 填充的每个字节都是 (pid + version) 的低8位
+    auto make = [](PageId pid, uint64_t version) {
+      PageBuf buf(16 + 200 + (pid * 131 + version * 17) % 800);
+      std::memcpy(buf.data(), &pid, 8);
+      std::memcpy(buf.data() + 8, &version, 8);
+      std::memset(buf.data() + 16, static_cast<int>((pid + version) & 0xFF), buf.size() - 16);
+      return buf;
+    };
+    auto check = [](PageId pid, const Slice &frag) {
+      PageId got;
+      uint64_t version;
+      if (frag.size() < 16) {
+        return false;
+      }
+      std::memcpy(&got, frag.data(), 8);
+      std::memcpy(&version, frag.data() + 8, 8);
+      auto fill = static_cast<char>((pid + version) & 0xFF);
+      return got == pid && std::all_of(frag.begin() + 16, frag.end(), [fill](char c) { return c == fill; });
+    };
+
+    uint64_t mapped = 0;
+    size_t segments = 0;
+    {
+      TestPageCache db(config, file, concat);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      std::vector<PageId> pids;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < count; ++i) {
+          pids.push_back(cache.allocate(guard, make(i, 0)));
+        }
+      }
+      cache.unregister_thread(tls());
+      log.flush();
+
+      std::atomic<int> running(writers);
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < writers; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+          cache.register_thread(tls());
+          std::mt19937_64 rnd(thread_id);
+          for (auto i = 1; i <= writes_per_writer; ++i) {
+            PageId i_page = rnd() % count;
+            auto guard = cache.pin(tls());
+            while (cache.replace(guard, pids[i_page], cache.get(guard, pids[i_page]), make(i_page, i)) == nullptr) {
+            }
+            if (i % 500 == 0) {
+              log.flush();
+            }
+          }
+          cache.unregister_thread(tls());
+          running.fetch_sub(1);
+        });
+      }
+      for (auto thread_id = 0; thread_id < readers; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+          cache.register_thread(tls());
+          std::mt19937_64 rnd(100 + thread_id);
+          std::vector<Slice> frags;
+          while (running.load() > 0) {
+            PageId i_page = rnd() % count;
+            auto guard = cache.pin(tls());
+            if (!cache.view(guard, pids[i_page], frags) || frags.size() != 1 || !check(i_page, frags[0])) {
+              throw std::runtime_error("view of page " + std::to_string(i_page) + " was wrong");
+            }
+            // 持有guard期间segment不会被重用, 视图不会变
+            std::this_thread::yield();
+            if (!check(i_page, frags[0])) {
+              throw std::runtime_error("mapped view changed under the guard");
+            }
+          }
+          cache.unregister_thread(tls());
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+      mapped = cache.mapped_reads();
+      segments = db.accountant->segment_count();
+    }
+    if (mapped == 0) {
+      throw std::runtime_error("no fragment was read through the mapping");
+    }
+    // 不重用的话日志会增长到约 20MB
+    if (segments * segment_size > 8 * 1024 * 1024) {
+      throw std::runtime_error("segments were not reused, log has " + std::to_string(segments) + " segments");
+    }
+    std::cout << "Mapped " << mapped << " fragments, log is " << segments << " segments" << std::endl;
+  }
+
+  // 批次中的写入一起恢复; 撕裂批次中的一条消息, 整个批次被丢弃而之前的写入都保留;
+  // 批次之后的普通写入在批次提交之前不会稳定
+  static void batch_test() {
+    TestLogFile file("batch");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    config.log_lanes = 2;
+    const PageId count = 64;
+
+    // 恢复之后每个页面的内容
+    auto read_back = [&](const Snapshot &snapshot, const std::vector<PageId> &pids) {
+      std::vector<std::vector<uint64_t>> values;
+      TestPageCache db(config, file, snapshot, concat);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId pid : pids) {
+          Page *page = cache.get(guard, pid);
+          values.push_back(page ? decode(*cache.materialize(*page)) : std::vector<uint64_t>());
+        }
+      }
+      cache.unregister_thread(tls());
+      return values;
+    };
+
+    std::vector<PageId> pids;
+    PageId outsider;
+    Lsn manifest;
+    Lsn first_member = -1;
+    {
+      // 不重用segment, 下面才能用清零头部的方式模拟没有写到磁盘的segment
+      TestPageCache db(config, file, concat, TestParts::Log);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < count; ++i) {
+          pids.push_back(cache.allocate(guard, encode(0)));
+        }
+        outsider = cache.allocate(guard, encode(0));
+        log.flush();
+
+        for (uint64_t round = 1; round <= 2; ++round) {
+          Batch batch(log);
+          manifest = batch.lsn();
+          for (PageId pid : pids) {
+            Page *page = cache.link(guard, pid, cache.get(guard, pid), encode(round), &batch);
+            if (page == nullptr) {
+              throw std::runtime_error("link failed without contention");
+            }
+            if (round == 2 && first_member < 0) {
+              first_member = page->cache_info.back().lsn;
+            }
+          }
+          if (round == 1) {
+            log.make_stable(batch.commit());
+            continue;
+          }
+
+          // 清单之后的普通写入要等批次提交才能稳定
+          std::atomic<bool> stable(false);
+          std::thread writer([&]() {
+            cache.register_thread(tls());
+            Lsn lsn;
+            {
+              auto writer_guard = cache.pin(tls());
+              Page *page = cache.link(writer_guard, outsider, cache.get(writer_guard, outsider), encode(9));
+              lsn = page->cache_info.back().lsn;
+            }
+            cache.unregister_thread(tls());
+            log.make_stable(lsn);
+            stable.store(true);
+          });
+          std::this_thread::sleep_for(std::chrono::milliseconds(50));
+          if (stable.load()) {
+            throw std::runtime_error("a write after an open batch became stable before the batch");
+          }
+          if (log.stable_lsn() >= manifest) {
+            throw std::runtime_error("stable lsn passed an open batch");
+          }
+          log.make_stable(batch.commit());
+          writer.join();
+        }
+      }
+      cache.unregister_thread(tls());
+      log.flush();
+    }
+
+    // 完整的批次: 每个页面都有两个批次各自的fragment
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    for (PageId pid : pids) {
+      if (snapshot.pt.at(pid).frags_.size() != 2) {
+        throw std::runtime_error("complete batch was not recovered for page " + std::to_string(pid));
+      }
+    }
+    if (snapshot.pt.at(outsider).frags_.size() != 1) {
+      throw std::runtime_error("write after the batch was lost");
+    }
+
+    // 模拟批次写到一半时崩溃: 撕裂第二个批次的第一条消息, 之后分配的segment都没有写到磁盘.
+    // 整个批次和它之后的写入都不能恢复, 之前的写入都保留
+    auto seg = std::prev(snapshot.segments.upper_bound(first_member));
+    unsigned char garbage = 0xFF;
+    pwrite_all(file.fd(), &garbage, 1, seg->second + static_cast<LogOffset>(first_member - seg->first) + MSG_HEADER_LEN);
+    unsigned char zeros[SEG_HEADER_LEN] = {0};
+    for (auto it = std::next(seg); it != snapshot.segments.end(); ++it) {
+      pwrite_all(file.fd(), zeros, sizeof(zeros), it->second);
+    }
+    snapshot = Recovery::recover(config, file.fd(), 4);
+    if (snapshot.stable_lsn != manifest - 1) {
+      throw std::runtime_error("log was not truncated at the torn batch");
+    }
+    std::vector<PageId> all(pids);
+    all.push_back(outsider);
+    auto values = read_back(snapshot, all);
+    for (PageId i = 0; i < count; ++i) {
+      if (values[i] != std::vector<uint64_t> {0, 1}) {
+        throw std::runtime_error("torn batch was partially recovered for page " + std::to_string(i));
+      }
+    }
+    if (values[count] != std::vector<uint64_t> {0}) {
+      throw std::runtime_error("write after the torn batch was recovered");
+    }
+
+    // 截断是持久的: 之后的写入和再次恢复都从清单之前继续. read_back 也写过日志, 先重新恢复
+    snapshot = Recovery::recover(config, file.fd(), 4);
+    {
+      TestPageCache db(config, file, snapshot, concat);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        {
+          // 没有提交就析构的批次被放弃: 已经写入的消息照常恢复, 也不会截断之后的写入
+          Batch batch(log);
+          cache.link(guard, pids[0], cache.get(guard, pids[0]), encode(4), &batch);
+        }
+        cache.link(guard, outsider, cache.get(guard, outsider), encode(3));
+      }
+      cache.unregister_thread(tls());
+      log.flush();
+    }
+    snapshot = Recovery::recover(config, file.fd(), 4);
+    values = read_back(snapshot, all);
+    if (values[0] != std::vector<uint64_t> {0, 1, 4} || values[count] != std::vector<uint64_t> {0, 3}) {
+      throw std::runtime_error("log after the truncated batch was recovered wrong");
+    }
+    std::cout << "Batches ok." << std::endl;
+  }
+
+  // 多个线程并发取id: 每个线程拿到的严格递增, 全局没有重复; 重启之后发出的id大于之前所有的id
+  static void idgen_test() {
+    TestLogFile file("idgen");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    config.idgen_persist_interval = 10000;
+    const int ids_per_thread = 200000;
+
+    auto run = [&](PageCache &cache) {
+      std::vector<std::vector<uint64_t>> ids(thread_number);
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+        threads.emplace_back([&, thread_id]() {
+          cache.register_thread(tls());
+          auto &mine = ids[thread_id];
+          mine.reserve(ids_per_thread);
+          for (auto i = 0; i < ids_per_thread; ++i) {
+            auto guard = cache.pin(tls());
+            mine.push_back(cache.generate_id(guard));
+          }
+          cache.unregister_thread(tls());
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+      std::vector<uint64_t> all;
+      for (auto &mine : ids) {
+        if (!std::is_sorted(mine.begin(), mine.end()) || std::adjacent_find(mine.begin(), mine.end()) != mine.end()) {
+          throw std::runtime_error("ids of one thread are not strictly increasing");
+        }
+        all.insert(all.end(), mine.begin(), mine.end());
+      }
+      std::sort(all.begin(), all.end());
+      if (std::adjacent_find(all.begin(), all.end()) != all.end()) {
+        throw std::runtime_error("the same id was generated twice");
+      }
+      return all;
+    };
+
+    uint64_t last = 0;
+    {
+      TestPageCache db(config, file, concat);
+      auto start = std::chrono::steady_clock::now();
+      auto all = run(db.cache);
+      std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+      last = all.back();
+      std::cout << "Generated " << all.size() << " ids at " << all.size() / elapsed.count() << " ids/s" << std::endl;
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    {
+      TestPageCache db(config, file, snapshot, concat);
+      auto all = run(db.cache);
+      if (all.front() <= last) {
+        throw std::runtime_error("id " + std::to_string(all.front()) + " was generated again after recovery");
+      }
+    }
+    std::cout << "Ids ok, last id before recovery " << last << std::endl;
+  }
+
+  // free 的pid马上被allocate重用; free_later 的页面在PageCache析构时写出MsgFree, 恢复之后仍然是空闲的,
+  // 这时它的pid才被重用; cleaner重写墓碑之后它仍然是空闲的
+  static void free_test() {
+    TestLogFile file("free");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+
+    PageId first, second, kept;
+    {
+      TestPageCache db(config, file, concat);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        first = cache.allocate(guard, encode(1));
+        second = cache.allocate(guard, encode(2));
+        kept = cache.allocate(guard, encode(3));
+        if (!cache.free(guard, first, cache.get(guard, first)) || cache.get(guard, first) != nullptr) {
+          throw std::runtime_error("freed page is still visible");
+        }
+        if (cache.allocate(guard, encode(4)) != first) {
+          throw std::runtime_error("freed page id was not reused");
+        }
+        cache.free_later(guard, second);
+        if (cache.get(guard, second) == nullptr) {
+          throw std::runtime_error("free_later released the page under a guard");
+        }
+      }
+      cache.unregister_thread(tls());
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    {
+      TestPageCache db(config, file, snapshot, concat);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        if (cache.get(guard, second) != nullptr || cache.rewrite(guard, second) != MSG_HEADER_LEN ||
+            cache.get(guard, second) != nullptr) {
+          throw std::runtime_error("page freed before the restart came back");
+        }
+        if (decode(*cache.materialize(*cache.get(guard, first))) != std::vector<uint64_t> {4} ||
+            decode(*cache.materialize(*cache.get(guard, kept))) != std::vector<uint64_t> {3}) {
+          throw std::runtime_error("live pages changed after recovery");
+        }
+        if (cache.allocate(guard, encode(5)) != second) {
+          throw std::runtime_error("page id freed before the restart was not reused");
+        }
+      }
+      cache.unregister_thread(tls());
+    }
+    std::cout << "Free ok, page ids " << first << " and " << second << " were reused" << std::endl;
+  }
+
+  // 热点页面被访问过之后, 一次比缓存大得多的扫描不能把它们冲掉
+  static void scan_test() {
+    const size_t page_size = 1024;
+    const size_t capacity = 4 * 1024 * 1024;
+    const PageId hot = 1000;
+    PageEvictor evictor(capacity);
+    for (PageId pid = 0; pid < hot; ++pid) {
+      evictor.insert(pid, page_size);
+    }
+    for (int round = 0; round < 2; ++round) {
+      for (PageId pid = 0; pid < hot; ++pid) {
+        evictor.accessed(pid);
+      }
+    }
+    size_t evicted = 0;
+    for (PageId pid = hot; pid < hot + 40 * capacity / page_size; ++pid) {
+      evictor.insert(pid, page_size);
+      evicted += evictor.evict(pid).size();
+    }
+    size_t survived = 0;
+    for (PageId pid = 0; pid < hot; ++pid) {
+      survived += evictor.contains(pid) ? 1 : 0;
+    }
+    if (survived < hot * 95 / 100) {
+      throw std::runtime_error("scan flushed the hot set, " + std::to_string(survived) + " pages survived");
+    }
+    if (evictor.size_in_bytes() > capacity) {
+      throw std::runtime_error("evictor exceeded its capacity");
+    }
+    std::cout << "Scan evicted " << evicted << " pages, " << survived << " of " << hot << " hot pages survived" << std::endl;
+  }
+
+  // 写入的页面远多于cache_capacity, 内存中的数据保持在容量附近, 被淘汰的页面从磁盘读回
+  static void eviction_test() {
+    TestLogFile file("eviction");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    config.cache_capacity = 1024 * 1024;
+    const PageId count = 8000;
+    const size_t flush_every = 100;
+    const size_t len = 1000;
+    size_t peak = 0;
+    {
+      TestPageCache db(config, file, concat);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      std::vector<PageId> pids;
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < count; ++i) {
+          pids.push_back(cache.allocate(guard, PageBuf(len, static_cast<unsigned char>(i))));
+          if (i % flush_every == 0) {
+            log.flush();
+          }
+          peak = std::max(peak, cache.resident_bytes());
+        }
+      }
+      log.flush();
+      // 没有落盘的页面暂时留在内存中, 最多是两次flush之间写入的量
+      if (peak > config.cache_capacity + flush_every * (len + 256)) {
+        throw std::runtime_error("resident pages grew to " + std::to_string(peak) + " bytes");
+      }
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < count; ++i) {
+          Page *page = cache.get(guard, pids[i]);
+          if (*cache.materialize(*page) != PageBuf(len, static_cast<unsigned char>(i))) {
+            throw std::runtime_error("evicted page was read back wrong");
+          }
+        }
+      }
+      if (cache.resident_bytes() > config.cache_capacity) {
+        throw std::runtime_error("page-ins exceeded the cache capacity");
+      }
+      cache.unregister_thread(tls());
+    }
+    std::cout << "Eviction ok, peak resident " << peak / 1024 << " KB" << std::endl;
+  }
+};
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "../pagecache/pagetable.h"
+
+class CpageTableTest final {
+
+private:
+  static constexpr int thread_number = 8;
+  static constexpr int ops_per_thread = 200000;
+  static constexpr PageId pages_per_thread = 512;
+
+  struct PageStub {
+    PageId pid;
+    uint64_t version;
+  };
+
+  using Table = PageTable<PageStub, 64>;
+
+  static tcs_t &tls() {
+    static thread_local tcs_t tid = DEFAULT_TCS_VAL;
+    return tid;
+  }
+
+  // 线程交错地使用同一批leaf, 覆盖整个37位的范围
+  static PageId pid_of(int thread_id, PageId i) {
+    PageId spread = (i % 8) << 33;
+    return spread | ((i / 8) * thread_number + static_cast<PageId>(thread_id));
+  }
+
+public:
+  // 并发的读写和leaf回收, 每个线程只修改自己的页面, 读到的必须是自己最后写入的版本
+  static void concurrent_test() {
+    Table table;
+    std::atomic<bool> stop(false);
+    std::atomic<size_t> reclaimed(0);
+    std::vector<std::thread> threads;
+    for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+      threads.emplace_back([&table, thread_id]() {
+        table.register_thread(tls());
+        std::mt19937_64 rnd(thread_id);
+        std::vector<PageStub *> mine(pages_per_thread, nullptr);
+        std::vector<PageStub *> garbage;
+        for (auto op = 0; op < ops_per_thread; ++op) {
+          PageId i = rnd() % pages_per_thread;
+          PageId pid = pid_of(thread_id, i);
+          auto guard = table.pin(tls());
+          if (table.get(pid) != mine[i]) {
+            throw std::runtime_error("page table lost an update");
+          }
+          if (mine[i] != nullptr && rnd() % 3 == 0) {
+            PageStub *expected = mine[i];
+            if (!table.cas(pid, expected, nullptr)) {
+              throw std::runtime_error("cas failed on an owned page");
+            }
+            garbage.push_back(mine[i]);
+            mine[i] = nullptr;
+          } else {
+            auto *page = new PageStub {pid, mine[i] == nullptr ? 0 : mine[i]->version + 1};
+            PageStub *old = table.swap(pid, page);
+            if (old != mine[i]) {
+              throw std::runtime_error("swap returned a foreign value");
+            }
+            if (old != nullptr) {
+              garbage.push_back(old);
+            }
+            mine[i] = page;
+          }
+        }
+        {
+          auto guard = table.pin(tls());
+          for (PageId i = 0; i < pages_per_thread; ++i) {
+            PageStub *expected = mine[i];
+            if (mine[i] != nullptr && !table.cas(pid_of(thread_id, i), expected, nullptr)) {
+              throw std::runtime_error("final cas failed");
+            }
+            delete mine[i];
+          }
+        }
+        for (auto page : garbage) {
+          delete page;
+        }
+        table.unregister_thread(tls());
+      });
+    }
+    std::thread reclaimer([&]() {
+      while (!stop.load()) {
+        reclaimed += table.reclaim_empty_leaves();
+        std::this_thread::yield();
+      }
+    });
+    for (auto &t : threads)
+      t.join();
+    stop = true;
+    reclaimer.join();
+
+    // 所有页面都已经删除, 剩下的leaf全部可以回收
+    table.reclaim_empty_leaves();
+    if (table.leaf_count() != 0 || table.drain() != 0) {
+      throw std::runtime_error("empty leaves were not reclaimed");
+    }
+    bool rejected = false;
+    try {
+      table.get(PageId(1) << MAX_PID_BITS);
+    } catch (const std::out_of_range &) {
+      rejected = true;
+    }
+    if (!rejected) {
+      throw std::runtime_error("page id beyond MAX_PID_BITS was accepted");
+    }
+    std::cout << "Page table ok, reclaimed " << reclaimed.load() << " leaves while running." << std::endl;
+  }
+};
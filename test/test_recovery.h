@@ -0,0 +1,235 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../pagecache/log.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/snapshot_file.h"
+#include "test_util.h"
+
+class CrecoveryTest final {
+
+private:
+  static constexpr int thread_number = 8;
+  static constexpr int writes_per_thread = 4000;
+  static constexpr int pages_per_thread = 64;
+  static constexpr size_t segment_size = 64 * 1024;
+
+  struct Expected {
+    PageStateType type;
+    size_t frags;
+  };
+
+  // 每个线程只写自己的页面, 同一个页面的消息lsn递增
+  static std::unordered_map<PageId, Expected> write_pages(Log &log) {
+    std::vector<std::unordered_map<PageId, Expected>> expected(thread_number);
+    std::vector<std::thread> threads;
+    for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+      threads.emplace_back([&log, &expected, thread_id]() {
+        std::mt19937_64 rnd(thread_id);
+        unsigned char payload[128] = {0};
+        auto &pages = expected[thread_id];
+        for (auto i = 0; i < writes_per_thread; ++i) {
+          PageId pid = thread_id * pages_per_thread + rnd() % pages_per_thread;
+          size_t len = rnd() % sizeof(payload);
+          auto it = pages.find(pid);
+          if (it == pages.end() || it->second.type == Free || rnd() % 20 == 0) {
+            log.write(MsgInlineNode, pid, payload, len);
+            pages[pid] = Expected {Present, 0};
+          } else if (rnd() % 50 == 0) {
+            log.write(MsgFree, pid, payload, 0);
+            it->second = Expected {Free, 0};
+          } else {
+            log.write(MsgInlineLink, pid, payload, len);
+            ++it->second.frags;
+          }
+        }
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+    std::unordered_map<PageId, Expected> all;
+    for (auto &pages : expected) {
+      all.insert(pages.begin(), pages.end());
+    }
+    return all;
+  }
+
+  static void check(const Snapshot &snapshot, const std::unordered_map<PageId, Expected> &expected) {
+    if (snapshot.pt.size() != expected.size()) {
+      throw std::runtime_error("unexpected page count");
+    }
+    for (auto &entry : expected) {
+      auto it = snapshot.pt.find(entry.first);
+      if (it == snapshot.pt.end() || it->second.type_ != entry.second.type ||
+          it->second.frags_.size() != entry.second.frags) {
+        throw std::runtime_error("page state mismatch for page " + std::to_string(entry.first));
+      }
+      Lsn last = it->second.base_.lsn;
+      for (auto &frag : it->second.frags_) {
+        if (frag.lsn <= last) {
+          throw std::runtime_error("fragments out of lsn order");
+        }
+        last = frag.lsn;
+      }
+    }
+  }
+
+public:
+  static void parallel_recover_test() {
+    TestLogFile file("recovery");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    std::unordered_map<PageId, Expected> expected;
+    {
+      Log log(config, file.fd());
+      expected = write_pages(log);
+    }
+
+    // 单线程和多线程恢复的结果必须一致
+    Snapshot serial = Recovery::recover(config, file.fd(), 1);
+    check(serial, expected);
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    check(snapshot, expected);
+    if (snapshot.stable_lsn != serial.stable_lsn || snapshot.segments != serial.segments) {
+      throw std::runtime_error("parallel recovery differs from serial recovery");
+    }
+
+    // 从恢复的位置继续写
+    {
+      Log log(config, file.fd(), snapshot.next_offset, snapshot.next_lsn);
+      unsigned char payload[16] = {0};
+      log.write(MsgInlineNode, 0, payload, sizeof(payload));
+      log.flush();
+    }
+    expected[0] = Expected {Present, 0};
+    snapshot = Recovery::recover(config, file.fd(), 4);
+    check(snapshot, expected);
+    if (snapshot.stable_lsn <= serial.stable_lsn) {
+      throw std::runtime_error("stable lsn did not advance");
+    }
+
+    // 撕裂最后一个segment中的第一条消息, 这个segment只剩头部
+    auto last = *snapshot.segments.rbegin();
+    unsigned char garbage = 0xFF;
+    pwrite_all(file.fd(), &garbage, 1, last.second + SEG_HEADER_LEN + MSG_HEADER_LEN);
+    snapshot = Recovery::recover(config, file.fd(), 4);
+    if (snapshot.stable_lsn != last.first + static_cast<Lsn>(SEG_HEADER_LEN) - 1) {
+      throw std::runtime_error("torn tail was not truncated");
+    }
+
+    std::cout << "Recovered " << expected.size() << " pages." << std::endl;
+  }
+
+  // 运行时增量生成快照, 重启时只重放快照之后的日志
+  static void snapshot_test() {
+    TestLogFile file("snapshot");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    config.snapshot_after_ops = 5000;
+    std::unordered_map<PageId, Expected> expected;
+    Lsn snapshot_lsn;
+    {
+      Log log(config, file.fd());
+      log.enable_snapshots(Snapshot(), file.snapshot_path());
+      expected = write_pages(log);
+      log.flush();
+      snapshot_lsn = log.snapshot();
+    }
+
+    auto view = SnapshotView::open(file.snapshot_path());
+    if (!view || view->header().stable_lsn != snapshot_lsn || view->header().page_count != expected.size() ||
+        view->find(0) == nullptr) {
+      throw std::runtime_error("bad snapshot file");
+    }
+    view.reset();
+    check(recover_with_snapshot(config, file.fd(), file.snapshot_path(), 4), expected);
+
+    // 快照之后的写入只能从日志中恢复
+    Snapshot full = Recovery::recover(config, file.fd(), 4);
+    {
+      Log log(config, file.fd(), full.next_offset, full.next_lsn);
+      unsigned char payload[16] = {0};
+      log.write(MsgInlineNode, 0, payload, sizeof(payload));
+      log.write(MsgInlineLink, 0, payload, sizeof(payload));
+      log.flush();
+    }
+    expected[0] = Expected {Present, 1};
+    Snapshot snapshot = recover_with_snapshot(config, file.fd(), file.snapshot_path(), 4);
+    check(snapshot, expected);
+    check(Recovery::recover(config, file.fd(), 4), expected);
+
+    std::cout << "Recovered " << expected.size() << " pages from snapshot at lsn " << snapshot_lsn << std::endl;
+  }
+
+  // 多个lane并发追加, 恢复时按lsn合并; 空闲的lane不会挡住其他lane落盘
+  static void lanes_test() {
+    TestLogFile file("lanes");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 0; // 只由落盘请求封口其他lane
+    config.log_lanes = 4;
+    std::unordered_map<PageId, Expected> expected;
+    Lsn snapshot_lsn;
+    {
+      Log log(config, file.fd());
+      log.enable_snapshots(Snapshot(), file.snapshot_path());
+      expected = write_pages(log);
+      snapshot_lsn = log.snapshot();
+
+      // 只写lane 1, 其他lane的segment区间在它之前
+      unsigned char payload[16] = {0};
+      log.write(MsgInlineNode, 1, payload, sizeof(payload));
+      for (int i = 0; i < 100; ++i) {
+        Lsn lsn = log.write(MsgInlineLink, 1, payload, sizeof(payload)).first;
+        log.make_stable(lsn);
+        if (log.stable_lsn() < lsn) {
+          throw std::runtime_error("make_stable returned before lsn is stable");
+        }
+      }
+      expected[1] = Expected {Present, 100};
+    }
+
+    Snapshot serial = Recovery::recover(config, file.fd(), 1);
+    check(serial, expected);
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    check(snapshot, expected);
+    if (snapshot.stable_lsn != serial.stable_lsn || snapshot.segments != serial.segments) {
+      throw std::runtime_error("parallel recovery differs from serial recovery");
+    }
+    check(recover_with_snapshot(config, file.fd(), file.snapshot_path(), 4), expected);
+
+    // 从恢复的位置继续多lane写入
+    {
+      Log log(config, file.fd(), snapshot.next_offset, snapshot.next_lsn);
+      unsigned char payload[16] = {0};
+      for (PageId pid = 0; pid < 8; ++pid) {
+        log.write(MsgInlineNode, pid, payload, sizeof(payload));
+      }
+      log.flush();
+    }
+    for (PageId pid = 0; pid < 8; ++pid) {
+      expected[pid] = Expected {Present, 0};
+    }
+    check(Recovery::recover(config, file.fd(), 4), expected);
+
+    std::cout << "Recovered " << expected.size() << " pages from " << config.log_lanes << " lanes, snapshot at lsn "
+              << snapshot_lsn << std::endl;
+  }
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "../pagecache/log.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/segment.h"
+#include "test_util.h"
+
+class CsegmentTest final {
+
+private:
+  static constexpr int thread_number = 4;
+  static constexpr int writes_per_thread = 20000;
+  static constexpr PageId cold_pages = 64;
+  static constexpr PageId hot_pages = 192;
+  static constexpr size_t segment_size = 64 * 1024;
+
+  // 模拟page table: 每个页面只有一个整页的版本
+  struct Pages {
+    Log &log;
+    SegmentAccountant &accountant;
+    std::vector<std::mutex> locks;
+    std::vector<std::optional<DiskPtr>> current;
+    std::vector<Lsn> lsns;
+
+    Pages(Log &l, SegmentAccountant &a, size_t n) : log(l), accountant(a), locks(n), current(n), lsns(n, -1) {}
+
+    // mark_replace 必须在complete之前
+    size_t write(PageId pid, size_t len) {
+      std::scoped_lock<std::mutex> lock(locks[pid]);
+      auto reservation = log.reserve(MsgInlineNode, pid, len);
+      std::memset(reservation.payload().data(), static_cast<int>(pid), len);
+      std::vector<DiskPtr> old;
+      if (current[pid]) {
+        old.push_back(*current[pid]);
+      }
+      accountant.mark_replace(pid, reservation.lsn(), old, reservation.pointer());
+      current[pid] = reservation.pointer();
+      lsns[pid] = reservation.lsn();
+      reservation.complete();
+      return MSG_HEADER_LEN + len;
+    }
+  };
+
+public:
+  // 状态转换在segment表中原地完成, 被替换完的segment在替换稳定之后回收, 并优先重用低offset
+  static void accountant_test() {
+    SegmentAccountant accountant(segment_size);
+    const Lsn seg = static_cast<Lsn>(segment_size);
+    if (accountant.next(0) != 0) {
+      throw std::runtime_error("first segment should start at offset 0");
+    }
+    for (PageId pid = 0; pid < 100; ++pid) {
+      accountant.mark_replace(pid, pid + 1, {}, DiskPtr::new_inline(SEG_HEADER_LEN + pid));
+    }
+    if (accountant.next(seg) != segment_size || accountant.next(2 * seg) != 2 * segment_size) {
+      throw std::runtime_error("segments should be appended while nothing is free");
+    }
+    // 第一个segment的页面全部被第三个segment中的新版本替换
+    for (PageId pid = 0; pid < 100; ++pid) {
+      accountant.mark_replace(pid, 2 * seg + pid, {DiskPtr::new_inline(SEG_HEADER_LEN + pid)},
+                              DiskPtr::new_inline(2 * segment_size + SEG_HEADER_LEN + pid));
+    }
+    // 第二个segment没有页面, 自己稳定之后就可以回收
+    accountant.stabilize(2 * seg + 50);
+    if (accountant.free_count() != 1) {
+      throw std::runtime_error("segment freed before its replacements were stable");
+    }
+    accountant.stabilize(3 * seg - 1);
+    if (accountant.free_count() != 2 || accountant.next(3 * seg) != 0) {
+      throw std::runtime_error("drained segments were not reused");
+    }
+    std::cout << "Segment accountant ok." << std::endl;
+  }
+
+  // 同一个页面的link和替换它的replace从不同的线程(不同的分片)放进去, 必须按放进去的顺序应用.
+  // 线程按第一次写入轮流分到各个分片, 16个新线程占满所有分片, 主线程所在的分片一定和其中一些构成逆序,
+  // 两个方向都试一次: 先link后replace的记录总有一部分落在序号更小的分片里
+  static void mark_order_test() {
+    const Lsn seg = static_cast<Lsn>(segment_size);
+    const PageId pages = 16;
+    for (int fresh_links = 0; fresh_links < 2; ++fresh_links) {
+      SegmentAccountant accountant(segment_size);
+      accountant.next(0);
+      accountant.next(seg, 1); // replace的新版本写在另一个lane的segment中
+      auto old_ptr = [](PageId pid) { return DiskPtr::new_inline(SEG_HEADER_LEN + pid); };
+      auto link = [&](PageId pid) { accountant.mark_link(pid, old_ptr(pid)); };
+      auto replace = [&](PageId pid) {
+        accountant.mark_replace(pid, seg + SEG_HEADER_LEN + pid, {old_ptr(pid)},
+                                DiskPtr::new_inline(segment_size + SEG_HEADER_LEN + pid));
+      };
+      for (PageId pid = 0; pid < pages; ++pid) {
+        if (fresh_links) {
+          std::thread([&, pid]() { link(pid); }).join();
+        } else {
+          link(pid);
+        }
+      }
+      for (PageId pid = 0; pid < pages; ++pid) {
+        if (fresh_links) {
+          replace(pid);
+        } else {
+          std::thread([&, pid]() { replace(pid); }).join();
+        }
+      }
+      // 第一个segment失活时, 其中的页面都已经被替换
+      accountant.next(2 * seg);
+      accountant.stabilize(2 * seg - 1);
+      if (accountant.free_count() != 1) {
+        throw std::runtime_error("a stale link applied after its replace kept the segment alive");
+      }
+    }
+    std::cout << "Segment marks are applied in order." << std::endl;
+  }
+
+  // 冷页面只写一次, 热页面不断覆盖: 被覆盖完的segment直接回收, 冷页面所在的segment由cleaner重写后回收
+  static void cleaner_test() {
+    TestLogFile file("segment");
+
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    config.cleaner_interval_ms = 5;
+    config.cleaner_bytes_per_sec = 0;
+    auto accountant = std::make_shared<SegmentAccountant>(segment_size);
+    std::vector<Lsn> expected;
+    uint64_t rewritten = 0;
+    {
+      Log log(config, file.fd(), 0, 0, accountant);
+      Pages pages(log, *accountant, cold_pages + hot_pages);
+      SegmentCleaner cleaner(config, accountant, [&pages](PageId pid) { return pages.write(pid, 200); });
+
+      for (PageId pid = 0; pid < cold_pages; ++pid) {
+        pages.write(pid, 200);
+      }
+      std::vector<std::thread> threads;
+      for (auto thread_id = 0; thread_id < thread_number; ++thread_id) {
+        threads.emplace_back([&pages, thread_id]() {
+          std::mt19937_64 rnd(thread_id);
+          for (auto i = 0; i < writes_per_thread; ++i) {
+            pages.write(cold_pages + rnd() % hot_pages, 100 + rnd() % 200);
+          }
+        });
+      }
+      for (auto &t : threads)
+        t.join();
+      log.flush();
+
+      auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      while (cleaner.rewritten_pages() < cold_pages && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      rewritten = cleaner.rewritten_pages();
+      log.flush();
+      expected = pages.lsns;
+    }
+
+    if (rewritten < cold_pages) {
+      throw std::runtime_error("cleaner did not rewrite the cold segment");
+    }
+    // 不重用的话日志会增长到约 20MB
+    LogOffset len = static_cast<LogOffset>(file.size());
+    if (len > 64 * segment_size) {
+      throw std::runtime_error("freed segments were not reused, log is " + std::to_string(len) + " bytes");
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    for (PageId pid = 0; pid < expected.size(); ++pid) {
+      auto it = snapshot.pt.find(pid);
+      if (it == snapshot.pt.end() || it->second.base_.lsn != expected[pid]) {
+        throw std::runtime_error("recovered stale version of page " + std::to_string(pid));
+      }
+    }
+
+    // 重启之后从恢复结果重建accountant
+    SegmentAccountant restarted(segment_size);
+    restarted.initialize_from_snapshot(snapshot, len);
+    if (restarted.free_count() == 0 || restarted.space_amplification() > MAX_SPACE_AMPLIFICATION) {
+      throw std::runtime_error("accountant was not rebuilt from the snapshot");
+    }
+
+    std::cout << "Rewrote " << rewritten << " pages, log is " << len / segment_size << " segments" << std::endl;
+  }
+};
@@ -0,0 +1,303 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../pagecache/log.h"
+#include "../pagecache/pagecache.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/segment.h"
+#include "../serialize.h"
+#include "../util/psearch.h"
+#include "test_util.h"
+
+class CserializeTest final {
+
+private:
+  static constexpr size_t segment_size = 64 * 1024;
+
+  static tcs_t &tls() {
+    static thread_local tcs_t tid = DEFAULT_TCS_VAL;
+    return tid;
+  }
+
+  static std::string key_of(uint64_t i) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "key%08llu", static_cast<unsigned long long>(i));
+    return buf;
+  }
+
+  // chain[0] 是Node, 之后是Delta
+  static PageBuf merge(const std::vector<PageBufPtr> &chain) {
+    Node node = NodeView(chain[0]->data(), chain[0]->size()).to_node();
+    for (size_t i = 1; i < chain.size(); ++i) {
+      node.apply(Delta::deserialize(chain[i]->data(), chain[i]->size()));
+    }
+    return Serialize::to_vec(node);
+  }
+
+public:
+  // varint边界, 节点和增量的往返; NodeView不解析整个节点就能查找; 截断的数据被拒绝
+  static void format_test() {
+    for (uint64_t v : {uint64_t(0), uint64_t(127), uint64_t(128), uint64_t(16383), uint64_t(16384),
+                       uint64_t(1) << 35, UINT64_MAX}) {
+      unsigned char buf[Serialize::MAX_VARINT_LEN];
+      SliceMut out(buf, sizeof(buf));
+      Serialize::put_varint(out, v);
+      size_t len = sizeof(buf) - out.size();
+      const unsigned char *p = buf;
+      if (len != Serialize::varint_size(v) || Serialize::get_varint(p, buf + len) != v || p != buf + len) {
+        throw std::runtime_error("varint round trip failed for " + std::to_string(v));
+      }
+    }
+
+    std::mt19937_64 rnd(7);
+    Node leaf;
+    leaf.lo = key_of(0);
+    leaf.hi = key_of(100000);
+    leaf.next = 12345;
+    std::map<std::string, std::string> expected;
+    for (int i = 0; i < 1000; ++i) {
+      std::string key = key_of(rnd() % 100000);
+      std::string value(rnd() % 300, static_cast<char>('a' + i % 26));
+      leaf.apply(Delta::set(key, value));
+      expected[key] = value;
+    }
+    auto bytes = Serialize::to_vec(leaf);
+    NodeView view(bytes.data(), bytes.size());
+    if (view.is_index() || view.size() != expected.size() || view.next() != 12345 || !view.has_hi() ||
+        view.lo() != Slice(leaf.lo) || view.hi() != Slice(*leaf.hi)) {
+      throw std::runtime_error("node header was read back wrong");
+    }
+    for (auto &kv : expected) {
+      auto value = view.get(kv.first);
+      if (!value || *value != Slice(kv.second)) {
+        throw std::runtime_error("node view lost " + kv.first);
+      }
+    }
+    for (int i = 0; i < 1000; ++i) {
+      std::string key = key_of(rnd() % 100000) + "x";
+      if (view.get(key)) {
+        throw std::runtime_error("node view found a missing key");
+      }
+    }
+    if (view.beyond_hi(key_of(99999)) || !view.beyond_hi(key_of(100000))) {
+      throw std::runtime_error("node bounds were read back wrong");
+    }
+
+    Node index;
+    index.is_index = true;
+    for (PageId child = 0; child < 100; ++child) {
+      index.items.emplace_back(key_of(child * 1000), Node::encode_child((child + 2) << 30));
+    }
+    auto index_bytes = Serialize::to_vec(index);
+    NodeView index_view(index_bytes.data(), index_bytes.size());
+    if (!index_view.is_index() || index_view.has_hi() || index_view.child_for(key_of(0)) != PageId(2) << 30 ||
+        index_view.child_for(key_of(1500)) != PageId(3) << 30 ||
+        index_view.child_for(key_of(99999)) != PageId(101) << 30) {
+      throw std::runtime_error("index node routed to the wrong child");
+    }
+
+    Delta del = Delta::del(key_of(1));
+    auto delta_bytes = Serialize::to_vec(del);
+    Delta back = Delta::deserialize(delta_bytes.data(), delta_bytes.size());
+    if (back.kind != DeltaKind::Del || back.key != del.key) {
+      throw std::runtime_error("delta round trip failed");
+    }
+
+    bool rejected = false;
+    try {
+      NodeView truncated(bytes.data(), bytes.size() / 2);
+      for (size_t i = 0; i < truncated.size(); ++i) {
+        truncated.key(i);
+      }
+    } catch (const std::runtime_error &) {
+      rejected = true;
+    }
+    if (!rejected) {
+      throw std::runtime_error("truncated node was accepted");
+    }
+    std::cout << "Serialized " << expected.size() << " items into " << bytes.size() << " bytes" << std::endl;
+  }
+
+  // 各个SIMD实现和逐个比较的结果一致; 共同前缀, 头部相同, 互为前缀的key都能查到正确的位置
+  static void search_test() {
+    std::mt19937_64 rnd(11);
+    std::vector<psearch::SearchImpl> impls {psearch::SearchSoftware};
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+      impls.push_back(psearch::SearchSse42);
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      impls.push_back(psearch::SearchAvx2);
+    }
+#endif
+    for (size_t n = 0; n < 70; ++n) {
+      std::vector<u64> heads(n);
+      for (auto &h : heads) {
+        h = rnd() % 4 == 0 ? rnd() : rnd() % 64; // 包括最高位为1和大量重复的值
+      }
+      std::sort(heads.begin(), heads.end());
+      auto *bytes = reinterpret_cast<const unsigned char *>(heads.data());
+      for (int probes = 0; probes < 200; ++probes) {
+        u64 probe = probes % 2 == 0 ? rnd() % 70 : (n > 0 ? heads[rnd() % n] + rnd() % 3 - 1 : rnd());
+        size_t expected = std::lower_bound(heads.begin(), heads.end(), probe) - heads.begin();
+        for (auto impl : impls) {
+          if (psearch::count_fn(impl)(bytes, n, probe) != expected) {
+            throw std::runtime_error("head search " + std::to_string(impl) + " disagrees at n = " + std::to_string(n));
+          }
+        }
+      }
+    }
+
+    std::vector<std::string> shapes {"user/0000/", "", "abcdefghijklmnop/", std::string("a\0b", 3)};
+    for (auto &shape : shapes) {
+      std::vector<std::string> keys;
+      for (int i = 0; i < 600; ++i) {
+        std::string key = shape + std::to_string(rnd() % 3000);
+        if (i % 3 == 0) {
+          key = shape + "commonhead" + std::to_string(rnd() % 50); // 去掉前缀之后前8个字节相同
+        } else if (i % 7 == 0) {
+          key = key.substr(0, key.size() - 1) + std::string(1, '\0');
+        }
+        keys.push_back(key);
+      }
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      Node node;
+      for (auto &key : keys) {
+        node.items.emplace_back(key, key + "=v");
+      }
+      auto bytes = Serialize::to_vec(node);
+      NodeView view(bytes.data(), bytes.size());
+      if (view.size() != keys.size() || view.to_node().items != node.items) {
+        throw std::runtime_error("prefix compressed node round trip failed");
+      }
+      std::vector<std::string> probes = keys;
+      for (auto &key : keys) {
+        probes.push_back(key + "x");
+        probes.push_back(key.substr(0, key.size() / 2));
+        probes.push_back(key + std::string(1, '\0'));
+      }
+      probes.push_back("");
+      probes.push_back(std::string(20, '\xff'));
+      for (auto &probe : probes) {
+        size_t expected = std::lower_bound(keys.begin(), keys.end(), probe) - keys.begin();
+        if (view.lower_bound(probe) != expected) {
+          throw std::runtime_error("lower_bound is wrong for a key of length " + std::to_string(probe.size()));
+        }
+        auto value = view.get(probe);
+        bool found = expected < keys.size() && keys[expected] == probe;
+        if (found != value.has_value() || (found && *value != Slice(probe + "=v"))) {
+          throw std::runtime_error("get is wrong for a key of length " + std::to_string(probe.size()));
+        }
+      }
+    }
+
+    // 4KB左右的leaf上的点查
+    Node leaf;
+    for (int i = 0; i < 120; ++i) {
+      leaf.items.emplace_back(key_of(500000 + i * 37), std::string(16, 'v'));
+    }
+    auto bytes = Serialize::to_vec(leaf);
+    NodeView view(bytes.data(), bytes.size());
+    std::vector<std::string> probes;
+    for (int i = 0; i < 4440; ++i) {
+      probes.push_back(key_of(500000 + i));
+    }
+    const int lookups = 2000000;
+    size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < lookups; ++i) {
+      hits += view.get(probes[i % 4440]).has_value();
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    size_t expected_hits = 0;
+    for (int i = 0; i < lookups; ++i) {
+      expected_hits += i % 4440 % 37 == 0;
+    }
+    if (hits != expected_hits) {
+      throw std::runtime_error("point lookups missed keys in the leaf");
+    }
+    std::cout << "Leaf of " << bytes.size() << " bytes, prefix " << view.prefix().size() << " bytes, "
+              << elapsed.count() / lookups << " ns per lookup (impl " << psearch::best_impl() << ")" << std::endl;
+  }
+
+  // 节点和增量直接序列化进日志, 恢复之后的字节和单独序列化的结果一致, 可以直接用NodeView读
+  static void pagecache_test() {
+    TestLogFile file("serialize");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    const PageId pages = 32;
+    const int links = 25;
+    std::vector<PageId> pids;
+    std::vector<Node> expected(pages);
+    {
+      TestPageCache db(config, file, merge);
+      auto &log = db.log;
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < pages; ++i) {
+          expected[i].lo = key_of(i * 1000);
+          expected[i].hi = key_of((i + 1) * 1000);
+          pids.push_back(cache.allocate_serialized(guard, expected[i]));
+          Page *page = cache.get(guard, pids[i]);
+          if (*page->bufs[0] != Serialize::to_vec(expected[i])) {
+            throw std::runtime_error("cached copy differs from the serialized node");
+          }
+        }
+        for (int round = 0; round < links; ++round) {
+          for (PageId i = 0; i < pages; ++i) {
+            Delta delta = round % 5 == 4 ? Delta::del(key_of(i * 1000 + round - 1))
+                                       : Delta::set(key_of(i * 1000 + round), std::string(round + 1, 'v'));
+            expected[i].apply(delta);
+            Page *page = cache.get(guard, pids[i]);
+            if (cache.link_serialized(guard, pids[i], page, delta) == nullptr) {
+              throw std::runtime_error("link failed without contention");
+            }
+          }
+        }
+      }
+      cache.unregister_thread(tls());
+      log.flush();
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    {
+      TestPageCache db(config, file, snapshot, merge);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        for (PageId i = 0; i < pages; ++i) {
+          Page *page = cache.get(guard, pids[i]);
+          auto bytes = cache.materialize(*page);
+          if (*bytes != Serialize::to_vec(expected[i])) {
+            throw std::runtime_error("recovered node differs from the expected one");
+          }
+          NodeView view(bytes->data(), bytes->size());
+          if (view.size() != expected[i].items.size() || view.lo() != Slice(expected[i].lo)) {
+            throw std::runtime_error("recovered node was read back wrong");
+          }
+        }
+      }
+      cache.unregister_thread(tls());
+    }
+    std::cout << "Serialized pages ok." << std::endl;
+  }
+};
@@ -0,0 +1,209 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../pagecache/log.h"
+#include "../pagecache/pagecache.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/segment.h"
+#include "../tree.h"
+#include "test_util.h"
+
+class CtreeTest final {
+
+private:
+  static constexpr int writers = 4;
+  static constexpr int readers = 2;
+  static constexpr int keys_per_writer = 5000;
+  static constexpr size_t segment_size = 256 * 1024;
+
+  static tcs_t &tls() {
+    static thread_local tcs_t tid = DEFAULT_TCS_VAL;
+    return tid;
+  }
+
+  // 写者的key交错排列, 它们在同一批leaf上竞争
+  static std::string key_of(int writer, int i) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "key%08d", i * writers + writer);
+    return buf;
+  }
+
+  static std::string value_of(const std::string &key, uint64_t version) {
+    return key + "#" + std::to_string(version) + std::string(version % 40, 'v');
+  }
+
+  // 读回整棵树, 和expected逐项比较, scan 的顺序也要对
+  static void verify(Tree &tree, PageCache &cache, const std::map<std::string, std::string> &expected) {
+    auto guard = cache.pin(tls());
+    for (auto &kv : expected) {
+      auto value = tree.get(guard, kv.first);
+      if (!value || *value != kv.second) {
+        throw std::runtime_error("tree lost " + kv.first);
+      }
+    }
+    auto it = expected.begin();
+    tree.scan(guard, "", [&](const Slice &key, const Slice &value) {
+      if (it == expected.end() || key != Slice(it->first) || value != Slice(it->second)) {
+        throw std::runtime_error("scan returned " + key.ToString() + " out of order or unexpectedly");
+      }
+      ++it;
+      return true;
+    });
+    if (it != expected.end()) {
+      throw std::runtime_error("scan stopped before " + it->first);
+    }
+  }
+
+  // 写者并发插入, 改写, 再删掉大部分key, 读者同时检查从不修改的key; 返回最终应有的内容
+  static std::map<std::string, std::string> run(Tree &tree, PageCache &cache) {
+    std::map<std::string, std::string> fixed;
+    cache.register_thread(tls());
+    {
+      auto guard = cache.pin(tls());
+      for (int i = 0; i < 200; ++i) {
+        std::string key = "fixed" + std::to_string(i * 7919 % 1000);
+        fixed[key] = value_of(key, i);
+        tree.put(guard, key, fixed[key]);
+      }
+    }
+    cache.unregister_thread(tls());
+
+    std::vector<std::map<std::string, std::string>> expected(writers);
+    std::atomic<int> running(writers);
+    std::vector<std::thread> threads;
+    for (auto thread_id = 0; thread_id < writers; ++thread_id) {
+      threads.emplace_back([&, thread_id]() {
+        cache.register_thread(tls());
+        std::mt19937_64 rnd(thread_id);
+        auto &mine = expected[thread_id];
+        for (int round = 0; round < 3; ++round) {
+          for (int i = 0; i < keys_per_writer; ++i) {
+            auto guard = cache.pin(tls());
+            std::string key = key_of(thread_id, i);
+            bool drop = round == 2 && rnd() % 10 != 0;
+            if (drop) {
+              tree.del(guard, key);
+              mine.erase(key);
+            } else {
+              std::string value = value_of(key, rnd() % 1000);
+              tree.put(guard, key, value);
+              mine[key] = value;
+            }
+          }
+        }
+        cache.unregister_thread(tls());
+        running.fetch_sub(1);
+      });
+    }
+    for (auto thread_id = 0; thread_id < readers; ++thread_id) {
+      threads.emplace_back([&, thread_id]() {
+        cache.register_thread(tls());
+        std::mt19937_64 rnd(100 + thread_id);
+        while (running.load() > 0) {
+          auto it = fixed.begin();
+          std::advance(it, rnd() % fixed.size());
+          auto guard = cache.pin(tls());
+          auto value = tree.get(guard, it->first);
+          if (!value || *value != it->second) {
+            throw std::runtime_error("reader lost " + it->first + " during a structure change");
+          }
+        }
+        cache.unregister_thread(tls());
+      });
+    }
+    for (auto &t : threads)
+      t.join();
+
+    for (auto &mine : expected) {
+      fixed.insert(mine.begin(), mine.end());
+    }
+    return fixed;
+  }
+
+public:
+  // 并发写入让树分裂长高, 删除之后leaf合并; 读者一直能读到不变的key, 最后的内容和scan顺序都正确
+  static void concurrent_test() {
+    TestLogFile file("tree");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    {
+      TestPageCache db(config, file, Tree::merge);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      PageId root;
+      {
+        auto guard = cache.pin(tls());
+        root = Tree::create(cache, guard);
+      }
+      cache.unregister_thread(tls());
+      Tree tree(cache, root);
+      auto expected = run(tree, cache);
+      cache.register_thread(tls());
+      verify(tree, cache, expected);
+      cache.unregister_thread(tls());
+      if (tree.splits() == 0 || tree.merges() == 0) {
+        throw std::runtime_error("tree did not split or merge");
+      }
+      std::cout << "Tree holds " << expected.size() << " keys after " << tree.splits() << " splits and "
+                << tree.merges() << " merges, " << cache.freed_pages() << " pages freed" << std::endl;
+    }
+  }
+
+  // 恢复之后从同一个根读回相同的内容, 还能继续写
+  static void recovery_test() {
+    TestLogFile file("tree");
+    Inner config;
+    config.segment_size = segment_size;
+    config.flush_every_ms = 1;
+    PageId root;
+    std::map<std::string, std::string> expected;
+    {
+      TestPageCache db(config, file, Tree::merge, TestParts::Log);
+      auto &cache = db.cache;
+      cache.register_thread(tls());
+      {
+        auto guard = cache.pin(tls());
+        root = Tree::create(cache, guard);
+      }
+      cache.unregister_thread(tls());
+      Tree tree(cache, root);
+      expected = run(tree, cache);
+      db.log.flush();
+    }
+
+    Snapshot snapshot = Recovery::recover(config, file.fd(), 4);
+    {
+      TestPageCache db(config, file, snapshot, Tree::merge, TestParts::Log);
+      auto &cache = db.cache;
+      Tree tree(cache, root);
+      cache.register_thread(tls());
+      verify(tree, cache, expected);
+      {
+        auto guard = cache.pin(tls());
+        for (int i = 0; i < keys_per_writer; ++i) {
+          std::string key = key_of(0, i);
+          expected[key] = value_of(key, i);
+          tree.put(guard, key, expected[key]);
+        }
+      }
+      verify(tree, cache, expected);
+      cache.unregister_thread(tls());
+    }
+    std::cout << "Recovered tree with " << expected.size() << " keys." << std::endl;
+  }
+};
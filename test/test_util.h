@@ -0,0 +1,128 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../config.h"
+#include "../pagecache/compression.h"
+#include "../pagecache/heap.h"
+#include "../pagecache/io_unix.h"
+#include "../pagecache/log.h"
+#include "../pagecache/pagecache.h"
+#include "../pagecache/recovery.h"
+#include "../pagecache/segment.h"
+
+// 测试用的临时日志文件, 析构时关闭它并删除它和所有旁路文件: heap的slab, 压缩字典, 快照以及它们的临时文件
+class TestLogFile final {
+  NO_COPY_MOVE(TestLogFile);
+
+  std::string path_;
+  int fd_;
+
+public:
+  explicit TestLogFile(const std::string &name) : path_("/tmp/dels_" + name + "_XXXXXX") {
+    fd_ = ::mkstemp(&path_[0]);
+    if (fd_ < 0) {
+      throw std::runtime_error("mkstemp failed");
+    }
+  }
+
+  ~TestLogFile() {
+    ::close(fd_);
+    remove(path_);
+    for (SlabId id = 0; id < HEAP_SLAB_COUNT; ++id) {
+      remove(path_ + ".heap." + std::to_string(id));
+    }
+    for (size_t id = 1; id < COMPRESSION_MAX_DICTS; ++id) {
+      remove(path_ + ".dict." + std::to_string(id));
+      remove(path_ + ".dict." + std::to_string(id) + ".tmp");
+    }
+    remove(snapshot_path());
+    remove(snapshot_path() + ".tmp");
+  }
+
+  const std::string &path() const { return path_; }
+
+  int fd() const { return fd_; }
+
+  std::string snapshot_path() const { return path_ + ".snapshot"; }
+
+  uint64_t size() const {
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+      throw std::runtime_error("fstat failed");
+    }
+    return static_cast<uint64_t>(st.st_size);
+  }
+
+  // 用O_DIRECT重新打开
+  void reopen_direct() {
+    ::close(fd_);
+    fd_ = open_log_file(path_.c_str(), false, true);
+  }
+
+private:
+  static void remove(const std::string &path) { ::unlink(path.c_str()); }
+};
+
+// TestPageCache 带哪些部件, 后面的包含前面的
+enum class TestParts {
+  Log,      // 只有日志, segment不重用
+  Segments, // 加上SegmentAccountant, 被替换完的segment被回收重用
+  Heap,     // 再加上Heap, 大页面写进heap
+};
+
+// 一个日志文件上的 Heap, SegmentAccountant, Log 和 PageCache, 按声明的顺序构造, 反序析构
+struct TestPageCache final {
+  NO_COPY_MOVE(TestPageCache);
+
+  std::shared_ptr<Heap> heap;
+  std::shared_ptr<SegmentAccountant> accountant;
+  Log log;
+  PageCache cache;
+
+  // 从空文件开始
+  TestPageCache(const Inner &config, const TestLogFile &file, MergeFn merge, TestParts parts = TestParts::Segments)
+      : heap(make_heap(config, file, parts)), accountant(make_accountant(config, heap, parts)),
+        log(config, file.fd(), 0, 0, accountant), cache(config, log, accountant, heap, std::move(merge)) {}
+
+  // 重启: 从恢复的结果继续
+  TestPageCache(const Inner &config, const TestLogFile &file, const Snapshot &snapshot, MergeFn merge,
+                TestParts parts = TestParts::Segments)
+      : heap(make_heap(config, file, parts)), accountant(recovered_accountant(config, file, snapshot, heap, parts)),
+        log(config, file.fd(), snapshot.next_offset, snapshot.next_lsn, accountant),
+        cache(config, log, accountant, heap, std::move(merge)) {
+    cache.load_snapshot(snapshot);
+  }
+
+private:
+  static std::shared_ptr<Heap> make_heap(const Inner &config, const TestLogFile &file, TestParts parts) {
+    if (parts != TestParts::Heap) {
+      return nullptr;
+    }
+    return std::make_shared<Heap>(file.path(), config.heap_punch_on_free);
+  }
+
+  static std::shared_ptr<SegmentAccountant> make_accountant(const Inner &config, const std::shared_ptr<Heap> &heap,
+                                                            TestParts parts) {
+    if (parts == TestParts::Log) {
+      return nullptr;
+    }
+    return std::make_shared<SegmentAccountant>(config.segment_size, heap, config.cleanup_threshold);
+  }
+
+  static std::shared_ptr<SegmentAccountant> recovered_accountant(const Inner &config, const TestLogFile &file,
+                                                                 const Snapshot &snapshot,
+                                                                 const std::shared_ptr<Heap> &heap, TestParts parts) {
+    auto accountant = make_accountant(config, heap, parts);
+    if (accountant) {
+      accountant->initialize_from_snapshot(snapshot, static_cast<LogOffset>(file.size()));
+    }
+    return accountant;
+  }
+};
@@ -5,11 +5,13 @@
 #include <queue>
 #include <condition_variable>
 #include <mutex>
+#include <vector>
 // #include <lock
 
 class ThreadPool {
 public:
   ThreadPool(size_t pool_nums);
+  ~ThreadPool();
   void enqueue(std::function<void()> work);
   void shutdown();
 
@@ -22,13 +24,13 @@ private:
   std::mutex queue_mutex_;
 };
 
-ThreadPool::ThreadPool(size_t pool_nums) : stop_(false) {
+inline ThreadPool::ThreadPool(size_t pool_nums) : stop_(false) {
   for (size_t i = 0; i < pool_nums; i ++) {
     workers_.emplace_back([this] { this->worker();});
   }
 }
 
-void ThreadPool::enqueue(std::function<void ()> work) {
+inline void ThreadPool::enqueue(std::function<void ()> work) {
   {
     std::scoped_lock<std::mutex> lock(queue_mutex_);
     work_queues_.emplace(work);
@@ -36,7 +38,7 @@ void ThreadPool::enqueue(std::function<void ()> work) {
   cv_.notify_one();
 }
 
-void ThreadPool::worker() {
+inline void ThreadPool::worker() {
   while (true) {
       std::function<void()> work;
       {
@@ -50,4 +52,23 @@ void ThreadPool::worker() {
       }
       work();
   }
-}
\ No newline at end of file
+}
+
+// 执行完队列中剩余的任务后退出
+inline void ThreadPool::shutdown() {
+  {
+    std::scoped_lock<std::mutex> lock(queue_mutex_);
+    if (stop_) {
+      return;
+    }
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto &worker : workers_) {
+    worker.join();
+  }
+}
+
+inline ThreadPool::~ThreadPool() {
+  shutdown();
+}
@@ -1,8 +1 @@
 #include "tree.h"
-#include "pagecache/pagecache.h"
-
-
-struct View {
-  NodeView node_view;
-  PageId pid;
-};
\ No newline at end of file
@@ -0,0 +1,449 @@
+#pragma once
+
+/*
+Tree: 建在PageCache上的有序KV索引, 无锁的B-link树, leaf上的修改是Bw-tree式的delta
+
+节点是serialize.h的Node, 每个节点负责 [lo, hi), next 指向右兄弟. 节点在PageCache中是一个页面:
+  leaf: 基准页加上link上去的Delta, 链过长时PageCache用 Tree::merge 合并成新的基准页
+  index: 条目是 (分隔键, 子页面id), 第一个条目的key等于lo. 只在分裂和合并时修改, 直接replace整个节点
+结构的修改(分裂, 合并)都是对单个页面的一次replace, 依靠PageCache的CAS保证原子, 没有锁.
+读者只读它拿到的那个版本, 版本在guard内一直有效, 所以读者从不等待写者.
+
+查找: 从根往下, 每一层 key >= hi 时沿着next向右走. 父节点中还没有对应索引项的右兄弟也能这样找到.
+
+分裂(节点合并之后超过TREE_NODE_SPLIT_BYTES):
+  1. 右半部分写进一个新页面, 这时它还不可见
+  2. replace左半部分, hi 改成分隔键, next 指向新页面. CAS失败时新页面留着下次分裂用
+  3. 在上一层负责分隔键的index节点中插入索引项; 插入之前的查找经过左半部分的next到达
+根的pid固定不变: 根分裂时两半都写进新页面, 根replace成指向它们的index节点, 树长高一层.
+
+合并(leaf合并之后小于TREE_NODE_MERGE_BYTES, 只合并leaf):
+  1. 给节点N做一个标记了merged_into(左兄弟L)的冻结版本, 之后没有人再修改N
+  2. replace L, 吸收N的条目, hi 和 next 改成N的
+  3. 删除父节点中N的索引项. N是父节点第一个孩子时保留, 经过它的查找转到L
+遇到冻结的N时: 写者先帮助完成步骤2再重试; 读者看L有没有吸收N, 没有的话N冻结的内容仍然是最新的.
+
+释放页面:
+  分裂失败留下的新页面从来没有被别人看到过, 直接用PageCache::free释放.
+  并入的节点在步骤3删掉父节点中的索引项之后, 新的查找就找不到它了, 用free_later等拿着旧版本的读者离开之后再释放.
+  索引项删不掉(已经是父节点的第一个孩子)时不释放. 释放之前先帮冻结着指向它的右兄弟完成合并.
+  冻结的节点上的merged_into和next仍然可能指向已经释放的页面(重启之后还可能被重用), 沿着它们走时检查
+  找到的是不是key左边的leaf, 不是的话从最左边的leaf向右找.
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "pagecache/pagecache.h"
+#include "serialize.h"
+#include "slice.h"
+
+// 节点的一个版本, 在guard析构之前有效. node_view 只看基准页, leaf的delta在page->bufs[1..]中
+struct View {
+  NodeView node_view;
+  PageId pid;
+  Page *page;
+};
+
+class Tree {
+  NO_COPY_MOVE(Tree);
+
+public:
+  using Guard = PageCache::Guard;
+
+private:
+  PageCache &cache_;
+  PageId root_;
+  std::atomic<uint64_t> splits_;
+  std::atomic<uint64_t> merges_;
+
+  static View make_view(PageId pid, Page *page) {
+    return View {NodeView(page->bufs[0]->data(), page->bufs[0]->size()), pid, page};
+  }
+
+  View load(const Guard &guard, PageId pid) {
+    Page *page = cache_.get(guard, pid);
+    if (page == nullptr) {
+      throw std::logic_error("tree page " + std::to_string(pid) + " does not exist");
+    }
+    return make_view(pid, page);
+  }
+
+  Node node_of(const View &view) const {
+    auto bytes = cache_.materialize(*view.page);
+    return NodeView(bytes->data(), bytes->size()).to_node();
+  }
+
+  PageId new_page(const Guard &guard, const Node &node) {
+    return cache_.allocate_serialized(guard, node);
+  }
+
+  // 分裂失败留下的页面. 只有cleaner会同时重写它, 失败时读新的版本重试
+  void give_back(const Guard &guard, PageId pid) {
+    while (!cache_.free(guard, pid, cache_.get(guard, pid))) {
+    }
+  }
+
+  // 冻结的节点上的merged_into或next, 指向的页面可能已经释放. 找到的不是key左边的leaf时从最左边的leaf开始
+  View follow(const Guard &guard, PageId pid, const Slice &key) {
+    if (Page *page = cache_.get(guard, pid)) {
+      View view = make_view(pid, page);
+      if (view.node_view.level() == 0 && !view.node_view.is_index() && key.compare(view.node_view.lo()) >= 0) {
+        return view;
+      }
+    }
+    View view = load(guard, root_);
+    while (view.node_view.level() > 0) {
+      view = load(guard, view.node_view.child(0));
+    }
+    return view;
+  }
+
+  // 从view出发向右走到负责key的节点. 返回false表示key在view的lo左边(路由来自旧版本), 调用者从根重新开始
+  // 停在冻结的节点上时, 它的内容仍然是这个范围最新的, 但是不能修改
+  bool move_right(const Guard &guard, View &view, const Slice &key) {
+    while (true) {
+      const NodeView &node = view.node_view;
+      if (key.compare(node.lo()) < 0) {
+        return false;
+      }
+      if (node.beyond_hi(key)) {
+        view = node.merged_into() == 0 ? load(guard, node.next()) : follow(guard, node.next(), key);
+        continue;
+      }
+      if (node.merged_into() == 0) {
+        return true;
+      }
+      // 正在并入左兄弟. 左兄弟可能已经分裂, 向右找到next指向这里的那个, 或者已经覆盖key的那个
+      View left = follow(guard, node.merged_into(), node.lo());
+      while (true) {
+        if (left.node_view.merged_into() != 0) {
+          finish_merge(guard, left); // 左兄弟自己也在并入, 帮忙完成, 之后吸收它的节点覆盖它的范围
+          left = follow(guard, left.node_view.merged_into(), left.node_view.lo());
+        } else if (left.node_view.next() == view.pid) {
+          return true; // 还没有被吸收
+        } else if (left.node_view.beyond_hi(key)) {
+          left = load(guard, left.node_view.next());
+        } else {
+          break;
+        }
+      }
+      view = left;
+    }
+  }
+
+  // 负责key的那一层节点
+  View descend(const Guard &guard, const Slice &key, u32 level) {
+    while (true) {
+      View view = load(guard, root_);
+      if (view.node_view.level() < level) {
+        throw std::logic_error("tree is lower than level " + std::to_string(level));
+      }
+      while (move_right(guard, view, key)) {
+        if (view.node_view.level() == level) {
+          return view;
+        }
+        view = load(guard, view.node_view.child_for(key));
+      }
+    }
+  }
+
+  // leaf中key的最新值: 先从新到旧看delta, 再看基准页
+  static std::optional<std::string> lookup(const View &view, const Slice &key) {
+    auto &bufs = view.page->bufs;
+    for (size_t i = bufs.size(); i-- > 1;) {
+      Delta delta = Delta::deserialize(bufs[i]->data(), bufs[i]->size());
+      if (Slice(delta.key) == key) {
+        if (delta.kind == DeltaKind::Set) {
+          return std::move(delta.value);
+        }
+        return std::nullopt;
+      }
+    }
+    auto value = view.node_view.get(key);
+    if (!value) {
+      return std::nullopt;
+    }
+    return value->ToString();
+  }
+
+  static bool too_big(const Page &page) {
+    return page.bufs.size() == 1 && page.bufs[0]->size() > TREE_NODE_SPLIT_BYTES;
+  }
+
+  void update(const Guard &guard, const Delta &delta) {
+    while (true) {
+      View leaf = descend(guard, delta.key, 0);
+      if (leaf.node_view.merged_into() != 0) {
+        finish_merge(guard, leaf);
+        continue;
+      }
+      // 上一次分裂输给了并发的link. 先帮忙分裂, 否则热点leaf上的link一直让分裂失败, 节点越长越大
+      if (leaf.page->bufs[0]->size() > TREE_NODE_SPLIT_BYTES && split(guard, leaf)) {
+        continue;
+      }
+      Page *page = cache_.link_serialized(guard, leaf.pid, leaf.page, delta);
+      if (page == nullptr) {
+        continue;
+      }
+      // 链刚被合并成一个基准页时顺便检查大小
+      if (too_big(*page)) {
+        split(guard, make_view(leaf.pid, page));
+      } else if (page->bufs.size() == 1 && delta.kind == DeltaKind::Del) {
+        maybe_merge(guard, make_view(leaf.pid, page));
+      }
+      return;
+    }
+  }
+
+  // 节点不需要分裂时返回false, 否则尝试一次(CAS可能失败)之后返回true
+  bool split(const Guard &guard, const View &view) {
+    Node node = node_of(view);
+    if (node.merged_into != 0 || node.items.size() < 2 || node.serialized_size() <= TREE_NODE_SPLIT_BYTES) {
+      return false;
+    }
+    size_t mid = node.items.size() / 2;
+    Node right;
+    right.is_index = node.is_index;
+    right.level = node.level;
+    right.lo = node.items[mid].first;
+    right.hi = node.hi;
+    right.next = node.next;
+    right.items.assign(node.items.begin() + mid, node.items.end());
+    node.items.resize(mid);
+    node.hi = right.lo;
+    PageId right_pid = new_page(guard, right);
+    node.next = right_pid;
+
+    if (view.pid == root_) {
+      PageId left_pid = new_page(guard, node);
+      Node root;
+      root.is_index = true;
+      root.level = node.level + 1;
+      root.items.emplace_back(node.lo, Node::encode_child(left_pid));
+      root.items.emplace_back(right.lo, Node::encode_child(right_pid));
+      if (cache_.replace_serialized(guard, root_, view.page, root) == nullptr) {
+        give_back(guard, left_pid);
+        give_back(guard, right_pid);
+        return true;
+      }
+      splits_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+
+    if (cache_.replace_serialized(guard, view.pid, view.page, node) == nullptr) {
+      give_back(guard, right_pid);
+      return true;
+    }
+    splits_.fetch_add(1, std::memory_order_relaxed);
+    install_term(guard, node.level + 1, right.lo, right_pid);
+    return true;
+  }
+
+  // 在level层负责sep的index节点中插入 sep -> child
+  void install_term(const Guard &guard, u32 level, const std::string &sep, PageId child) {
+    std::string encoded = Node::encode_child(child);
+    while (true) {
+      View parent = descend(guard, sep, level);
+      Node node = node_of(parent);
+      auto it = std::lower_bound(node.items.begin(), node.items.end(), sep,
+                                 [](const std::pair<std::string, std::string> &item, const std::string &key) {
+                                   return item.first < key;
+                                 });
+      if (it != node.items.end() && it->first == sep) {
+        if (it->second == encoded) {
+          return;
+        }
+        it->second = encoded; // 留给并入节点的旧索引项, 两个都能找到, 指向新的少走一步
+      } else {
+        node.items.emplace(it, sep, encoded);
+      }
+      Page *page = cache_.replace_serialized(guard, parent.pid, parent.page, node);
+      if (page == nullptr) {
+        continue;
+      }
+      if (too_big(*page)) {
+        split(guard, make_view(parent.pid, page));
+      }
+      return;
+    }
+  }
+
+  // 太小的leaf并入左兄弟. 只在父节点中它的索引项已经存在, 而且不是第一个孩子时才做
+  void maybe_merge(const Guard &guard, const View &view) {
+    if (view.pid == root_ || view.node_view.is_index() || view.node_view.lo().empty() ||
+        view.node_view.merged_into() != 0) {
+      return;
+    }
+    Node node = node_of(view);
+    if (node.serialized_size() >= TREE_NODE_MERGE_BYTES) {
+      return;
+    }
+    View parent = descend(guard, node.lo, 1);
+    const NodeView &index = parent.node_view;
+    size_t i = index.lower_bound(node.lo);
+    if (i == 0 || i == index.size() || index.key(i) != node.lo || index.child(i) != view.pid) {
+      return;
+    }
+    View left = load(guard, index.child(i - 1));
+    while (left.node_view.merged_into() == 0 && left.node_view.next() != view.pid) {
+      if (!left.node_view.beyond_hi(node.lo)) {
+        return;
+      }
+      left = load(guard, left.node_view.next());
+    }
+    if (left.node_view.merged_into() != 0 || node_of(left).serialized_size() + node.serialized_size() >=
+                                                 TREE_NODE_SPLIT_BYTES) {
+      return;
+    }
+    node.merged_into = left.pid;
+    Page *page = cache_.replace_serialized(guard, view.pid, view.page, node);
+    if (page != nullptr) {
+      finish_merge(guard, make_view(view.pid, page));
+    }
+  }
+
+  // 让冻结的节点被左边的节点吸收, 可能已经有人完成了
+  void finish_merge(const Guard &guard, const View &removed) {
+    Node victim = node_of(removed);
+    View left = follow(guard, victim.merged_into, victim.lo);
+    while (true) {
+      const NodeView &node = left.node_view;
+      if (node.merged_into() != 0) {
+        finish_merge(guard, left);
+        left = follow(guard, node.merged_into(), node.lo());
+        continue;
+      }
+      if (node.next() == removed.pid) {
+        Node merged = node_of(left);
+        merged.items.insert(merged.items.end(), victim.items.begin(), victim.items.end());
+        merged.hi = victim.hi;
+        merged.next = victim.next;
+        if (cache_.replace_serialized(guard, left.pid, left.page, merged) != nullptr) {
+          merges_.fetch_add(1, std::memory_order_relaxed);
+          if (remove_term(guard, victim.lo, removed.pid)) {
+            release(guard, removed.pid, victim);
+          }
+          return;
+        }
+        left = load(guard, left.pid);
+        continue;
+      }
+      if (!node.beyond_hi(victim.lo)) {
+        return; // 已经吸收
+      }
+      left = load(guard, node.next());
+    }
+  }
+
+  // 新的查找已经找不到并入的节点, 等拿着旧版本的读者离开之后释放它.
+  // 右兄弟可能在它冻结之前也冻结了, 并且merged_into指向它, 先帮右兄弟完成合并; 右兄弟的索引项删不掉时就不释放
+  void release(const Guard &guard, PageId pid, const Node &victim) {
+    Page *page = victim.next != 0 ? cache_.get(guard, victim.next) : nullptr;
+    if (page != nullptr) {
+      View right = make_view(victim.next, page);
+      if (right.node_view.merged_into() == pid) {
+        finish_merge(guard, right);
+        if (has_term(guard, right.node_view.lo().ToString(), right.pid)) {
+          return;
+        }
+      }
+    }
+    cache_.free_later(guard, pid);
+  }
+
+  // level 1 中负责lo的节点是否还有指向child的索引项
+  bool has_term(const Guard &guard, const std::string &lo, PageId child) {
+    View parent = descend(guard, lo, 1);
+    const NodeView &index = parent.node_view;
+    size_t i = index.lower_bound(lo);
+    return i < index.size() && index.key(i) == lo && index.child(i) == child;
+  }
+
+  // 删掉了索引项时返回true. 索引项不存在, 或者是父节点的第一个孩子时返回false
+  bool remove_term(const Guard &guard, const std::string &lo, PageId child) {
+    while (true) {
+      View parent = descend(guard, lo, 1);
+      Node node = node_of(parent);
+      auto it = std::lower_bound(node.items.begin(), node.items.end(), lo,
+                                 [](const std::pair<std::string, std::string> &item, const std::string &key) {
+                                   return item.first < key;
+                                 });
+      if (it == node.items.end() || it->first != lo || Node::decode_child(it->second) != child || lo == node.lo) {
+        return false;
+      }
+      node.items.erase(it);
+      if (cache_.replace_serialized(guard, parent.pid, parent.page, node) != nullptr) {
+        return true;
+      }
+    }
+  }
+
+public:
+  // root 是 create 返回的页面
+  Tree(PageCache &cache, PageId root) : cache_(cache), root_(root), splits_(0), merges_(0) {}
+
+  // 给PageCache用的MergeFn
+  static PageBuf merge(const std::vector<PageBufPtr> &chain) {
+    Node node = NodeView(chain[0]->data(), chain[0]->size()).to_node();
+    for (size_t i = 1; i < chain.size(); ++i) {
+      node.apply(Delta::deserialize(chain[i]->data(), chain[i]->size()));
+    }
+    return Serialize::to_vec(node);
+  }
+
+  // 分配一棵空树的根
+  static PageId create(PageCache &cache, const Guard &guard) {
+    return cache.allocate_serialized(guard, Node());
+  }
+
+  PageId root() const {
+    return root_;
+  }
+
+  std::optional<std::string> get(const Guard &guard, const Slice &key) {
+    return lookup(descend(guard, key, 0), key);
+  }
+
+  void put(const Guard &guard, std::string key, std::string value) {
+    update(guard, Delta::set(std::move(key), std::move(value)));
+  }
+
+  void del(const Guard &guard, std::string key) {
+    update(guard, Delta::del(std::move(key)));
+  }
+
+  // 按key的顺序访问 >= start 的条目, fn 返回false时停止. 每个leaf读的是同一个版本, leaf之间不保证
+  void scan(const Guard &guard, const std::string &start, const std::function<bool(const Slice &, const Slice &)> &fn) {
+    std::string from = start;
+    while (true) {
+      View leaf = descend(guard, from, 0);
+      auto bytes = cache_.materialize(*leaf.page);
+      NodeView node(bytes->data(), bytes->size());
+      for (size_t i = node.lower_bound(from); i < node.size(); ++i) {
+        if (!fn(node.key(i), node.value(i))) {
+          return;
+        }
+      }
+      if (!node.has_hi()) {
+        return;
+      }
+      from = node.hi().ToString();
+    }
+  }
+
+  uint64_t splits() const {
+    return splits_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t merges() const {
+    return merges_.load(std::memory_order_relaxed);
+  }
+};
@@ -1,9 +1,262 @@
 #pragma once
-#include <zlib.h>
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
 
-uint32_t crc32_buf(const unsigned char *buf, size_t len) {
-  auto crc_res = ::crc32(0, buf, len);
-  return (crc_res ^ 0xffffffff);
-}
\ No newline at end of file
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli), 日志消息/segment头部/快照文件的校验和
+//
+// x86_64上优先使用SSE4.2的crc32指令:
+//   - 长缓冲区切成3段同时计算, 隐藏crc32指令3个周期的延迟
+//   - 3段的结果需要把前面的crc"平移"过后面的长度再异或, 有PCLMUL时用一次无进位乘法完成, 否则用查表的软件乘法
+// 其他平台使用slice-by-8查表
+//
+// 流式接口 Crc32c 可以分多次喂数据, 消息头和负载不需要拼接在一起
+
+namespace pcrc {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78; // 反射形式
+
+// 3路交错的块大小, 长缓冲区先按LONG处理, 剩余部分再按SHORT处理
+constexpr size_t CRC_LONG = 8192;
+constexpr size_t CRC_SHORT = 256;
+
+struct Tables {
+  uint32_t slice[8][256];
+  // 软件平移用的 x^(8n) mod P, n 为 CRC_LONG 或 CRC_SHORT
+  uint32_t long_shift;
+  uint32_t short_shift;
+  // PCLMUL平移用的 x^(8n-33) mod P, 多出来的x^33由乘法结果的位置和crc32指令补上
+  uint32_t long_clmul;
+  uint32_t short_clmul;
+};
+
+// 反射形式下的 x^n mod P
+inline uint32_t xpow_mod(size_t n) {
+  uint32_t p = 0x80000000; // x^0
+  while (n-- > 0) {
+    p = (p & 1) ? (p >> 1) ^ CRC32C_POLY : p >> 1;
+  }
+  return p;
+}
+
+// 反射形式下的 a * b mod P
+inline uint32_t mult_mod(uint32_t a, uint32_t b) {
+  uint32_t m = 0x80000000;
+  uint32_t p = 0;
+  while (a != 0) {
+    if (a & m) {
+      p ^= b;
+      a ^= m;
+    }
+    m >>= 1;
+    b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+  }
+  return p;
+}
+
+inline const Tables &tables() {
+  static const Tables t = [] {
+    Tables t;
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int k = 0; k < 8; ++k) {
+        crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+      }
+      t.slice[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+      for (int k = 1; k < 8; ++k) {
+        t.slice[k][i] = (t.slice[k - 1][i] >> 8) ^ t.slice[0][t.slice[k - 1][i] & 0xFF];
+      }
+    }
+    t.long_shift = xpow_mod(8 * CRC_LONG);
+    t.short_shift = xpow_mod(8 * CRC_SHORT);
+    t.long_clmul = xpow_mod(8 * CRC_LONG - 33);
+    t.short_clmul = xpow_mod(8 * CRC_SHORT - 33);
+    return t;
+  }();
+  return t;
+}
+
+// 以下的update都直接操作crc寄存器, 不做初始值和结果的取反
+
+inline uint32_t update_sw(uint32_t crc, const unsigned char *p, size_t len) {
+  const Tables &t = tables();
+  while (len > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc = (crc >> 8) ^ t.slice[0][(crc ^ *p++) & 0xFF];
+    --len;
+  }
+  while (len >= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    word ^= crc;
+    crc = t.slice[7][word & 0xFF] ^ t.slice[6][(word >> 8) & 0xFF] ^ t.slice[5][(word >> 16) & 0xFF] ^
+          t.slice[4][(word >> 24) & 0xFF] ^ t.slice[3][(word >> 32) & 0xFF] ^ t.slice[2][(word >> 40) & 0xFF] ^
+          t.slice[1][(word >> 48) & 0xFF] ^ t.slice[0][word >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while (len-- > 0) {
+    crc = (crc >> 8) ^ t.slice[0][(crc ^ *p++) & 0xFF];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2,pclmul"))) inline uint32_t shift_clmul(uint32_t crc, uint32_t k) {
+  __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128(static_cast<int>(crc)),
+                                         _mm_cvtsi32_si128(static_cast<int>(k)), 0);
+  return static_cast<uint32_t>(_mm_crc32_u64(0, static_cast<uint64_t>(_mm_cvtsi128_si64(product))));
+}
+
+struct ClmulShift {
+  static constexpr bool interleave_short = true;
+  uint32_t operator()(uint32_t crc, bool long_block) const {
+    const Tables &t = tables();
+    return shift_clmul(crc, long_block ? t.long_clmul : t.short_clmul);
+  }
+};
+
+// 软件平移比较慢, 只用于LONG块
+struct SoftShift {
+  static constexpr bool interleave_short = false;
+  uint32_t operator()(uint32_t crc, bool long_block) const {
+    const Tables &t = tables();
+    return mult_mod(long_block ? t.long_shift : t.short_shift, crc);
+  }
+};
+
+__attribute__((target("sse4.2"))) inline uint32_t update_hw_serial(uint32_t crc, const unsigned char *p, size_t len) {
+  while (len > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+    --len;
+  }
+  uint64_t crc64 = crc;
+  while (len >= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    len -= 8;
+  }
+  crc = static_cast<uint32_t>(crc64);
+  while (len-- > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+
+// 3段各block字节同时计算, 然后 crc = shift(shift(crc0) ^ crc1) ^ crc2
+template <typename Shift>
+__attribute__((target("sse4.2"))) inline uint32_t update_hw_3way(uint32_t crc, const unsigned char *&p, size_t &len,
+                                                                 size_t block, bool long_block, Shift shift) {
+  while (len >= 3 * block) {
+    uint64_t crc0 = crc;
+    uint64_t crc1 = 0;
+    uint64_t crc2 = 0;
+    const unsigned char *end = p + block;
+    do {
+      uint64_t w0, w1, w2;
+      std::memcpy(&w0, p, 8);
+      std::memcpy(&w1, p + block, 8);
+      std::memcpy(&w2, p + 2 * block, 8);
+      crc0 = _mm_crc32_u64(crc0, w0);
+      crc1 = _mm_crc32_u64(crc1, w1);
+      crc2 = _mm_crc32_u64(crc2, w2);
+      p += 8;
+    } while (p < end);
+    crc = shift(static_cast<uint32_t>(crc0), long_block) ^ static_cast<uint32_t>(crc1);
+    crc = shift(crc, long_block) ^ static_cast<uint32_t>(crc2);
+    p += 2 * block;
+    len -= 3 * block;
+  }
+  return crc;
+}
+
+template <typename Shift>
+__attribute__((target("sse4.2"))) inline uint32_t update_hw(uint32_t crc, const unsigned char *p, size_t len) {
+  // 对齐之后再进入交错循环
+  size_t head = (8 - (reinterpret_cast<uintptr_t>(p) & 7)) & 7;
+  if (head > len) {
+    head = len;
+  }
+  crc = update_hw_serial(crc, p, head);
+  p += head;
+  len -= head;
+  crc = update_hw_3way(crc, p, len, CRC_LONG, true, Shift());
+  if (Shift::interleave_short) {
+    crc = update_hw_3way(crc, p, len, CRC_SHORT, false, Shift());
+  }
+  return update_hw_serial(crc, p, len);
+}
+
+#endif
+
+using UpdateFn = uint32_t (*)(uint32_t, const unsigned char *, size_t);
+
+enum CrcImpl {
+  CrcSoftware,
+  CrcSse42,
+  CrcSse42Clmul,
+};
+
+inline UpdateFn update_fn(CrcImpl impl) {
+#if defined(__x86_64__)
+  if (impl == CrcSse42Clmul) {
+    return update_hw<ClmulShift>;
+  }
+  if (impl == CrcSse42) {
+    return update_hw<SoftShift>;
+  }
+#endif
+  (void)impl;
+  return update_sw;
+}
+
+// 当前CPU上最快的实现
+inline CrcImpl best_impl() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.2")) {
+    return __builtin_cpu_supports("pclmul") ? CrcSse42Clmul : CrcSse42;
+  }
+#endif
+  return CrcSoftware;
+}
+
+inline uint32_t update(uint32_t crc, const unsigned char *p, size_t len) {
+  static const UpdateFn fn = update_fn(best_impl());
+  return fn(crc, p, len);
+}
+
+} // namespace pcrc
+
+// 流式计算, 结果与一次性计算整个缓冲区相同
+class Crc32c {
+  uint32_t state_ = 0xFFFFFFFF;
+
+public:
+  Crc32c &update(const unsigned char *buf, size_t len) {
+    state_ = pcrc::update(state_, buf, len);
+    return *this;
+  }
+
+  uint32_t finish() const {
+    return ~state_;
+  }
+};
+
+inline uint32_t crc32c(const unsigned char *buf, size_t len) {
+  return ~pcrc::update(0xFFFFFFFF, buf, len);
+}
+
+// 所有持久化数据的校验和
+inline uint32_t crc32_buf(const unsigned char *buf, size_t len) {
+  return crc32c(buf, len);
+}
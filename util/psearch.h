@@ -0,0 +1,109 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+// 在有序的u64数组(树节点中key的定长头部, 见serialize.h)中数出小于probe的个数, 也就是lower_bound的位置
+//
+// x86_64上按CPU选择实现:
+//   - AVX2 一次比较4个, SSE4.2 一次比较2个. 没有无符号64位比较, 两边都异或符号位之后用有符号比较
+//   - 数组有序, 一组中出现不小于probe的元素就可以停下
+// 其他平台逐个比较
+// 数组不要求对齐, 直接在序列化的字节上使用
+
+namespace psearch {
+
+constexpr uint64_t SIGN_BIT = 0x8000000000000000ULL;
+
+inline uint64_t load_u64(const unsigned char *p) {
+  uint64_t v;
+  std::memcpy(&v, p, 8);
+  return v;
+}
+
+inline size_t count_less_sw(const unsigned char *heads, size_t n, uint64_t probe) {
+  size_t i = 0;
+  while (i < n && load_u64(heads + 8 * i) < probe) {
+    ++i;
+  }
+  return i;
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("sse4.2"))) inline size_t count_less_sse42(const unsigned char *heads, size_t n,
+                                                                 uint64_t probe) {
+  const __m128i sign = _mm_set1_epi64x(static_cast<long long>(SIGN_BIT));
+  const __m128i key = _mm_xor_si128(_mm_set1_epi64x(static_cast<long long>(probe)), sign);
+  size_t i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(heads + 8 * i)), sign);
+    int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(key, v)));
+    if (mask != 0x3) {
+      return i + __builtin_popcount(mask);
+    }
+  }
+  return i + count_less_sw(heads + 8 * i, n - i, probe);
+}
+
+__attribute__((target("avx2"))) inline size_t count_less_avx2(const unsigned char *heads, size_t n, uint64_t probe) {
+  const __m256i sign = _mm256_set1_epi64x(static_cast<long long>(SIGN_BIT));
+  const __m256i key = _mm256_xor_si256(_mm256_set1_epi64x(static_cast<long long>(probe)), sign);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(heads + 8 * i)), sign);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(key, v)));
+    if (mask != 0xF) {
+      return i + __builtin_popcount(mask);
+    }
+  }
+  return i + count_less_sw(heads + 8 * i, n - i, probe);
+}
+
+#endif
+
+using CountFn = size_t (*)(const unsigned char *, size_t, uint64_t);
+
+enum SearchImpl {
+  SearchSoftware,
+  SearchSse42,
+  SearchAvx2,
+};
+
+inline CountFn count_fn(SearchImpl impl) {
+#if defined(__x86_64__)
+  if (impl == SearchAvx2) {
+    return count_less_avx2;
+  }
+  if (impl == SearchSse42) {
+    return count_less_sse42;
+  }
+#endif
+  (void)impl;
+  return count_less_sw;
+}
+
+// 当前CPU上最快的实现
+inline SearchImpl best_impl() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return SearchAvx2;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    return SearchSse42;
+  }
+#endif
+  return SearchSoftware;
+}
+
+inline size_t count_less(const unsigned char *heads, size_t n, uint64_t probe) {
+  static const CountFn fn = count_fn(best_impl());
+  return fn(heads, n, probe);
+}
+
+} // namespace psearch